@@ -11,6 +11,8 @@ var SS = SpreadsheetApp.openById('enter_spreadsheet_ID_here');
 var sheet = SS.getSheetByName('Sheet1');        // creates sheet class for Sheet1
 var sheet2 = SS.getSheetByName('Calculations'); // creates sheet class for Calculations sheet
 var str = "";
+var max_run_time = 600000;      // longest run time accepted for one event (ms, twice error_time in the Arduino code)
+var config_cache_time = 21600; // how long the config may stay cached (seconds, 6 hours is the longest CacheService allows, edits to the Calculations sheet clear it straight away)
 
 function doPost(e) {
 
@@ -18,65 +20,132 @@ function doPost(e) {
   var result = {};
   
   try { 
-    parsedData = JSON.parse(e.postData.contents);
+    parsedData = decode_batch(e.postData.contents); // the body is a base64 encoded batch (see decode_batch below)
   } 
   catch(f){
     return ContentService.createTextOutput("Error in parsing request body: " + f.message);
   }
    
   if (parsedData !== undefined){
-    var flag = parsedData.format; 
-    if (flag === undefined){
-      flag = 0;
-    }
-    
-    var dataArr = parsedData.values.split(","); // creates an array of the values taken from Arduino code
-    
     var date_now = Utilities.formatDate(new Date(), "CST", "yyyy/MM/dd"); // gets the current date
     var time_now = Utilities.formatDate(new Date(), "CST", "hh:mm a");    // gets the current time
     
-    var value0 = dataArr [0]; // run_total variable from Arduino code
+    var value0 = parsedData.duration; // total run time of the batch in ms (run_total in the Arduino code)
+    
+    var start_time = Date.now(); // used to log how long the spreadsheet reads and writes take
+    
+    var config = get_config();                            // config values from the cache (only read from the Calculations sheet after it has been edited)
+    var conversion_factor = config.values['conversion'];  // conversion factor (Calculations sheet B1)
+    var gallons;
+    var logged;                                           // number after the last event logged (the Arduino only removes the batch once this matches)
     
     
-    // read and execute command from the "payload_base" string from Arduino code
+    // read and execute the command from the batch header sent by the Arduino code
     switch (parsedData.command) {
       
       case "insert_row":
-                  
-         var range = sheet.getRange("A2:D2");
-         range.insertCells(SpreadsheetApp.Dimension.ROWS); // insert cells just above the existing data instead of inserting an entire row
          
-         sheet.getRange('A2').setValue(date_now);  // publish current date into Sheet1 cell A2
-         sheet2.getRange('B3').setValue(date_now); // publish current date into Calculations sheet cell B3
-         sheet.getRange('B2').setValue(time_now);  // publish current time into Sheet1 cell B2 
-         sheet.getRange('C2').setValue(value0);    // publish run_total to Sheet1 cell C2
-         
-         var ounces  = ((sheet.getRange('C2').getValue() ) * sheet2.getRange('B1').getValue() ) / 1000 * 128; // calculate how many ounces used based on the conversion factor (from Calculations sheet B1) and run time (from Sheet1 C2)
-         sheet.getRange('D2').setValue(ounces);   // publish ounces used to Sheet1 cell D2
+         var lock = LockService.getScriptLock(); // the total is read and updated by one request at a time so no rows are missed
+         lock.waitLock(10000);
+         try {
+           gallons = total_gallons(); // read before this row is added in case the total has to be loaded from the sheet
+           
+           var ounces = (value0 * conversion_factor) / 1000 * 128; // calculate how many ounces used based on the conversion factor (from Calculations sheet B1) and run time
+           if (parsedData.pulses !== undefined) {
+             ounces = parsedData.pulses * 128 / parsedData.pulses_per_gallon; // use the ounces measured by the flow meter instead (only sent when a flow meter is installed)
+           }
+           sheet.appendRow([date_now, time_now, value0, ounces]); // add current date, current time, run_total, and ounces used to the end of the log in Sheet1 (no existing rows are moved)
+           sheet2.getRange('B3').setValue(date_now);               // publish current date into Calculations sheet cell B3
+           
+           gallons = gallons + ounces / 128; // keep the total up to date here instead of reading the sheet-wide formula in Calculations sheet B2 again
+           PropertiesService.getScriptProperties().setProperty('gallons', String(gallons));
+           add_to_rollups([[date_now, time_now, value0, ounces]]);
+           logged = parsedData.end;
+         }
+         finally {
+           lock.releaseLock();
+         }
          
          //str = "Data published"; // string to return back to serial console
-         SpreadsheetApp.flush();
          break;     
        
+      case "insert_events": // every event in the batch gets its own row, all written in one call
+         
+         var lock = LockService.getScriptLock(); // batches are checked and logged by one request at a time so a retry cannot log the same events twice
+         lock.waitLock(10000);
+         try {
+           gallons = total_gallons();
+           var properties = PropertiesService.getScriptProperties();
+           var last_batch = JSON.parse(properties.getProperty('last_batch') || 'null'); // event numbers covered by the last batch that was logged
+           var rows = [];
+           var skipped = 0;
+           var rejected = 0;
+           var total_ounces = 0;
+           for (var i = 0; i < parsedData.events.length; i++) {
+             var event = parsedData.events[i];
+             // skip events already logged by an earlier try of this batch (event numbers only go back if the event log on the Arduino was reset)
+             if (last_batch !== null && parsedData.first >= last_batch.first && event.sequence < last_batch.end) {
+               skipped++;
+               continue;
+             }
+             var problem = event_problem(event, parsedData);
+             if (problem !== "") {
+               console.log("event " + event.sequence + " rejected: " + problem);
+               rejected++;
+               continue;
+             }
+             var event_ounces = (event.duration * conversion_factor) / 1000 * 128; // calculate how many ounces used based on the conversion factor (from Calculations sheet B1) and run time
+             if (event.pulses !== undefined) {
+               event_ounces = event.pulses * 128 / parsedData.pulses_per_gallon; // use the ounces measured by the flow meter instead (only sent when a flow meter is installed)
+             }
+             var plausible = event.start > 1500000000 && event.start * 1000 < Date.now() + 86400000;
+             var when = (event.synced || (event.synced === undefined && plausible)) ? new Date(event.start * 1000) : new Date(); // events saved before the clock was synced are logged at the time they arrive
+             rows.push([Utilities.formatDate(when, "CST", "yyyy/MM/dd"), Utilities.formatDate(when, "CST", "hh:mm a"), event.duration, event_ounces]);
+             total_ounces += event_ounces;
+           }
+           
+           if (rows.length > 0) {
+             sheet.getRange(sheet.getLastRow() + 1, 1, rows.length, 4).setValues(rows); // add all of the events to the end of the log in Sheet1 in one call
+             sheet2.getRange('B3').setValue(date_now);                                   // publish current date into Calculations sheet cell B3
+             gallons = gallons + total_ounces / 128;
+             properties.setProperty('gallons', String(gallons));
+             add_to_rollups(rows);
+           }
+           if (last_batch === null || parsedData.first < last_batch.first || parsedData.end > last_batch.end) {
+             properties.setProperty('last_batch', JSON.stringify({'first': parsedData.first, 'end': parsedData.end}));
+           }
+           logged = parsedData.end; // events skipped or rejected are done with too
+         }
+         finally {
+           lock.releaseLock();
+         }
+         console.log("events " + parsedData.first + " to " + (parsedData.end - 1) + ": " + rows.length + " logged, " + skipped + " already logged, " + rejected + " rejected");
+         break;
+       
+      case "get_config": // only check for config changes, nothing is written to the spreadsheet
+         gallons = total_gallons();
+         break;
+       
     }
     
+    console.log("doPost " + parsedData.command + ": " + (Date.now() - start_time) + " ms"); // check the execution log to see how long each request spends in the spreadsheet
+    
     // return data to Arduino
     //return ContentService.createTextOutput(str);
     
   // return data to Arduino
   var return_json = {
-    'gallons':          sheet2.getRange('B2').getValue(),  // total gallons used
-    'conversion':       sheet2.getRange('B1').getValue(),  // conversion factor being used
-    'target':           sheet2.getRange('B13').getValue(), // daily target in ounces
-    'filter':           sheet2.getRange('B18').getValue(), // what gallon value to change the filter
-    'a':                sheet2.getRange('B21').getValue(), // ounces to automatically dispense (function 1)
-    'b':                sheet2.getRange('B22').getValue(), // ounces to automatically dispense (function 2)
-    'c':                sheet2.getRange('B23').getValue(), // ounces to automatically dispense (function 3)
-    'd':                sheet2.getRange('B24').getValue(), // ounces to automatically dispense (function 4)
-    'e':                sheet2.getRange('B25').getValue(), // ounces to automatically dispense (function 5)
-    'afterhours_start': sheet2.getRange('B28').getValue(), // afterhours start time (hour from 0 to 23 where 23 would be 11pm and 0 would be midnight)
-    'afterhours_stop':  sheet2.getRange('B29').getValue()  // afterhours start time (hour from 0 to 23 where 23 would be 11pm and 0 would be midnight)
-  }; 
+    'gallons':          gallons,          // total gallons used (always sent since it changes with every insert)
+    'version':          config.version
+  };
+  if (logged !== undefined) {
+    return_json['logged'] = logged;   // only sent once the batch has been written to the spreadsheet
+  }
+  if (parsedData.config !== return_json.version) { // only send the config values if they have changed since the version the Arduino already has
+    for (var key in config.values) {
+      return_json[key] = config.values[key];
+    }
+  }
   return ContentService.createTextOutput(JSON.stringify(return_json)).setMimeType(ContentService.MimeType.JSON); // convert json to a string and send back to Arduino
   //return ContentService.createTextOutput("some text");
     
@@ -87,3 +156,269 @@ function doPost(e) {
   }
     
 }
+
+
+// Decodes a batch sent by the Arduino (base64 of the binary format written by start_publish_batch() in main_v3.cpp)
+// Numbers are varints: 7 bits per byte, least significant first, with the high bit set on every byte but the last
+function decode_batch(contents) {
+  var bytes = Utilities.base64Decode(contents);
+  var pos = 0;
+  function next_byte() {
+    if (pos >= bytes.length) {
+      throw new Error("batch is too short");
+    }
+    return bytes[pos++] & 0xff; // base64Decode gives signed bytes
+  }
+  function next_varint() {
+    var value = 0;
+    var scale = 1;
+    var b;
+    do {
+      b = next_byte();
+      value += (b & 0x7f) * scale;
+      scale *= 128;
+    } while (b & 0x80);
+    return value;
+  }
+  
+  var format = next_byte();
+  if (format !== 2 && format !== 3) { // format 2 has no synced flag in the mode
+    throw new Error("unknown batch format " + format);
+  }
+  var batch = {};
+  batch.command = ["get_config", "insert_row", "insert_events"][next_byte()];
+  var flow_meter = (next_byte() & 1) !== 0;
+  var version_length = next_byte();
+  batch.config = "";
+  for (var i = 0; i < version_length; i++) {
+    batch.config += String.fromCharCode(next_byte());
+  }
+  if (batch.command === "get_config") {
+    return batch;
+  }
+  
+  if (flow_meter) {
+    batch.pulses_per_gallon = next_varint();
+  }
+  batch.first = next_varint();                 // number of the first event
+  batch.end = batch.first + next_varint();     // number after the last event (events that could not be read on the Arduino are left out)
+  var count = next_varint();
+  batch.duration = next_varint();              // total run time (ms)
+  if (flow_meter) {
+    batch.pulses = next_varint();              // total flow meter pulses
+  }
+  batch.events = [];
+  var start = 0;
+  var sequence = batch.first;
+  for (var n = 0; n < count; n++) {
+    sequence += next_varint(); // skip the events that were left out just before this one
+    var change = next_varint();
+    start += (change % 2) ? -(change + 1) / 2 : change / 2; // start time is the zigzag encoded change from the last event
+    var event = {'sequence': sequence++, 'start': start, 'duration': next_varint(), 'mode': next_byte()};
+    if (format >= 3) {
+      event.synced = (event.mode & 0x80) !== 0; // was the clock synced when the event was saved?
+      event.mode = event.mode & 0x7f;
+    }
+    if (flow_meter) {
+      event.pulses = next_varint();
+    }
+    batch.events.push(event);
+  }
+  return batch;
+}
+
+
+// Returns the config values and their version, from the cache if the Calculations sheet has not been edited since they were last read
+function get_config() {
+  var cache = CacheService.getScriptCache();
+  var cached = cache.get('config');
+  if (cached !== null) {
+    return JSON.parse(cached);
+  }
+  
+  // read the whole config block from the Calculations sheet (B1:B29) in one call instead of reading each cell separately
+  var config = sheet2.getRange('B1:B29').getValues();
+  var config_values = {
+    'conversion':       config[0][0],     // conversion factor being used (B1)
+    'target':           config[12][0],    // daily target in ounces (B13)
+    'filter':           config[17][0],    // what gallon value to change the filter (B18)
+    'a':                config[20][0],    // ounces to automatically dispense (function 1) (B21)
+    'b':                config[21][0],    // ounces to automatically dispense (function 2) (B22)
+    'c':                config[22][0],    // ounces to automatically dispense (function 3) (B23)
+    'd':                config[23][0],    // ounces to automatically dispense (function 4) (B24)
+    'e':                config[24][0],    // ounces to automatically dispense (function 5) (B25)
+    'afterhours_start': config[27][0],    // afterhours start time (hour from 0 to 23 where 23 would be 11pm and 0 would be midnight) (B28)
+    'afterhours_stop':  config[28][0]     // afterhours start time (hour from 0 to 23 where 23 would be 11pm and 0 would be midnight) (B29)
+  };
+  var result = {'values': config_values, 'version': config_version(config_values)};
+  cache.put('config', JSON.stringify(result), config_cache_time);
+  return result;
+}
+
+
+// Returns the total gallons used, kept in the script properties and updated as rows are added
+// (only read from Calculations sheet B2 the first time, or after Sheet1 has been edited by hand)
+function total_gallons() {
+  var properties = PropertiesService.getScriptProperties();
+  var gallons = properties.getProperty('gallons');
+  if (gallons === null) {
+    gallons = sheet2.getRange('B2').getValue();
+    properties.setProperty('gallons', String(gallons));
+  }
+  return Number(gallons);
+}
+
+
+// Returns the Daily or Monthly rollup sheet, adding it with a header row if it does not exist yet
+function rollup_sheet(name, period) {
+  var rollup = SS.getSheetByName(name);
+  if (rollup === null) {
+    rollup = SS.insertSheet(name);
+    rollup.appendRow([period, 'Entries', 'Run Time (ms)', 'Ounces', 'Gallons']);
+  }
+  return rollup;
+}
+
+
+// Adds rows of the log (date, time, run time, ounces) to the rows for their day (Daily sheet) and month (Monthly sheet)
+// The running totals for the current day and month are kept in the script properties with the row they are on, so each day or month in the rows writes
+// one row of each table without reading or searching the sheets (a new row is started at the bottom of the table when the day or month changes)
+function add_to_rollups(rows) {
+  var properties = PropertiesService.getScriptProperties();
+  var rollups = JSON.parse(properties.getProperty('rollups') || '{}');
+  rollups.day = add_to_rollup(rollup_sheet('Daily', 'Date'), rollups.day, rows, 10);
+  rollups.month = add_to_rollup(rollup_sheet('Monthly', 'Month'), rollups.month, rows, 7);
+  properties.setProperty('rollups', JSON.stringify(rollups));
+}
+
+
+// Adds rows of the log to the running totals for one period (the key is the start of the date, key_length characters long), returns the updated total
+// (a row from before the current period is added to the current period, rebuild_rollups() puts it in the right place)
+function add_to_rollup(rollup_sheet, rollup, rows, key_length) {
+  var changed = false;
+  for (var i = 0; i < rows.length; i++) {
+    var key = rows[i][0].substring(0, key_length);
+    if (rollup === undefined || key > rollup.key) {
+      if (changed) {
+        write_rollup(rollup_sheet, rollup);
+      }
+      rollup = {'key': key, 'row': rollup_sheet.getLastRow() + 1, 'entries': 0, 'run_time': 0, 'ounces': 0};
+    }
+    rollup.entries += 1;
+    rollup.run_time += Number(rows[i][2]);
+    rollup.ounces += rows[i][3];
+    changed = true;
+  }
+  if (changed) {
+    write_rollup(rollup_sheet, rollup);
+  }
+  return rollup;
+}
+
+
+// Writes the row of a rollup table for one day or month
+function write_rollup(rollup_sheet, rollup) {
+  rollup_sheet.getRange(rollup.row, 1, 1, 5).setValues([["'" + rollup.key, rollup.entries, rollup.run_time, rollup.ounces, rollup.ounces / 128]]); // key is written as text so the sheet does not turn it into a date
+}
+
+
+// Returns why an event sent by the Arduino cannot be logged, or an empty string if it can
+function event_problem(event, batch) {
+  if (!(event.duration > 0 && event.duration <= max_run_time)) {
+    return "run time out of range (" + event.duration + " ms)";
+  }
+  if (event.mode > 2) {
+    return "unknown dispense mode " + event.mode;
+  }
+  if (event.pulses !== undefined && !(batch.pulses_per_gallon > 0)) {
+    return "flow meter pulses per gallon missing";
+  }
+  return "";
+}
+
+
+// Rebuilds the Daily and Monthly sheets from the whole log in Sheet1 (run this by hand from the script editor after editing the log)
+function rebuild_rollups() {
+  var lock = LockService.getScriptLock();
+  lock.waitLock(30000);
+  try {
+    var last_row = sheet.getLastRow();
+    var rows = (last_row > 1) ? sheet.getRange(2, 1, last_row - 1, 4).getValues() : [];
+    var tables = {'day': {}, 'month': {}};
+    var keys = {'day': [], 'month': []};
+    for (var i = 0; i < rows.length; i++) {
+      var date = rows[i][0];
+      if (date === '') {
+        continue;
+      }
+      if (date instanceof Date) {
+        date = Utilities.formatDate(date, "CST", "yyyy/MM/dd");
+      }
+      var ounces = Number(rows[i][3]);
+      var period_keys = {'day': String(date), 'month': String(date).substring(0, 7)};
+      for (var period in period_keys) {
+        var key = period_keys[period];
+        if (tables[period][key] === undefined) {
+          tables[period][key] = {'key': key, 'entries': 0, 'run_time': 0, 'ounces': 0};
+          keys[period].push(key);
+        }
+        tables[period][key].entries += 1;
+        tables[period][key].run_time += Number(rows[i][2]);
+        tables[period][key].ounces += ounces;
+      }
+    }
+    
+    var rollups = {};
+    var names = {'day': ['Daily', 'Date'], 'month': ['Monthly', 'Month']};
+    for (var period in names) {
+      var table_sheet = rollup_sheet(names[period][0], names[period][1]);
+      if (table_sheet.getLastRow() > 1) {
+        table_sheet.getRange(2, 1, table_sheet.getLastRow() - 1, 5).clearContent();
+      }
+      keys[period].sort(); // log rows may not be in date order (rows used to be added at the top)
+      var values = keys[period].map(function(key) {
+        var rollup = tables[period][key];
+        return ["'" + key, rollup.entries, rollup.run_time, rollup.ounces, rollup.ounces / 128]; // same columns as write_rollup()
+      });
+      if (values.length > 0) {
+        table_sheet.getRange(2, 1, values.length, 5).setValues(values);
+        var last = tables[period][keys[period][keys[period].length - 1]];
+        last.row = values.length + 1;
+        rollups[period] = last;
+      }
+    }
+    var properties = PropertiesService.getScriptProperties();
+    properties.setProperty('rollups', JSON.stringify(rollups));
+    properties.deleteProperty('gallons'); // read again from Calculations sheet B2 on the next request
+  }
+  finally {
+    lock.releaseLock();
+  }
+}
+
+
+// Runs when the spreadsheet is edited by hand (rows written by doPost do not run it)
+// Clears the cached config when the Calculations sheet changes, and the running total when the log in Sheet1 changes so it is read again from B2
+// (the Daily and Monthly sheets are not rebuilt automatically since that reads the whole log, run rebuild_rollups() once the edits are done)
+// (a simple trigger only runs if this script is bound to the spreadsheet, otherwise add an installable "On edit" trigger for this function)
+function onEdit(e) {
+  var name = e.range.getSheet().getName();
+  if (name === 'Calculations') {
+    CacheService.getScriptCache().remove('config');
+  }
+  else if (name === 'Sheet1') {
+    PropertiesService.getScriptProperties().deleteProperty('gallons');
+  }
+}
+
+
+// Returns a short version string for the config values that changes whenever any of the values change
+function config_version(config_values) {
+  var digest = Utilities.computeDigest(Utilities.DigestAlgorithm.MD5, JSON.stringify(config_values));
+  var version = "";
+  for (var i = 0; i < 4; i++) {
+    var hex = (digest[i] & 0xff).toString(16);
+    version += (hex.length < 2 ? "0" : "") + hex;
+  }
+  return version;
+}
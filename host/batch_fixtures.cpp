@@ -0,0 +1,153 @@
+// Host tool: writes batches encoded by the dispenser itself (start_publish_batch() and write_base64()) to a JSON file, each with the
+// values the Google Sheets script should decode it to, for test_sheets.js: batch_fixtures <file>
+
+#include "../main_v3.cpp"
+#include "test.h"
+
+const char *const command_names[] = {"get_config", "insert_row", "insert_events"};
+FILE *fixtures;
+int fixture_count = 0;
+
+
+// Collects what is printed to it
+struct text_print : public Print {
+  std::string text;
+  size_t write(uint8_t data) override {
+    text += (char)data;
+    return 1;
+  }
+};
+
+
+// Start a fixture with the base64 body of an encoded batch and the values in its header
+void begin_fixture(const char *name, const uint8_t *data, size_t length, batch_commands command) {
+  text_print body;
+  write_base64(body, data, length);
+  fprintf(fixtures, "%s\n  \"%s\": {\"body\": \"%s\", \"command\": \"%s\", \"config\": \"%s\"",
+          fixture_count++ == 0 ? "" : ",", name, body.text.c_str(), command_names[command], config_version);
+}
+
+
+// Encode the events from unsent_event (or the running totals if there is no event log) and write the batch with the values it should decode to
+void write_batch_fixture(const char *name) {
+  sinks_pending = 0; // the batch is only encoded, never sent
+  publish_state = publish_idle;
+  start_publish_batch();
+  begin_fixture(name, batch_data + batch_offset, batch_length, event_log_ready ? command_insert_events : command_insert_row);
+  fprintf(fixtures, ", \"first\": %u, \"end\": %u, \"duration\": %lu", batch_start, batch_end, (unsigned long)published_total);
+  if (flow_meter_installed) {fprintf(fixtures, ", \"pulses_per_gallon\": %u, \"pulses\": %lu", flow_pulses_per_gallon, (unsigned long)published_pulses);}
+  fprintf(fixtures, ", \"events\": [");
+  dispense_event event;
+  int count = 0;
+  for (uint32_t sequence = batch_start; event_log_ready && sequence < batch_end; sequence++) {
+    if (!read_event(sequence, event)) {continue;} // left out of the batch
+    fprintf(fixtures, "%s{\"sequence\": %u, \"start\": %u, \"duration\": %u, \"mode\": %u, \"synced\": %s", count++ == 0 ? "" : ", ",
+            event.sequence, event.start, event.duration, (unsigned int)(event.mode & ~event_synced), (event.mode & event_synced) ? "true" : "false");
+    if (flow_meter_installed) {fprintf(fixtures, ", \"pulses\": %u", (unsigned int)event.pulses);}
+    fprintf(fixtures, "}");
+  }
+  fprintf(fixtures, "]}");
+}
+
+
+// Save an event as if the valve had been opened at start (unix time)
+void log_event_at(time_t start, unsigned long duration, dispense_modes mode, uint32_t pulses = 0) {
+  setTime(start + duration / 1000);
+  log_event(duration, mode, pulses);
+}
+
+
+// Change the event number saved in the log for an event, so it can no longer be read (like an event whose part of the file was not written)
+void damage_event(uint32_t sequence) {
+  char name[16];
+  event_file_name(name, sequence);
+  event_file.close();
+  File file = LittleFS.open(name, "r");
+  std::vector<uint8_t> data(file.size());
+  file.read(data.data(), data.size());
+  file.close();
+  data[(sequence % events_per_segment) * sizeof(dispense_event)] ^= 0xff;
+  file = LittleFS.open(name, "w");
+  file.write(data.data(), data.size());
+  file.close();
+}
+
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    printf("usage: batch_fixtures <file>\n");
+    return 2;
+  }
+  fixtures = fopen(argv[1], "w");
+  if (fixtures == nullptr) {
+    printf("could not write %s\n", argv[1]);
+    return 1;
+  }
+  sim_wifi_up = false;
+  begin_dispenser();
+  strcpy(config_version, "a1b2c3d4");
+  time_synced = true; // events are saved with their start time from the NTP server (setTime() is called before each one, so synced_clock() is not used)
+  time_t t0 = 1700000000; // 2023/11/14 16:13 CST
+  fprintf(fixtures, "{");
+
+  uint8_t header[batch_header_room];
+  begin_fixture("get_config", header, encode_batch_header(header, command_get_config), command_get_config);
+  fprintf(fixtures, "}");
+
+  // one event of each mode, with start times that go back as well as forward
+  log_event_at(t0, 1200, dispense_sensor);
+  log_event_at(t0 + 60, 3400, dispense_button);
+  log_event_at(t0 + 30, 250, dispense_sensor); // the clock was set back
+  log_event_at(t0 + 2 * 86400, 5000, dispense_auto);
+  write_batch_fixture("events");
+
+  // the same batch sent again once another event has been saved (the script only logs the new one)
+  log_event_at(t0 + 2 * 86400 + 600, 1500, dispense_button);
+  write_batch_fixture("events_retry");
+
+  // numbers that take several bytes
+  unsent_event = next_event;
+  log_event_at(t0 + 400000000, 600000, dispense_sensor);
+  log_event_at(t0, 16384, dispense_button);
+  write_batch_fixture("large_numbers");
+
+  // an event that cannot be read is left out
+  unsent_event = next_event;
+  for (int i = 0; i < 4; i++) {log_event_at(t0 + 3600 + i * 60, 1000 + i, dispense_sensor);}
+  damage_event(unsent_event + 1);
+  write_batch_fixture("left_out");
+
+  // flow meter pulses
+  unsent_event = next_event;
+  flow_meter_installed = true;
+  log_event_at(t0 + 7200, 4000, dispense_auto, 532);
+  log_event_at(t0 + 7300, 900, dispense_sensor, 120);
+  write_batch_fixture("flow_meter");
+  flow_meter_installed = false;
+
+  // the last day of a month into the next, and the day after (CST)
+  unsent_event = next_event;
+  log_event_at(1701409800, 2000, dispense_sensor); // 2023/11/30 11:50 PM
+  log_event_at(1701411000, 3000, dispense_button); // 2023/12/01 12:10 AM
+  write_batch_fixture("month_end");
+  unsent_event = next_event;
+  log_event_at(1701511200, 4000, dispense_sensor); // 2023/12/02 04:00 AM
+  write_batch_fixture("next_day");
+
+  // events saved before the time was synced (their start times are counted from compile time, so the script logs them when they arrive)
+  unsent_event = next_event;
+  time_synced = false;
+  log_event_at(t0 + 86400, 1800, dispense_sensor);
+  write_batch_fixture("unsynced");
+  time_synced = true;
+
+  // no event log, the running total is sent as one row
+  event_log_ready = false;
+  run_total = 12345;
+  write_batch_fixture("insert_row");
+
+  fprintf(fixtures, "\n}\n");
+  fclose(fixtures);
+  printf("%d batches written to %s\n", fixture_count, argv[1]);
+  return check_failures == 0 ? 0 : 1;
+}
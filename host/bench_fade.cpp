@@ -0,0 +1,87 @@
+// Host benchmark: CPU cycles to draw one LED fade frame, the old pow() curve with per-pixel color names against draw_leds() and its fade tables
+// (the ESP8266 has no FPU, so pow() costs far more there than on the host, the host numbers only show the relative cost of the work per frame)
+// Also checks that the tables give the same brightness as the old curve at every step, and fails if they do not.
+
+#include "../main_v3.cpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <chrono>
+
+#define bench_frames      200000
+
+
+// Cycle counter of the host CPU (nanoseconds where there is no cycle counter)
+uint64_t host_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+
+// ----- The fade frame as it was drawn before the fade tables (pow() for every frame and a String compare for every pixel) -----
+
+float R = (pwm_intervals * log10(2)) / (log10(255)); // used to calculate the 'R' value for fading LEDs
+uint32_t old_frame[led_count];
+
+
+// Brightness of a fade step on the old curve
+int old_brightness(int step, bool dimmed) {
+  int brightness = pow(2, (step / R)) - 1;
+  if (dimmed) {brightness = brightness / dim_factor;}
+  return brightness;
+}
+
+
+void old_set_pixel(int j, int red, int green, int blue) {
+  old_frame[j] = rgb_color(red, green, blue);
+}
+
+
+void old_draw_leds(const String &color, int step) {
+  int brightness = old_brightness(step, afterhours);
+  for (int j = 0; j < led_count; j++) {
+    if (color == "blue")   {old_set_pixel(j, 0, 0, brightness);}
+    if (color == "red")    {old_set_pixel(j, brightness, 0, 0);}
+    if (color == "green")  {old_set_pixel(j, 0, brightness, 0);}
+    if (color == "purple") {old_set_pixel(j, brightness, 0, brightness);}
+    if (color == "orange") {old_set_pixel(j, brightness * 0.75, brightness * 0.25, 0);}
+  }
+  hal_show_leds(old_frame, led_count);
+}
+
+
+// Step through fade in and fade out of every color, returns cycles per frame
+template <class F> double time_frames(F draw) {
+  uint64_t start = host_cycles();
+  int step = 0;
+  int direction = 1;
+  for (long frame = 0; frame < bench_frames; frame++) {
+    draw(frame / (2 * pwm_intervals) % 5, step);
+    step += direction;
+    if (step == pwm_intervals || step == 0) {direction = -direction;}
+  }
+  return (double)(host_cycles() - start) / bench_frames;
+}
+
+
+int main() {
+  const char *const color_names[] = {"blue", "red", "green", "purple", "orange"};
+  int mismatches = 0;
+  for (int step = 0; step <= pwm_intervals; step++) {
+    if (fade_levels.level[step] != old_brightness(step, false)) {mismatches++;}
+    if (fade_levels_dimmed.level[step] != old_brightness(step, true)) {mismatches++;}
+  }
+
+  for (int dimmed = 0; dimmed < 2; dimmed++) {
+    afterhours = dimmed;
+    double old_cycles = time_frames([&](int color, int step) {old_draw_leds(color_names[color], step);});
+    double new_cycles = time_frames([](int color, int step) {draw_leds((led_color)color, step);});
+    printf("fade frame (%s): pow() and color names %.0f cycles, fade tables %.0f cycles (%.1fx)\n",
+           dimmed ? "afterhours" : "full brightness", old_cycles, new_cycles, old_cycles / new_cycles);
+  }
+  printf("fade table steps that differ from the old curve: %d\n", mismatches);
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+// Host scenario runner: open, close and loop latency (p50, p99 and max) while the dispenser does the things that have made it slow to respond
+// Run with no arguments for every scenario, or with the names of the scenarios to run. Each scenario runs on a fresh dispenser in its own
+// process, and prints its numbers in the same format as the 'l' command on the serial monitor, so a run on the device can be compared with it.
+
+#include "../main_v3.cpp"
+#include "test.h"
+#include "sim_script.h"
+#include <algorithm>
+#include <sys/wait.h>
+#include <unistd.h>
+
+sim_google_script script;
+
+
+// Every sample of a latency measurement taken during a scenario (the dispenser only keeps the most recent latency_samples)
+struct scenario_stats {
+  const latency_stats *stats;
+  unsigned long seen;
+  std::vector<unsigned long> samples;
+};
+
+scenario_stats scenario_latency[] = {{&open_latency, 0, {}}, {&close_latency, 0, {}}, {&loop_latency, 0, {}}};
+uint32_t brightest_led = 0; // brightest color channel shown on the LEDs since the last reset (0 to 255)
+
+
+// Collect the samples recorded since the last pass (each measurement is recorded at most once per pass, so none are missed)
+void collect_samples() {
+  for (scenario_stats &stat : scenario_latency) {
+    for (; stat.seen < stat.stats->count; stat.seen++) {stat.samples.push_back(stat.stats->samples[stat.seen % latency_samples]);}
+  }
+  for (int i = 0; i < sim_led_count; i++) {
+    uint32_t color = sim_leds[i];
+    brightest_led = std::max({brightest_led, (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff});
+  }
+}
+
+
+// Run the loop for ms of virtual time, collecting the samples
+void scenario_run_for(uint64_t ms) {
+  uint64_t end = sim_time_us() + ms * 1000;
+  while (sim_time_us() < end) {
+    loop();
+    collect_samples();
+    sim_advance_us(pass_gap_us);
+  }
+}
+
+
+// Run the loop until a condition is true or ms of virtual time have passed, collecting the samples (returns the condition)
+template <class F> bool scenario_run_until(F condition, uint64_t ms) {
+  uint64_t end = sim_time_us() + ms * 1000;
+  while (!condition() && sim_time_us() < end) {
+    loop();
+    collect_samples();
+    sim_advance_us(pass_gap_us);
+  }
+  return condition();
+}
+
+
+// Print the samples of a scenario in the same format as print_latency()
+void print_scenario_latency(const scenario_stats &stat) {
+  std::vector<unsigned long> sorted = stat.samples;
+  std::sort(sorted.begin(), sorted.end());
+  size_t n = sorted.size();
+  if (n == 0) {
+    printf("latency %s: no samples\n", stat.stats->name);
+    return;
+  }
+  printf("latency %s: p50 %lu us, p99 %lu us, max %lu us (%zu samples)\n",
+         stat.stats->name, sorted[(n - 1) * 50 / 100], sorted[(n - 1) * 99 / 100], sorted[n - 1], n);
+}
+
+
+// Start the dispenser and wait for the network and the time (the config comes from Google Sheets on the first publish)
+void begin_scenario() {
+  begin_dispenser();
+  check(run_until([] {return network_started && time_synced;}, 10000));
+}
+
+
+// Fill a glass for fill_ms, then wait gap_ms before the next one
+void fill_glass(uint64_t fill_ms, uint64_t gap_ms) {
+  place_glass();
+  scenario_run_for(fill_ms);
+  remove_glass();
+  scenario_run_for(gap_ms);
+}
+
+
+// Wait for the dispenser to finish anything it is doing (valve closed, display off and no publish in progress)
+bool wait_until_idle() {
+  return scenario_run_until([] {return !valve_open && !display_on && publish_state == publish_idle && sinks_pending == 0;}, publish_timeout + 30000);
+}
+
+
+// A glass arrives at a different point of each publish (connecting, sending the batch, waiting for the script, reading the reply)
+void glass_during_publish() {
+  begin_scenario();
+  for (uint64_t offset = 0; offset <= 3000; offset += 100) {
+    check(wait_until_idle());
+    start_publish_batch();
+    check(publish_state != publish_idle);
+    scenario_run_for(offset);
+    fill_glass(2000, turn_off_delay + 100);
+  }
+  check(wait_until_idle());
+  check(scenario_latency[0].samples.size() == 31); // every glass opened the valve
+}
+
+
+// The button is held to each preset in turn (then through all of them to the publish), and the valve closes itself after each preset
+void button_presets() {
+  begin_scenario();
+  start_publish_batch();
+  check(scenario_run_until([] {return function_1_oz != 0;}, publish_timeout)); // the presets come from Google Sheets
+  for (int preset = 1; preset <= 5; preset++) {
+    check(wait_until_idle());
+    press_button();
+    scenario_run_for(preset * button_hold_time + 100);
+    release_button();
+    check(scenario_run_until([] {return valve_open;}, 500));
+    check(scenario_run_until([] {return !valve_open;}, automatic_dispense_time + 1000));
+  }
+  check(wait_until_idle());
+  int published_batches = script.batches.size();
+  press_button();
+  scenario_run_for(8 * button_hold_time + 100);
+  release_button();
+  scenario_run_for(500);
+  check(!valve_open); // held past the off function
+  check(wait_until_idle());
+  check((int)script.batches.size() > published_batches);
+  check(scenario_latency[0].samples.size() == 5);
+}
+
+
+// Glasses filled back to back, some of them before the valve has been closed for cycle_time
+void rapid_fills() {
+  begin_scenario();
+  for (int fill = 0; fill < 50; fill++) {
+    fill_glass(300 + fill * 53 % 700, turn_off_delay + fill * 37 % 500);
+  }
+  check(wait_until_idle());
+  check(scenario_latency[0].samples.size() == 50);
+  check(scenario_latency[1].samples.size() == 50);
+}
+
+
+// Fills during afterhours, with the LEDs dimmed
+void afterhours_dimming() {
+  begin_scenario();
+  time_t local = myTZ.toLocal(now());
+  afterhours_start = hour(local);
+  afterhours_stop = (afterhours_start + 2) % 24;
+  schedule_task(task_check_time, 0);
+  scenario_run_for(100);
+  check(afterhours);
+  brightest_led = 0;
+  for (int fill = 0; fill < 20; fill++) {fill_glass(1500, display_off_delay + 200);}
+  check(wait_until_idle());
+  check(brightest_led > 0 && brightest_led <= 255 / dim_factor);
+  check(scenario_latency[0].samples.size() == 20);
+}
+
+
+struct scenario {
+  const char *name;
+  void (*run)();
+};
+
+const scenario scenarios[] = {
+  {"glass_during_publish", glass_during_publish},
+  {"button_presets", button_presets},
+  {"rapid_fills", rapid_fills},
+  {"afterhours_dimming", afterhours_dimming},
+};
+
+
+// Run one scenario in a child process (the dispenser's state is global, so each scenario needs a fresh process), returns true if it passed
+bool run_scenario(const scenario &s) {
+  fflush(stdout);
+  pid_t child = fork();
+  if (child == 0) {
+    printf("scenario %s\n", s.name);
+    s.run();
+    for (const scenario_stats &stat : scenario_latency) {print_scenario_latency(stat);}
+    int result = test_result(s.name);
+    fflush(stdout);
+    _exit(result);
+  }
+  int status = 0;
+  waitpid(child, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+int main(int argc, char **argv) {
+  int failed = 0;
+  for (const scenario &s : scenarios) {
+    bool selected = argc == 1;
+    for (int i = 1; i < argc; i++) {selected |= strcmp(argv[i], s.name) == 0;}
+    if (selected && !run_scenario(s)) {failed++;}
+  }
+  return failed == 0 ? 0 : 1;
+}
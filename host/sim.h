@@ -0,0 +1,552 @@
+//  ===========================================
+//  Host simulation of the water dispenser
+//  Stand-ins for the parts of the Arduino core and libraries main_v3.cpp uses, so the dispenser logic can be built and run
+//  on a Linux machine (build main_v3.cpp with host_simulation defined, see CMakeLists.txt)
+//  ===========================================
+//
+//  Everything runs on a virtual clock that only moves when the simulation moves it: hal_delay(), sim_advance_us(), and the
+//  blocking calls of the hardware and network stand-ins (showing a frame on the LED ring, serial output once the UART FIFO
+//  is full, flash writes, DNS lookups, TLS handshakes and slow web clients) move it by roughly what they take on an ESP8266.
+//  Input changes scheduled on the simulated pins run the interrupts attached to them at the exact virtual time they happen.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <memory>
+#include <type_traits>
+
+
+// ----- Arduino core -----
+
+#define HIGH              1
+#define LOW               0
+#define INPUT             0
+#define OUTPUT            1
+#define INPUT_PULLUP      2
+#define CHANGE            1
+#define FALLING           2
+#define RISING            3
+#define DEC               10
+#define HEX               16
+
+// NodeMCU pin names (GPIO numbers)
+#define D0                16
+#define D1                5
+#define D2                4
+#define D3                0
+#define D4                2
+#define D5                14
+#define D6                12
+#define D7                13
+#define D8                15
+#define LED_BUILTIN       2
+#define sim_pin_count     17
+
+#define IRAM_ATTR
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+
+typedef uint8_t byte;
+
+template <class T, class U> typename std::common_type<T, U>::type min(T a, U b) {return a < b ? a : b;}
+template <class T, class U> typename std::common_type<T, U>::type max(T a, U b) {return a > b ? a : b;}
+
+void pinMode(uint8_t pin, uint8_t mode);
+inline int digitalPinToInterrupt(int pin) {return pin;}
+void attachInterrupt(int interrupt, void (*handler)(), int mode);
+
+
+// Arduino String (only the parts main_v3.cpp uses)
+class String {
+  public:
+    String(const char *text = "") : text(text != nullptr ? text : "") {}
+    String(const std::string &text) : text(text) {}
+    const char *c_str() const {return text.c_str();}
+    unsigned int length() const {return text.length();}
+    int toInt() const {return atol(text.c_str());}
+    float toFloat() const {return atof(text.c_str());}
+    String &operator+=(const String &other) {text += other.text; return *this;}
+    bool operator==(const String &other) const {return text == other.text;}
+    bool operator==(const char *other) const {return text == other;}
+    std::string text;
+};
+inline String operator+(const String &a, const String &b) {return String(a.text + b.text);}
+inline String operator+(const String &a, const char *b) {return String(a.text + b);}
+inline String operator+(const char *a, const String &b) {return String(a + b.text);}
+
+
+// Output stream (print formats match the Arduino core)
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t data) = 0;
+    virtual size_t write(const uint8_t *data, size_t length);
+    size_t write(const char *text) {return write((const uint8_t *)text, strlen(text));}
+    size_t print(const char *text) {return write(text);}
+    size_t print(const String &text) {return write(text.c_str());}
+    size_t print(char c) {return write((uint8_t)c);}
+    size_t print(unsigned char value, int base = DEC) {return print((unsigned long long)value, base);}
+    size_t print(int value, int base = DEC) {return print((long long)value, base);}
+    size_t print(unsigned int value, int base = DEC) {return print((unsigned long long)value, base);}
+    size_t print(long value, int base = DEC) {return print((long long)value, base);}
+    size_t print(unsigned long value, int base = DEC) {return print((unsigned long long)value, base);}
+    size_t print(long long value, int base = DEC);
+    size_t print(unsigned long long value, int base = DEC);
+    size_t print(double value, int digits = 2);
+    size_t println() {return write("\r\n");}
+    template <class T> size_t println(T value) {return print(value) + println();}
+    template <class T> size_t println(T value, int format) {return print(value, format) + println();}
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+
+// Input stream (reads wait for up to the timeout set with setTimeout(), moving the virtual clock while they wait)
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    void setTimeout(unsigned long ms) {timeout = ms;}
+    int timedRead();
+    int timedPeek();
+  protected:
+    unsigned long timeout = 1000;
+};
+
+
+// Serial port (9600 baud with a 128 byte transmit FIFO like the ESP8266 UART, so long prints block the loop the same way)
+class HardwareSerial : public Stream {
+  public:
+    void begin(unsigned long baud);
+    void flush();
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t data);
+    using Print::write;
+};
+extern HardwareSerial Serial;
+
+
+// ----- TimeLib and Timezone -----
+
+struct tmElements_t {
+  uint8_t Second;
+  uint8_t Minute;
+  uint8_t Hour;
+  uint8_t Wday;                       // day of the week, Sunday is 1
+  uint8_t Day;
+  uint8_t Month;
+  uint8_t Year;                       // years since 1970
+};
+typedef time_t (*getExternalTime)();
+time_t now();
+void setTime(time_t t);
+void setSyncProvider(getExternalTime provider);
+void setSyncInterval(time_t interval);
+time_t makeTime(const tmElements_t &tm);
+void breakTime(time_t t, tmElements_t &tm);
+int hour(time_t t);
+int minute(time_t t);
+int second(time_t t);
+int day(time_t t);
+int weekday(time_t t);
+int month(time_t t);
+int year(time_t t);
+const char *monthShortStr(uint8_t month);
+const char *dayShortStr(uint8_t day);
+
+enum week_t {Last, First, Second, Third, Fourth};
+enum dow_t {Sun = 1, Mon, Tue, Wed, Thu, Fri, Sat};
+enum month_t {Jan = 1, Feb, Mar, Apr, May, Jun, Jul, Aug, Sep, Oct, Nov, Dec};
+struct TimeChangeRule {
+  char abbrev[6];
+  uint8_t week;
+  uint8_t dow;
+  uint8_t month;
+  uint8_t hour;
+  int offset;                         // offset from UTC (minutes)
+};
+class Timezone {
+  public:
+    Timezone(TimeChangeRule dst_start, TimeChangeRule std_start) : dst_rule(dst_start), std_rule(std_start) {}
+    time_t toLocal(time_t utc, TimeChangeRule **rule = nullptr);
+    time_t toUTC(time_t local);
+  private:
+    time_t change_time(const TimeChangeRule &rule, int year); // local time a rule starts in a year
+    TimeChangeRule dst_rule;
+    TimeChangeRule std_rule;
+};
+
+
+// ----- LittleFS (kept in memory, survives until the process exits) -----
+
+class File {
+  public:
+    File() {}
+    File(const std::string &path, bool writable, size_t position) : path(path), writable(writable), position(position), open(true) {}
+    explicit operator bool() const {return open;}
+    size_t read(uint8_t *data, size_t length);
+    size_t write(const uint8_t *data, size_t length);
+    bool seek(size_t pos);
+    size_t size() const;
+    void close();
+  private:
+    std::string path;
+    bool writable = false;
+    size_t position = 0;
+    bool open = false;
+};
+class sim_file_system {
+  public:
+    bool begin();
+    bool format();
+    File open(const char *path, const char *mode);
+    bool rename(const char *from, const char *to);
+    bool exists(const char *path);
+    std::map<std::string, std::vector<uint8_t>> files;
+    bool mounted = false;
+    bool broken = false;              // set to make begin() and format() fail (the dispenser then runs without the event log)
+};
+extern sim_file_system LittleFS;
+
+
+// ----- Network -----
+
+class IPAddress {
+  public:
+    IPAddress(uint32_t address = 0) : address(address) {}
+    bool isSet() const {return address != 0;}
+    String toString() const {return String("127.0.0.1");}
+  private:
+    uint32_t address;
+};
+
+// TLS sessions (the simulated servers give each full handshake a new session ID, and a resumed session keeps its ID)
+struct br_ssl_session_parameters {
+  uint8_t session_id[32];
+  uint8_t session_id_len;
+};
+namespace BearSSL {
+  class Session {
+    public:
+      Session() {memset(&parameters, 0, sizeof(parameters));}
+      br_ssl_session_parameters *getSession() {return &parameters;}
+    private:
+      br_ssl_session_parameters parameters;
+  };
+}
+
+class sim_connection;
+class sim_web_client;
+
+// TCP connection to one of the simulated servers (see sim_server), or from a sim_web_client accepted by WiFiServer
+// (copies share the connection, like on the ESP8266)
+class WiFiClient : public Stream {
+  public:
+    WiFiClient() {}
+    explicit WiFiClient(sim_web_client *incoming) : incoming(incoming) {}
+    int connect(const char *host, uint16_t port);
+    uint8_t connected();
+    explicit operator bool() {return connected();}
+    void stop();
+    void setNoDelay(bool) {}
+    int available();
+    int read();
+    int peek();
+    size_t peekBytes(uint8_t *buffer, size_t length);      // copy what has arrived without reading it (accepted clients only)
+    size_t write(uint8_t data) {return write(&data, 1);}
+    size_t write(const uint8_t *data, size_t length);
+    using Print::write;
+    sim_web_client *web_client() const {return incoming;}
+  protected:
+    std::shared_ptr<sim_connection> connection;
+    sim_web_client *incoming = nullptr;
+    bool secure = false;
+    BearSSL::Session *session = nullptr;
+};
+
+// TCP listener (accepts the sim_web_client requests, in the order they connected)
+class WiFiServer {
+  public:
+    using ClientType = WiFiClient;
+    WiFiServer(uint16_t port) {}
+    void begin() {listening = true;}
+    WiFiClient accept();
+  private:
+    bool listening = false;
+};
+
+// TLS connection (the handshake takes longer than a TCP connect, and less when the cached session is resumed)
+class WiFiClientSecure : public WiFiClient {
+  public:
+    WiFiClientSecure() {secure = true;}
+    void setInsecure() {}
+    void setSession(BearSSL::Session *cached) {session = cached;}
+};
+
+// UDP socket (only talks to the simulated NTP server)
+class WiFiUDP {
+  public:
+    uint8_t begin(uint16_t port) {return 1;}
+    int beginPacket(IPAddress address, uint16_t port);
+    size_t write(const uint8_t *data, size_t length) {return length;}
+    int endPacket();
+    int parsePacket();
+    int read(uint8_t *data, size_t length);
+  private:
+    bool sending = false;
+};
+
+// OTA updates and mDNS (nothing to do on the host)
+#define U_FLASH           0
+#define U_FS              100
+typedef int ota_error_t;
+#define OTA_AUTH_ERROR    0
+#define OTA_BEGIN_ERROR   1
+#define OTA_CONNECT_ERROR 2
+#define OTA_RECEIVE_ERROR 3
+#define OTA_END_ERROR     4
+class ArduinoOTAClass {
+  public:
+    template <class F> void onStart(F) {}
+    template <class F> void onEnd(F) {}
+    template <class F> void onProgress(F) {}
+    template <class F> void onError(F) {}
+    int getCommand() {return U_FLASH;}
+    void setHostname(const char *) {}
+    void begin() {}
+    void handle() {}
+};
+extern ArduinoOTAClass ArduinoOTA;
+class MDNSResponder {
+  public:
+    bool addService(const char *, const char *, uint16_t) {return true;}
+};
+extern MDNSResponder MDNS;
+
+
+// Web server (clients are accepted from a ServerType like the ESP8266 library's template, and handled the way the library handles them:
+// once the first bytes of a request have arrived, handleClient() waits for the rest of it for up to HTTP_MAX_DATA_WAIT)
+#define HTTP_MAX_DATA_WAIT 5000
+#define CONTENT_LENGTH_UNKNOWN ((size_t)-1)
+enum HTTPMethod {HTTP_ANY, HTTP_GET, HTTP_POST};
+class sim_web_server {
+  public:
+    void on(const char *uri, HTTPMethod method, void (*handler)());
+    bool serve(WiFiClient &client);                       // read and answer a request (returns false while still waiting for its first bytes)
+    void send(int code, const char *content_type, const String &content);
+    void send(int code, const char *content_type, const char *content) {send(code, content_type, String(content));}
+    void setContentLength(size_t length) {content_length = length;}
+    void sendContent(const String &content) {sendContent(content.c_str(), content.length());}
+    void sendContent(const char *content, size_t length);
+    bool hasArg(const char *name) const {return args.count(name) > 0;}
+    String arg(const char *name) const;
+  private:
+    struct route {
+      std::string uri;
+      HTTPMethod method;
+      void (*handler)();
+    };
+    std::vector<route> routes;
+    std::map<std::string, std::string> args;
+    size_t content_length = 0;
+};
+namespace esp8266webserver {
+  template <class ServerType> class ESP8266WebServerTemplate : public sim_web_server {
+    public:
+      using ClientType = typename ServerType::ClientType;
+      ESP8266WebServerTemplate(int port) : server(port) {}
+      void begin() {server.begin();}
+      void handleClient() {
+        if (!current.connected()) {current = server.accept();}
+        if (current.connected() && serve(current)) {current = ClientType();}
+      }
+    private:
+      ServerType server;
+      ClientType current;
+  };
+}
+using ESP8266WebServer = esp8266webserver::ESP8266WebServerTemplate<WiFiServer>;
+
+
+// ----- ArduinoJson (flat objects with one level of nesting, enough for the status, config and script responses) -----
+
+struct sim_json_value {
+  enum types {type_null, type_bool, type_integer, type_float, type_string, type_object};
+  types type = type_null;
+  bool boolean = false;
+  long long integer = 0;
+  double number = 0;
+  std::string text;
+  std::list<std::pair<std::string, sim_json_value>> members; // (a list so a nested object stays put while members are added)
+  sim_json_value *member(const char *key);
+  sim_json_value &add_member(const char *key);
+};
+
+class JsonVariant {
+  public:
+    JsonVariant(sim_json_value *object, const char *key) : object(object), key(key) {}
+    JsonVariant &operator=(bool value);
+    JsonVariant &operator=(int value) {return set_integer(value);}
+    JsonVariant &operator=(unsigned int value) {return set_integer(value);}
+    JsonVariant &operator=(long value) {return set_integer(value);}
+    JsonVariant &operator=(unsigned long value) {return set_integer(value);}
+    JsonVariant &operator=(long long value) {return set_integer(value);}
+    JsonVariant &operator=(float value) {return set_float(value);}
+    JsonVariant &operator=(double value) {return set_float(value);}
+    JsonVariant &operator=(const char *value);
+    JsonVariant &operator=(const String &value) {return *this = value.c_str();}
+    template <class T> operator T() const {
+      const sim_json_value *value = find();
+      if (value == nullptr) {return T();}
+      if (value->type == sim_json_value::type_float) {return (T)value->number;}
+      if (value->type == sim_json_value::type_bool) {return (T)value->boolean;}
+      return (T)value->integer;
+    }
+    const char *operator|(const char *fallback) const;
+    bool isNull() const {return find() == nullptr;}
+  private:
+    JsonVariant &set_integer(long long value);
+    JsonVariant &set_float(double value);
+    const sim_json_value *find() const;
+    sim_json_value *object;
+    std::string key;
+};
+
+class JsonObject {
+  public:
+    JsonObject(sim_json_value *object = nullptr) : object(object) {}
+    JsonVariant operator[](const char *key) {return JsonVariant(object, key);}
+  private:
+    sim_json_value *object;
+};
+
+class JsonDocument {
+  public:
+    JsonDocument() {root.type = sim_json_value::type_object;}
+    JsonVariant operator[](const char *key) {return JsonVariant(&root, key);}
+    void clear() {root = sim_json_value(); root.type = sim_json_value::type_object;}
+    bool containsKey(const char *key) {return root.member(key) != nullptr;}
+    JsonObject createNestedObject(const char *key);
+    template <class T> T to() {clear(); return T(&root);}
+    sim_json_value root;
+};
+template <size_t capacity> class StaticJsonDocument : public JsonDocument {};
+
+class DeserializationError {
+  public:
+    enum Code {Ok, EmptyInput, IncompleteInput, InvalidInput, NoMemory};
+    DeserializationError(Code code = Ok) : code(code) {}
+    explicit operator bool() const {return code != Ok;}
+    const char *c_str() const;
+  private:
+    Code code;
+};
+namespace DeserializationOption {
+  struct Filter {
+    Filter(JsonDocument &filter) : filter(filter) {}
+    JsonDocument &filter;
+  };
+}
+DeserializationError deserializeJson(JsonDocument &doc, Stream &input, DeserializationOption::Filter filter);
+DeserializationError deserializeJson(JsonDocument &doc, const char *input);
+size_t serializeJson(const JsonDocument &doc, char *output, size_t size);
+size_t serializeJson(const JsonDocument &doc, Print &output);
+
+
+// ----- Simulation control (used by the host tests and the scenario runner) -----
+
+// virtual clock
+uint64_t sim_time_us();                                     // current virtual time (us since the simulation started)
+void sim_advance_us(uint64_t us);                           // move the virtual clock, running any input changes that happen on the way
+void sim_charge_us(uint64_t us);                            // time taken by a blocking call on the device (same as sim_advance_us)
+
+// simulated pins
+void sim_set_pin(uint8_t pin, int level);                   // change an input now
+void sim_schedule_pin(uint8_t pin, int level, uint64_t at); // change an input at a virtual time (us)
+void sim_pulse_train(uint8_t pin, double hz, uint64_t count); // square wave on an input starting now (count falling edges)
+uint64_t sim_pulses_sent(uint8_t pin);                      // falling edges sent on a pin by pulse trains so far
+int sim_pin_level(uint8_t pin);                             // current level of a pin
+extern void (*sim_write_hook)(uint8_t pin, uint8_t level);  // called whenever the logic sets an output pin
+
+// simulated LED ring (the last frame shown)
+#define sim_max_leds      64
+extern uint32_t sim_leds[sim_max_leds];
+extern int sim_led_count;
+extern unsigned long sim_led_shows;                         // number of frames shown (each takes 30 us per LED plus the 50 us reset)
+
+// serial port
+void sim_serial_input(const char *text);                    // text typed on the serial monitor
+std::string sim_serial_output();                            // everything printed since the last call
+extern bool sim_serial_echo;                                // also print the output to stdout?
+
+// flash, heap and WiFi
+extern uint64_t sim_flash_write_us;                         // time each write to a flash file takes (us)
+extern uint32_t sim_free_heap;                              // free heap reported to the logic (bytes)
+extern bool sim_wifi_up;                                    // is WiFi connected?
+extern uint64_t sim_wifi_connect_us;                        // how long after WiFi is started it connects (us)
+
+// DNS and the simulated NTP server
+extern uint64_t sim_dns_us;                                 // time a DNS lookup takes (us, a lookup that gets no answer blocks for much longer)
+extern unsigned long sim_dns_lookups;                       // number of DNS lookups since startup
+extern bool sim_dns_up;                                     // does the DNS server answer? (hal_host_by_name() fails if not)
+extern uint64_t sim_last_dns_lookup;                        // virtual time of the last DNS lookup (us)
+extern bool sim_ntp_up;                                     // does the NTP server answer?
+extern uint64_t sim_ntp_rtt_us;                             // round trip time to the NTP server (us)
+extern time_t sim_utc_start;                                // UTC time at virtual time 0 (unix time)
+extern double sim_clock_error_ppm;                          // how much slower the simulated local clock runs than the NTP server (ppm)
+
+// simulated servers (a connection to host:port is handed to the server registered for it, or fails after a DNS lookup)
+class sim_connection {
+  public:
+    std::string received;                                   // bytes sent by the client that the server has not used yet
+    std::vector<std::pair<uint64_t, std::string>> replies;  // bytes for the client, with the virtual time they arrive (us)
+    size_t reply_offset = 0;                                // bytes of the first reply already read by the client
+    bool closed = false;                                    // has the server closed the connection?
+    bool client_closed = false;
+    class sim_server *server = nullptr;
+    void reply(const std::string &data, uint64_t delay_us = 0);
+};
+class sim_server {
+  public:
+    virtual ~sim_server() {}
+    virtual void receive(sim_connection &connection) = 0;   // bytes have arrived in connection.received
+    uint64_t connect_us = 50000;                            // time a TCP connect takes (us)
+    uint64_t handshake_us = 1500000;                        // time a full TLS handshake takes (us)
+    uint64_t resumed_handshake_us = 300000;                 // time a TLS handshake that resumes a session takes (us)
+    bool resume_sessions = true;                            // does the server accept cached TLS sessions?
+    unsigned long connections = 0;
+};
+void sim_serve(const char *host, uint16_t port, sim_server *server); // nullptr to take the server down
+
+// local web client (talks to the ESP8266WebServer stand-in)
+class sim_web_client {
+  public:
+    sim_web_client(const std::string &request, uint64_t byte_us = 0); // request bytes arrive one every byte_us from now
+    ~sim_web_client();
+    bool done = false;                                      // has the request been answered or dropped?
+    int status = 0;                                         // HTTP status code (0 if the request was dropped)
+    std::string content_type;
+    std::string body;
+    uint64_t answered_at = 0;                               // virtual time the answer was sent (us)
+    bool accepted = false;                                  // has WiFiServer::accept() returned it?
+    uint64_t accepted_at = 0;                               // virtual time it was accepted (us)
+    size_t read = 0;                                        // bytes of the request read by the dispenser
+    std::string request;
+    uint64_t start;
+    uint64_t byte_us;
+    size_t arrived(uint64_t at) const;                      // number of request bytes that have arrived by a virtual time
+};
@@ -0,0 +1,101 @@
+// Host simulation: stand-in for an MQTT broker (see sim_broker.h)
+
+#include "sim_broker.h"
+
+
+sim_mqtt_broker::sim_mqtt_broker(const char *host, uint16_t port) : host(host), port(port) {
+  connect_us = 5000;
+  sim_serve(host, port, this);
+}
+
+
+sim_mqtt_broker::~sim_mqtt_broker() {
+  sim_serve(host.c_str(), port, nullptr);
+}
+
+
+// Read a string sent with its length first (returns false if the packet is too short)
+static bool read_string(const std::string &packet, size_t &pos, std::string &text) {
+  if (pos + 2 > packet.size()) {return false;}
+  size_t length = ((uint8_t)packet[pos] << 8) | (uint8_t)packet[pos + 1];
+  if (pos + 2 + length > packet.size()) {return false;}
+  text = packet.substr(pos + 2, length);
+  pos += 2 + length;
+  return true;
+}
+
+
+// Handle every complete packet that has arrived
+void sim_mqtt_broker::receive(sim_connection &connection) {
+  while (connection.received.size() >= 2) {
+    size_t length = 0;
+    size_t pos = 1;
+    int shift = 0;
+    uint8_t b;
+    do { // remaining length, 7 bits at a time
+      if (pos >= connection.received.size()) {return;}
+      b = connection.received[pos++];
+      length |= (size_t)(b & 0x7f) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    if (connection.received.size() < pos + length) {return;}
+    uint8_t type = connection.received[0];
+    std::string packet = connection.received.substr(pos, length);
+    connection.received.erase(0, pos + length);
+
+    switch (type & 0xf0) {
+      case 0x10: { // CONNECT
+        connect_requests++;
+        size_t at = 0;
+        std::string protocol;
+        if (!read_string(packet, at, protocol) || protocol != "MQTT" || at + 4 > packet.size() || packet[at] != 4) {
+          connection.closed = true;
+          return;
+        }
+        uint8_t flags = packet[at + 1];
+        keepalive = ((uint8_t)packet[at + 2] << 8) | (uint8_t)packet[at + 3];
+        at += 4;
+        read_string(packet, at, client_id);
+        will_topic.clear();
+        will_message.clear();
+        will_retain = (flags & 0x20) != 0;
+        if (flags & 0x04) {
+          read_string(packet, at, will_topic);
+          read_string(packet, at, will_message);
+        }
+        if (answer_connect) {connection.reply(std::string("\x20\x02\x00", 3) + (char)connack_code, reply_us);}
+        break;
+      }
+      case 0x30: { // PUBLISH
+        sim_mqtt_message message;
+        size_t at = 0;
+        if (!read_string(packet, at, message.topic)) {break;}
+        message.qos = (type >> 1) & 3;
+        message.retain = (type & 1) != 0;
+        if (message.qos > 0 && at + 2 <= packet.size()) {
+          message.packet_id = ((uint8_t)packet[at] << 8) | (uint8_t)packet[at + 1];
+          at += 2;
+        }
+        message.payload = packet.substr(at);
+        message.received_at = sim_time_us();
+        messages.push_back(message);
+        if (message.retain) {retained[message.topic] = message;}
+        if (message.qos == 1 && answer_publish) {
+          uint16_t id = message.packet_id + puback_id_offset;
+          connection.reply(std::string("\x40\x02", 2) + (char)(id >> 8) + (char)(id & 0xff), reply_us);
+          pubacks++;
+        }
+        break;
+      }
+      case 0xc0: // PINGREQ
+        pings++;
+        if (answer_ping) {connection.reply(std::string("\xd0\x00", 2), reply_us);}
+        break;
+      case 0xe0: // DISCONNECT
+        connection.closed = true;
+        return;
+      default:
+        break;
+    }
+  }
+}
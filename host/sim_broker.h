@@ -0,0 +1,43 @@
+//  Host simulation: stand-in for an MQTT broker (MQTT 3.1.1 over plain TCP, like mosquitto on port 1883)
+//  Answers CONNECT with CONNACK, QoS 1 PUBLISH with PUBACK and PINGREQ with PINGRESP, keeps the messages it receives and the
+//  retained message of each topic, and can be told to refuse connections or leave packets unanswered so tests can check the
+//  dispenser's timeouts.
+
+#pragma once
+
+#include "sim.h"
+
+struct sim_mqtt_message {
+  std::string topic;
+  std::string payload;
+  int qos = 0;
+  bool retain = false;
+  uint16_t packet_id = 0;             // (QoS 1 only)
+  uint64_t received_at = 0;           // virtual time the message arrived (us)
+};
+
+class sim_mqtt_broker : public sim_server {
+  public:
+    sim_mqtt_broker(const char *host = "broker.local", uint16_t port = 1883); // starts serving host:port
+    ~sim_mqtt_broker();
+    void receive(sim_connection &connection);
+    std::vector<sim_mqtt_message> messages;               // every message published, in order
+    std::map<std::string, sim_mqtt_message> retained;     // last retained message of each topic
+    std::string client_id;            // from the last CONNECT
+    std::string will_topic;           // from the last CONNECT
+    std::string will_message;
+    bool will_retain = false;
+    int keepalive = 0;                // seconds, from the last CONNECT
+    unsigned long connect_requests = 0; // number of CONNECT packets received
+    unsigned long pings = 0;          // number of PINGREQ packets received
+    unsigned long pubacks = 0;        // number of PUBACK packets sent
+    int connack_code = 0;             // return code sent in CONNACK (0 accepts the connection)
+    bool answer_connect = true;       // send CONNACK?
+    bool answer_publish = true;       // send PUBACK for QoS 1 messages?
+    bool answer_ping = true;          // send PINGRESP?
+    int puback_id_offset = 0;         // added to the packet ID in PUBACK (like a broker answering some other message)
+    uint64_t reply_us = 20000;        // time each answer takes to arrive (us)
+  private:
+    std::string host;
+    uint16_t port;
+};
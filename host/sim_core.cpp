@@ -0,0 +1,512 @@
+// Host simulation: virtual clock, pins and interrupts, LED ring, serial port, TimeLib and Timezone, and the HAL functions main_v3.cpp declares for host_simulation
+
+#include "sim.h"
+
+
+// HAL functions (declared in main_v3.cpp)
+unsigned long hal_millis();
+unsigned long hal_micros();
+void hal_delay(unsigned long ms);
+int hal_read(uint8_t pin);
+void hal_write(uint8_t pin, uint8_t level);
+void hal_show_leds(const uint32_t *colors, int count);
+void hal_begin_leds(uint8_t brightness);
+uint32_t hal_cycles();
+uint32_t hal_cycles_per_us();
+uint32_t hal_free_heap();
+uint32_t hal_max_free_block();
+uint8_t hal_heap_fragmentation();
+void hal_wifi_begin(const char *ssid, const char *password);
+bool hal_wifi_connected();
+String hal_local_ip();
+
+
+// ----- Virtual clock and pins -----
+
+static uint64_t now_us = 0;
+
+struct pin_state {
+  int level = LOW;
+  uint8_t mode = INPUT;
+  void (*handler)() = nullptr;        // attached interrupt
+  int interrupt_mode = 0;
+};
+static pin_state pins[sim_pin_count];
+static std::multimap<uint64_t, std::pair<uint8_t, int>> scheduled_changes; // virtual time -> pin and level
+
+struct pulse_train {
+  uint8_t pin;
+  uint64_t start;
+  double hz;
+  uint64_t count;                     // falling edges to send
+  uint64_t edges = 0;                 // edges sent so far (falling and rising)
+  uint64_t next_edge() const {return start + (uint64_t)llround(edges * 500000.0 / hz);}
+};
+static std::vector<pulse_train> pulse_trains;
+static uint64_t pulses_sent[sim_pin_count];
+
+void (*sim_write_hook)(uint8_t pin, uint8_t level) = nullptr;
+
+
+uint64_t sim_time_us() {
+  return now_us;
+}
+
+
+// Change the level of a pin and run its interrupt if the change matches the interrupt mode
+static void change_pin(uint8_t pin, int level) {
+  pin_state &state = pins[pin];
+  if (state.level == level) {return;}
+  state.level = level;
+  if (state.handler == nullptr) {return;}
+  if (state.interrupt_mode == CHANGE || (state.interrupt_mode == FALLING && level == LOW) || (state.interrupt_mode == RISING && level == HIGH)) {
+    state.handler();
+  }
+}
+
+
+void sim_advance_us(uint64_t us) {
+  uint64_t target = now_us + us;
+  while (true) {
+    uint64_t next = target + 1;
+    if (!scheduled_changes.empty()) {next = scheduled_changes.begin()->first;}
+    pulse_train *train = nullptr;
+    for (pulse_train &candidate : pulse_trains) {
+      if (candidate.next_edge() < next) {
+        next = candidate.next_edge();
+        train = &candidate;
+      }
+    }
+    if (next > target) {break;}
+    if (next > now_us) {now_us = next;}
+    if (train != nullptr) { // the square wave starts with a falling edge
+      uint8_t pin = train->pin;
+      bool falling = (train->edges % 2 == 0);
+      train->edges++;
+      if (falling) {pulses_sent[pin]++;}
+      if (train->edges == train->count * 2) {pulse_trains.erase(pulse_trains.begin() + (train - pulse_trains.data()));}
+      change_pin(pin, falling ? LOW : HIGH);
+    }
+    else {
+      auto change = scheduled_changes.begin();
+      uint8_t pin = change->second.first;
+      int level = change->second.second;
+      scheduled_changes.erase(change);
+      change_pin(pin, level);
+    }
+  }
+  now_us = target;
+}
+
+
+void sim_charge_us(uint64_t us) {
+  sim_advance_us(us);
+}
+
+
+void sim_set_pin(uint8_t pin, int level) {
+  change_pin(pin, level);
+}
+
+
+void sim_schedule_pin(uint8_t pin, int level, uint64_t at) {
+  scheduled_changes.insert({at, {pin, level}});
+}
+
+
+void sim_pulse_train(uint8_t pin, double hz, uint64_t count) {
+  if (count == 0 || hz <= 0) {return;}
+  pulse_train train = {pin, now_us, hz, count};
+  pulse_trains.push_back(train);
+}
+
+
+uint64_t sim_pulses_sent(uint8_t pin) {
+  return pulses_sent[pin];
+}
+
+
+int sim_pin_level(uint8_t pin) {
+  return pins[pin].level;
+}
+
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  pins[pin].mode = mode;
+  if (mode == INPUT_PULLUP) {pins[pin].level = HIGH;}
+}
+
+
+void attachInterrupt(int interrupt, void (*handler)(), int mode) {
+  pins[interrupt].handler = handler;
+  pins[interrupt].interrupt_mode = mode;
+}
+
+
+unsigned long hal_millis() {
+  return now_us / 1000;
+}
+
+
+unsigned long hal_micros() {
+  return now_us;
+}
+
+
+void hal_delay(unsigned long ms) {
+  sim_advance_us((uint64_t)ms * 1000);
+}
+
+
+int hal_read(uint8_t pin) {
+  return pins[pin].level;
+}
+
+
+void hal_write(uint8_t pin, uint8_t level) {
+  pins[pin].level = level;
+  if (sim_write_hook != nullptr) {sim_write_hook(pin, level);}
+}
+
+
+uint32_t hal_cycles() {
+  return (uint32_t)(now_us * 80);
+}
+
+
+uint32_t hal_cycles_per_us() {
+  return 80;
+}
+
+
+// ----- LED ring -----
+
+uint32_t sim_leds[sim_max_leds];
+int sim_led_count = 0;
+unsigned long sim_led_shows = 0;
+
+
+void hal_begin_leds(uint8_t brightness) {
+}
+
+
+void hal_show_leds(const uint32_t *colors, int count) {
+  if (count > sim_max_leds) {count = sim_max_leds;}
+  memcpy(sim_leds, colors, count * sizeof(uint32_t));
+  sim_led_count = count;
+  sim_led_shows++;
+  sim_charge_us(count * 30 + 50); // 24 bits at 800 kHz per LED, then the reset time (interrupts are off while the frame is sent)
+}
+
+
+// ----- Heap and WiFi -----
+
+uint32_t sim_free_heap = 30000;
+bool sim_wifi_up = true;
+uint64_t sim_wifi_connect_us = 3000000;
+static bool wifi_started = false;
+static uint64_t wifi_start_time = 0;
+
+
+uint32_t hal_free_heap() {
+  return sim_free_heap;
+}
+
+
+uint32_t hal_max_free_block() {
+  return sim_free_heap; // the simulated heap is never fragmented
+}
+
+
+uint8_t hal_heap_fragmentation() {
+  return 0;
+}
+
+
+void hal_wifi_begin(const char *ssid, const char *password) {
+  wifi_started = true;
+  wifi_start_time = now_us;
+}
+
+
+bool hal_wifi_connected() {
+  return wifi_started && sim_wifi_up && now_us - wifi_start_time >= sim_wifi_connect_us;
+}
+
+
+String hal_local_ip() {
+  return IPAddress().toString();
+}
+
+
+// ----- Print, Stream and the serial port -----
+
+size_t Print::write(const uint8_t *data, size_t length) {
+  size_t written = 0;
+  while (written < length && write(data[written])) {written++;}
+  return written;
+}
+
+
+size_t Print::print(long long value, int base) {
+  if (base == DEC) {
+    char text[24];
+    snprintf(text, sizeof(text), "%lld", value);
+    return write(text);
+  }
+  return print((unsigned long long)value, base);
+}
+
+
+size_t Print::print(unsigned long long value, int base) {
+  char text[24];
+  snprintf(text, sizeof(text), base == HEX ? "%llX" : "%llu", value);
+  return write(text);
+}
+
+
+size_t Print::print(double value, int digits) {
+  if (isnan(value)) {return write("nan");}
+  if (isinf(value)) {return write("inf");}
+  char text[64];
+  snprintf(text, sizeof(text), "%.*f", digits, value);
+  return write(text);
+}
+
+
+size_t Print::printf(const char *format, ...) {
+  char text[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  return write(text);
+}
+
+
+int Stream::timedRead() {
+  unsigned long start = hal_millis();
+  do {
+    int c = read();
+    if (c >= 0) {return c;}
+    sim_advance_us(1000);
+  } while (hal_millis() - start < timeout);
+  return -1;
+}
+
+
+int Stream::timedPeek() {
+  unsigned long start = hal_millis();
+  do {
+    int c = peek();
+    if (c >= 0) {return c;}
+    sim_advance_us(1000);
+  } while (hal_millis() - start < timeout);
+  return -1;
+}
+
+
+HardwareSerial Serial;
+bool sim_serial_echo = false;
+static std::string serial_output;
+static std::string serial_input;
+static uint64_t serial_byte_us = 0;   // time to send one byte (us, 0 until begin() is called)
+static uint64_t serial_sent_at = 0;   // virtual time the transmit FIFO will be empty (us)
+#define serial_fifo_size 128
+
+
+void HardwareSerial::begin(unsigned long baud) {
+  serial_byte_us = 10000000 / baud; // 8 data bits, a start bit and a stop bit
+}
+
+
+void HardwareSerial::flush() {
+  if (serial_sent_at > now_us) {sim_charge_us(serial_sent_at - now_us);}
+}
+
+
+int HardwareSerial::available() {
+  return serial_input.size();
+}
+
+
+int HardwareSerial::read() {
+  if (serial_input.empty()) {return -1;}
+  int c = (uint8_t)serial_input[0];
+  serial_input.erase(0, 1);
+  return c;
+}
+
+
+int HardwareSerial::peek() {
+  if (serial_input.empty()) {return -1;}
+  return (uint8_t)serial_input[0];
+}
+
+
+size_t HardwareSerial::write(uint8_t data) {
+  if (serial_byte_us > 0) {
+    if (serial_sent_at < now_us) {serial_sent_at = now_us;}
+    if (serial_sent_at - now_us >= serial_fifo_size * serial_byte_us) { // FIFO is full, wait for a byte to be sent
+      sim_charge_us(serial_sent_at - now_us - (serial_fifo_size - 1) * serial_byte_us);
+    }
+    serial_sent_at += serial_byte_us;
+  }
+  serial_output += (char)data;
+  if (sim_serial_echo) {putchar(data);}
+  return 1;
+}
+
+
+void sim_serial_input(const char *text) {
+  serial_input += text;
+}
+
+
+std::string sim_serial_output() {
+  std::string output;
+  output.swap(serial_output);
+  return output;
+}
+
+
+// ----- TimeLib -----
+
+static time_t sys_time = 0;
+static unsigned long prev_millis = 0;
+static time_t next_sync_time = 0;
+static time_t sync_interval = 300;
+static getExternalTime sync_provider = nullptr;
+
+
+// Days since 1970-01-01 for a date in the proleptic Gregorian calendar
+static long long days_from_civil(int y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  long long era = (y >= 0 ? y : y - 399) / 400;
+  unsigned yoe = (unsigned)(y - era * 400);
+  unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (long long)doe - 719468;
+}
+
+
+time_t makeTime(const tmElements_t &tm) {
+  return (time_t)days_from_civil(1970 + tm.Year, tm.Month, tm.Day) * 86400 + tm.Hour * 3600 + tm.Minute * 60 + tm.Second;
+}
+
+
+void breakTime(time_t t, tmElements_t &tm) {
+  long long days = t / 86400;
+  long long seconds = t % 86400;
+  tm.Second = seconds % 60;
+  tm.Minute = seconds / 60 % 60;
+  tm.Hour = seconds / 3600;
+  tm.Wday = (days + 4) % 7 + 1; // 1970-01-01 was a Thursday
+  long long z = days + 719468;
+  long long era = (z >= 0 ? z : z - 146096) / 146097;
+  unsigned doe = (unsigned)(z - era * 146097);
+  unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned mp = (5 * doy + 2) / 153;
+  unsigned d = doy - (153 * mp + 2) / 5 + 1;
+  unsigned m = mp < 10 ? mp + 3 : mp - 9;
+  long long y = (long long)yoe + era * 400 + (m <= 2);
+  tm.Day = d;
+  tm.Month = m;
+  tm.Year = y - 1970;
+}
+
+
+time_t now() {
+  while (hal_millis() - prev_millis >= 1000) {
+    sys_time++;
+    prev_millis += 1000;
+  }
+  if (next_sync_time <= sys_time && sync_provider != nullptr) {
+    time_t t = sync_provider();
+    if (t != 0) {setTime(t);}
+    else {next_sync_time = sys_time + sync_interval;}
+  }
+  return sys_time;
+}
+
+
+void setTime(time_t t) {
+  sys_time = t;
+  next_sync_time = t + sync_interval;
+  prev_millis = hal_millis();
+}
+
+
+void setSyncProvider(getExternalTime provider) {
+  sync_provider = provider;
+  next_sync_time = sys_time;
+  now();
+}
+
+
+void setSyncInterval(time_t interval) {
+  sync_interval = interval;
+  next_sync_time = sys_time + interval;
+}
+
+
+int hour(time_t t)    {tmElements_t tm; breakTime(t, tm); return tm.Hour;}
+int minute(time_t t)  {tmElements_t tm; breakTime(t, tm); return tm.Minute;}
+int second(time_t t)  {tmElements_t tm; breakTime(t, tm); return tm.Second;}
+int day(time_t t)     {tmElements_t tm; breakTime(t, tm); return tm.Day;}
+int weekday(time_t t) {tmElements_t tm; breakTime(t, tm); return tm.Wday;}
+int month(time_t t)   {tmElements_t tm; breakTime(t, tm); return tm.Month;}
+int year(time_t t)    {tmElements_t tm; breakTime(t, tm); return tm.Year + 1970;}
+
+
+const char *monthShortStr(uint8_t month) {
+  static const char *const names[] = {"Err", "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  return names[month <= 12 ? month : 0];
+}
+
+
+const char *dayShortStr(uint8_t day) {
+  static const char *const names[] = {"Err", "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+  return names[day <= 7 ? day : 0];
+}
+
+
+// ----- Timezone (same rules as the Timezone library) -----
+
+time_t Timezone::change_time(const TimeChangeRule &rule, int year) {
+  uint8_t month = rule.month;
+  uint8_t week = rule.week;
+  if (week == Last) { // last week of the month: find the first one in the next month and go back a week
+    if (++month > 12) {
+      month = 1;
+      year++;
+    }
+    week = First;
+  }
+  tmElements_t tm = {0, 0, rule.hour, 0, 1, month, (uint8_t)(year - 1970)};
+  time_t t = makeTime(tm);
+  t += ((rule.dow - weekday(t) + 7) % 7 + (week - 1) * 7) * 86400;
+  if (rule.week == Last) {t -= 7 * 86400;}
+  return t;
+}
+
+
+time_t Timezone::toLocal(time_t utc, TimeChangeRule **rule) {
+  int y = year(utc);
+  time_t dst_utc = change_time(dst_rule, y) - std_rule.offset * 60;
+  time_t std_utc = change_time(std_rule, y) - dst_rule.offset * 60;
+  bool dst = (dst_utc < std_utc) ? (utc >= dst_utc && utc < std_utc) : !(utc >= std_utc && utc < dst_utc);
+  TimeChangeRule *current = dst ? &dst_rule : &std_rule;
+  if (rule != nullptr) {*rule = current;}
+  return utc + current->offset * 60;
+}
+
+
+time_t Timezone::toUTC(time_t local) {
+  int y = year(local);
+  time_t dst_local = change_time(dst_rule, y);
+  time_t std_local = change_time(std_rule, y);
+  bool dst = (std_local > dst_local) ? (local >= dst_local && local < std_local) : !(local >= std_local && local < dst_local);
+  return local - (dst ? dst_rule.offset : std_rule.offset) * 60;
+}
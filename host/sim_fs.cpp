@@ -0,0 +1,84 @@
+// Host simulation: LittleFS kept in memory (each write takes sim_flash_write_us of virtual time)
+
+#include "sim.h"
+
+sim_file_system LittleFS;
+uint64_t sim_flash_write_us = 3000;
+
+
+bool sim_file_system::begin() {
+  mounted = !broken;
+  return mounted;
+}
+
+
+bool sim_file_system::format() {
+  if (broken) {return false;}
+  files.clear();
+  return true;
+}
+
+
+File sim_file_system::open(const char *path, const char *mode) {
+  if (!mounted) {return File();}
+  bool exists = files.count(path) > 0;
+  if (mode[0] == 'r') {
+    if (!exists) {return File();}
+    return File(path, false, 0);
+  }
+  if (mode[0] == 'w' || !exists) {files[path].clear();}
+  return File(path, true, files[path].size());
+}
+
+
+bool sim_file_system::rename(const char *from, const char *to) {
+  if (!mounted || files.count(from) == 0) {return false;}
+  files[to] = files[from];
+  files.erase(from);
+  return true;
+}
+
+
+bool sim_file_system::exists(const char *path) {
+  return files.count(path) > 0;
+}
+
+
+size_t File::read(uint8_t *data, size_t length) {
+  if (!open || LittleFS.files.count(path) == 0) {return 0;}
+  const std::vector<uint8_t> &contents = LittleFS.files[path];
+  if (position >= contents.size()) {return 0;}
+  if (length > contents.size() - position) {length = contents.size() - position;}
+  memcpy(data, contents.data() + position, length);
+  position += length;
+  return length;
+}
+
+
+size_t File::write(const uint8_t *data, size_t length) {
+  if (!open || !writable) {return 0;}
+  std::vector<uint8_t> &contents = LittleFS.files[path];
+  if (contents.size() < position + length) {contents.resize(position + length);}
+  memcpy(contents.data() + position, data, length);
+  position += length;
+  sim_charge_us(sim_flash_write_us);
+  return length;
+}
+
+
+bool File::seek(size_t pos) {
+  if (!open || pos > size()) {return false;}
+  position = pos;
+  return true;
+}
+
+
+size_t File::size() const {
+  auto file = LittleFS.files.find(path);
+  return (open && file != LittleFS.files.end()) ? file->second.size() : 0;
+}
+
+
+void File::close() {
+  open = false;
+}
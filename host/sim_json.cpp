@@ -0,0 +1,309 @@
+// Host simulation: the parts of ArduinoJson main_v3.cpp uses (parsing reads the stream one byte at a time with the
+// stream's timeout, like ArduinoJson does)
+
+#include "sim.h"
+
+
+sim_json_value *sim_json_value::member(const char *key) {
+  for (auto &m : members) {
+    if (m.first == key) {return &m.second;}
+  }
+  return nullptr;
+}
+
+
+sim_json_value &sim_json_value::add_member(const char *key) {
+  sim_json_value *value = member(key);
+  if (value != nullptr) {return *value;}
+  members.push_back({key, sim_json_value()});
+  return members.back().second;
+}
+
+
+JsonVariant &JsonVariant::operator=(bool value) {
+  sim_json_value &v = object->add_member(key.c_str());
+  v = sim_json_value();
+  v.type = sim_json_value::type_bool;
+  v.boolean = value;
+  return *this;
+}
+
+
+JsonVariant &JsonVariant::operator=(const char *value) {
+  sim_json_value &v = object->add_member(key.c_str());
+  v = sim_json_value();
+  v.type = sim_json_value::type_string;
+  v.text = value != nullptr ? value : "";
+  return *this;
+}
+
+
+JsonVariant &JsonVariant::set_integer(long long value) {
+  sim_json_value &v = object->add_member(key.c_str());
+  v = sim_json_value();
+  v.type = sim_json_value::type_integer;
+  v.integer = value;
+  return *this;
+}
+
+
+JsonVariant &JsonVariant::set_float(double value) {
+  sim_json_value &v = object->add_member(key.c_str());
+  v = sim_json_value();
+  v.type = sim_json_value::type_float;
+  v.number = value;
+  return *this;
+}
+
+
+const sim_json_value *JsonVariant::find() const {
+  if (object == nullptr) {return nullptr;}
+  return object->member(key.c_str());
+}
+
+
+const char *JsonVariant::operator|(const char *fallback) const {
+  const sim_json_value *value = find();
+  return (value != nullptr && value->type == sim_json_value::type_string) ? value->text.c_str() : fallback;
+}
+
+
+JsonObject JsonDocument::createNestedObject(const char *key) {
+  sim_json_value &value = root.add_member(key);
+  value = sim_json_value();
+  value.type = sim_json_value::type_object;
+  return JsonObject(&value);
+}
+
+
+const char *DeserializationError::c_str() const {
+  static const char *names[] = {"Ok", "EmptyInput", "IncompleteInput", "InvalidInput", "NoMemory"};
+  return names[code];
+}
+
+
+// ----- Parsing -----
+
+// Reads JSON text from a stream (or a string), one byte at a time
+class json_reader {
+  public:
+    json_reader(Stream *stream, const char *text) : stream(stream), text(text) {}
+    int peek() {
+      if (stream != nullptr) {return stream->timedPeek();}
+      return *text != 0 ? (uint8_t)*text : -1;
+    }
+    int read() {
+      if (stream != nullptr) {return stream->timedRead();}
+      return *text != 0 ? (uint8_t)*text++ : -1;
+    }
+    int peek_token() { // next character that is not white space
+      while (peek() == ' ' || peek() == '\t' || peek() == '\r' || peek() == '\n') {read();}
+      return peek();
+    }
+  private:
+    Stream *stream;
+    const char *text;
+};
+
+
+static DeserializationError::Code parse_value(json_reader &in, sim_json_value *value, int depth);
+
+
+static DeserializationError::Code parse_string(json_reader &in, std::string *text) {
+  in.read(); // opening quote
+  while (true) {
+    int c = in.read();
+    if (c < 0) {return DeserializationError::IncompleteInput;}
+    if (c == '"') {return DeserializationError::Ok;}
+    if (c == '\\') {
+      c = in.read();
+      if (c < 0) {return DeserializationError::IncompleteInput;}
+      if (c == 'n') {c = '\n';}
+      else if (c == 'r') {c = '\r';}
+      else if (c == 't') {c = '\t';}
+      else if (c == 'b') {c = '\b';}
+      else if (c == 'f') {c = '\f';}
+      else if (c == 'u') {
+        char hex[5] = {0};
+        for (int i = 0; i < 4; i++) {
+          int h = in.read();
+          if (h < 0) {return DeserializationError::IncompleteInput;}
+          hex[i] = h;
+        }
+        c = strtol(hex, nullptr, 16);
+        if (c > 0x7f) {c = '?';}
+      }
+    }
+    if (text != nullptr) {*text += (char)c;}
+  }
+}
+
+
+static DeserializationError::Code parse_object(json_reader &in, sim_json_value *value, sim_json_value *filter, int depth) {
+  in.read(); // {
+  if (value != nullptr) {
+    *value = sim_json_value();
+    value->type = sim_json_value::type_object;
+  }
+  if (in.peek_token() == '}') {in.read(); return DeserializationError::Ok;}
+  while (true) {
+    if (in.peek_token() < 0) {return DeserializationError::IncompleteInput;}
+    if (in.peek_token() != '"') {return DeserializationError::InvalidInput;}
+    std::string key;
+    DeserializationError::Code error = parse_string(in, &key);
+    if (error != DeserializationError::Ok) {return error;}
+    int c = in.peek_token();
+    if (c < 0) {return DeserializationError::IncompleteInput;}
+    if (c != ':') {return DeserializationError::InvalidInput;}
+    in.read();
+    // with a filter, only the members it names are kept (the others are read and dropped)
+    sim_json_value *keep = nullptr;
+    if (value != nullptr) {
+      sim_json_value *wanted = filter != nullptr ? filter->member(key.c_str()) : nullptr;
+      if (filter == nullptr || (wanted != nullptr && wanted->type == sim_json_value::type_bool && wanted->boolean)) {keep = &value->add_member(key.c_str());}
+    }
+    error = parse_value(in, keep, depth + 1);
+    if (error != DeserializationError::Ok) {return error;}
+    c = in.peek_token();
+    if (c < 0) {return DeserializationError::IncompleteInput;}
+    in.read();
+    if (c == '}') {return DeserializationError::Ok;}
+    if (c != ',') {return DeserializationError::InvalidInput;}
+  }
+}
+
+
+static DeserializationError::Code parse_value(json_reader &in, sim_json_value *value, int depth) {
+  if (depth > 10) {return DeserializationError::InvalidInput;}
+  int c = in.peek_token();
+  if (c < 0) {return DeserializationError::IncompleteInput;}
+  if (c == '{') {return parse_object(in, value, nullptr, depth);}
+  if (c == '[') { // arrays are read and dropped
+    in.read();
+    if (in.peek_token() == ']') {in.read(); return DeserializationError::Ok;}
+    while (true) {
+      DeserializationError::Code error = parse_value(in, nullptr, depth + 1);
+      if (error != DeserializationError::Ok) {return error;}
+      c = in.peek_token();
+      if (c < 0) {return DeserializationError::IncompleteInput;}
+      in.read();
+      if (c == ']') {break;}
+      if (c != ',') {return DeserializationError::InvalidInput;}
+    }
+    if (value != nullptr) {*value = sim_json_value();}
+    return DeserializationError::Ok;
+  }
+  if (c == '"') {
+    std::string text;
+    DeserializationError::Code error = parse_string(in, &text);
+    if (error == DeserializationError::Ok && value != nullptr) {
+      *value = sim_json_value();
+      value->type = sim_json_value::type_string;
+      value->text = text;
+    }
+    return error;
+  }
+  std::string token; // number, true, false or null
+  while (in.peek() >= 0 && strchr("{}[],: \t\r\n\"", in.peek()) == nullptr) {token += (char)in.read();}
+  if (in.peek() < 0 && depth == 0) {} // a bare value at the end of the input is complete
+  else if (in.peek() < 0) {return DeserializationError::IncompleteInput;}
+  sim_json_value parsed;
+  if (token == "true" || token == "false") {
+    parsed.type = sim_json_value::type_bool;
+    parsed.boolean = token == "true";
+  }
+  else if (token == "null") {}
+  else {
+    char *end;
+    long long integer = strtoll(token.c_str(), &end, 10);
+    if (*end == 0 && !token.empty()) {
+      parsed.type = sim_json_value::type_integer;
+      parsed.integer = integer;
+    }
+    else {
+      double number = strtod(token.c_str(), &end);
+      if (*end != 0 || token.empty()) {return DeserializationError::InvalidInput;}
+      parsed.type = sim_json_value::type_float;
+      parsed.number = number;
+    }
+  }
+  if (value != nullptr) {*value = parsed;}
+  return DeserializationError::Ok;
+}
+
+
+static DeserializationError parse_document(JsonDocument &doc, json_reader &in, sim_json_value *filter) {
+  doc.clear();
+  int c = in.peek_token();
+  if (c < 0) {return DeserializationError::EmptyInput;}
+  if (c != '{') {return DeserializationError::InvalidInput;}
+  return parse_object(in, &doc.root, filter, 0);
+}
+
+
+DeserializationError deserializeJson(JsonDocument &doc, Stream &input, DeserializationOption::Filter filter) {
+  json_reader in(&input, nullptr);
+  return parse_document(doc, in, &filter.filter.root);
+}
+
+
+DeserializationError deserializeJson(JsonDocument &doc, const char *input) {
+  json_reader in(nullptr, input);
+  return parse_document(doc, in, nullptr);
+}
+
+
+// ----- Serializing -----
+
+static void write_value(std::string &out, const sim_json_value &value) {
+  char number[32];
+  switch (value.type) {
+    case sim_json_value::type_null: out += "null"; break;
+    case sim_json_value::type_bool: out += value.boolean ? "true" : "false"; break;
+    case sim_json_value::type_integer: out += std::to_string(value.integer); break;
+    case sim_json_value::type_float:
+      snprintf(number, sizeof(number), "%.9g", value.number);
+      out += number;
+      break;
+    case sim_json_value::type_string:
+      out += '"';
+      for (char c : value.text) {
+        if (c == '"' || c == '\\') {out += '\\'; out += c;}
+        else if (c == '\n') {out += "\\n";}
+        else if (c == '\r') {out += "\\r";}
+        else if (c == '\t') {out += "\\t";}
+        else {out += c;}
+      }
+      out += '"';
+      break;
+    case sim_json_value::type_object:
+      out += '{';
+      for (auto m = value.members.begin(); m != value.members.end(); m++) {
+        if (m != value.members.begin()) {out += ',';}
+        out += '"';
+        out += m->first;
+        out += "\":";
+        write_value(out, m->second);
+      }
+      out += '}';
+      break;
+  }
+}
+
+
+size_t serializeJson(const JsonDocument &doc, char *output, size_t size) {
+  std::string text;
+  write_value(text, doc.root);
+  if (size == 0) {return 0;}
+  size_t length = text.size() < size - 1 ? text.size() : size - 1;
+  memcpy(output, text.data(), length);
+  output[length] = 0;
+  return length;
+}
+
+
+size_t serializeJson(const JsonDocument &doc, Print &output) {
+  std::string text;
+  write_value(text, doc.root);
+  return output.write((const uint8_t *)text.data(), text.size());
+}
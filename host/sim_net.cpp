@@ -0,0 +1,361 @@
+// Host simulation: TCP and TLS connections to the simulated servers, DNS and the NTP server, the web server and its clients
+
+#include "sim.h"
+
+
+// HAL function (declared in main_v3.cpp)
+bool hal_host_by_name(const char *host, IPAddress &address);
+
+
+ArduinoOTAClass ArduinoOTA;
+MDNSResponder MDNS;
+
+uint64_t sim_dns_us = 20000;
+unsigned long sim_dns_lookups = 0;
+bool sim_dns_up = true;
+uint64_t sim_last_dns_lookup = 0;
+bool sim_ntp_up = true;
+uint64_t sim_ntp_rtt_us = 30000;
+time_t sim_utc_start = 1700000000;    // 2023-11-14 22:13:20 UTC
+double sim_clock_error_ppm = 0;
+
+static uint8_t next_session_id = 0;
+
+
+// Simulated servers by "host:port" (a function so servers can be registered by global objects in any file)
+static std::map<std::string, sim_server *> &servers() {
+  static std::map<std::string, sim_server *> registered;
+  return registered;
+}
+
+
+// Look up a host name (blocks for sim_dns_us)
+static void dns_lookup() {
+  sim_dns_lookups++;
+  sim_last_dns_lookup = sim_time_us();
+  sim_charge_us(sim_dns_us);
+}
+
+
+void sim_serve(const char *host, uint16_t port, sim_server *server) {
+  std::string name = std::string(host) + ":" + std::to_string(port);
+  if (server == nullptr) {servers().erase(name);}
+  else {servers()[name] = server;}
+}
+
+
+void sim_connection::reply(const std::string &data, uint64_t delay_us) {
+  uint64_t at = sim_time_us() + delay_us;
+  if (!replies.empty() && replies.back().first > at) {at = replies.back().first;} // bytes arrive in order
+  replies.push_back({at, data});
+}
+
+
+// ----- TCP and TLS connections -----
+
+int WiFiClient::connect(const char *host, uint16_t port) {
+  stop();
+  dns_lookup();
+  auto found = servers().find(std::string(host) + ":" + std::to_string(port));
+  if (found == servers().end()) {return 0;}
+  sim_server *server = found->second;
+  server->connections++;
+  sim_charge_us(server->connect_us);
+  if (secure) {
+    br_ssl_session_parameters *parameters = session != nullptr ? session->getSession() : nullptr;
+    if (parameters != nullptr && parameters->session_id_len > 0 && server->resume_sessions) {
+      sim_charge_us(server->resumed_handshake_us);
+    }
+    else {
+      sim_charge_us(server->handshake_us);
+      if (parameters != nullptr) {
+        memset(parameters->session_id, ++next_session_id, sizeof(parameters->session_id));
+        parameters->session_id_len = sizeof(parameters->session_id);
+      }
+    }
+  }
+  connection = std::make_shared<sim_connection>();
+  connection->server = server;
+  return 1;
+}
+
+
+uint8_t WiFiClient::connected() {
+  if (incoming != nullptr) {return !incoming->done;}
+  return connection != nullptr && (!connection->closed || available() > 0);
+}
+
+
+void WiFiClient::stop() {
+  if (incoming != nullptr && !incoming->done) {incoming->done = true;} // dropped without an answer
+  incoming = nullptr;
+  connection.reset();
+}
+
+
+int WiFiClient::available() {
+  if (incoming != nullptr) {return incoming->done ? 0 : incoming->arrived(sim_time_us()) - incoming->read;}
+  if (connection == nullptr) {return 0;}
+  int waiting = 0;
+  for (size_t i = 0; i < connection->replies.size() && connection->replies[i].first <= sim_time_us(); i++) {
+    waiting += connection->replies[i].second.size();
+  }
+  return waiting - connection->reply_offset;
+}
+
+
+int WiFiClient::read() {
+  int c = peek();
+  if (c < 0) {return c;}
+  if (incoming != nullptr) {
+    incoming->read++;
+    return c;
+  }
+  connection->reply_offset++;
+  if (connection->reply_offset == connection->replies[0].second.size()) {
+    connection->replies.erase(connection->replies.begin());
+    connection->reply_offset = 0;
+  }
+  return c;
+}
+
+
+int WiFiClient::peek() {
+  if (available() <= 0) {return -1;}
+  if (incoming != nullptr) {return (uint8_t)incoming->request[incoming->read];}
+  return (uint8_t)connection->replies[0].second[connection->reply_offset];
+}
+
+
+size_t WiFiClient::peekBytes(uint8_t *buffer, size_t length) {
+  if (incoming == nullptr) {return 0;}
+  size_t waiting = available();
+  if (length > waiting) {length = waiting;}
+  memcpy(buffer, incoming->request.data() + incoming->read, length);
+  return length;
+}
+
+
+size_t WiFiClient::write(const uint8_t *data, size_t length) {
+  if (incoming != nullptr) {return length;} // answers are sent with ESP8266WebServer::send()
+  if (connection == nullptr || connection->closed) {return 0;}
+  connection->received.append((const char *)data, length);
+  connection->server->receive(*connection);
+  return length;
+}
+
+
+// ----- NTP server -----
+
+static bool ntp_answer_waiting = false;
+static uint64_t ntp_request_time = 0;
+
+
+// Look up a host's address for UDP (the simulated NTP server is the only host looked up this way)
+bool hal_host_by_name(const char *host, IPAddress &address) {
+  dns_lookup();
+  if (!sim_dns_up) {return false;}
+  address = IPAddress(0x7f000001);
+  return true;
+}
+
+
+int WiFiUDP::beginPacket(IPAddress address, uint16_t port) {
+  if (!address.isSet()) {return 0;}
+  sending = true;
+  return 1;
+}
+
+
+int WiFiUDP::endPacket() {
+  if (!sending) {return 0;}
+  sending = false;
+  if (sim_ntp_up) {
+    ntp_answer_waiting = true;
+    ntp_request_time = sim_time_us();
+  }
+  return 1;
+}
+
+
+int WiFiUDP::parsePacket() {
+  return (ntp_answer_waiting && sim_time_us() >= ntp_request_time + sim_ntp_rtt_us) ? 48 : 0;
+}
+
+
+int WiFiUDP::read(uint8_t *data, size_t length) {
+  if (parsePacket() == 0 || length < 48) {return 0;}
+  ntp_answer_waiting = false;
+  // the server's clock when it answered (halfway through the round trip), running sim_clock_error_ppm faster than the virtual clock
+  double server_us = (double)sim_utc_start * 1e6 + (ntp_request_time + sim_ntp_rtt_us / 2) * (1 + sim_clock_error_ppm / 1e6);
+  uint64_t seconds = (uint64_t)(server_us / 1e6);
+  uint32_t fraction = (uint32_t)((server_us / 1e6 - seconds) * 4294967296.0);
+  uint32_t ntp_seconds = (uint32_t)(seconds + 2208988800ULL);
+  memset(data, 0, 48);
+  data[0] = 0x24; // NTP version 4, server mode
+  for (int i = 0; i < 4; i++) {
+    data[40 + i] = ntp_seconds >> (24 - 8 * i);
+    data[44 + i] = fraction >> (24 - 8 * i);
+  }
+  return 48;
+}
+
+
+// ----- Web server -----
+
+// Clients that have connected to the web server, in the order they connected (WiFiServer::accept() hands them out)
+static std::vector<sim_web_client *> &web_clients() {
+  static std::vector<sim_web_client *> waiting;
+  return waiting;
+}
+static sim_web_client *current_client = nullptr;
+
+
+sim_web_client::sim_web_client(const std::string &request, uint64_t byte_us) : request(request), start(sim_time_us()), byte_us(byte_us) {
+  web_clients().push_back(this);
+}
+
+
+sim_web_client::~sim_web_client() {
+  for (size_t i = 0; i < web_clients().size(); i++) {
+    if (web_clients()[i] == this) {web_clients().erase(web_clients().begin() + i);}
+  }
+}
+
+
+size_t sim_web_client::arrived(uint64_t at) const {
+  if (byte_us == 0) {return request.size();}
+  if (at < start) {return 0;}
+  size_t count = (at - start) / byte_us + 1;
+  return count < request.size() ? count : request.size();
+}
+
+
+// Has the whole request (headers and the body given by Content-Length) arrived?
+static bool request_complete(const std::string &text) {
+  size_t end = text.find("\r\n\r\n");
+  if (end == std::string::npos) {return false;}
+  const char *length = strcasestr(text.c_str(), "\r\nContent-Length:");
+  size_t body_length = (length != nullptr && length < text.c_str() + end) ? atol(length + 17) : 0;
+  return text.size() >= end + 4 + body_length;
+}
+
+
+// Decode a form encoded value (+ for spaces and %XX escapes)
+static std::string url_decode(const std::string &text) {
+  std::string decoded;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '+') {decoded += ' ';}
+    else if (text[i] == '%' && i + 2 < text.size()) {
+      decoded += (char)strtol(text.substr(i + 1, 2).c_str(), nullptr, 16);
+      i += 2;
+    }
+    else {decoded += text[i];}
+  }
+  return decoded;
+}
+
+
+// Add the name=value pairs of a query string or form body to the request arguments
+static void parse_args(const std::string &text, std::map<std::string, std::string> &args) {
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t end = text.find('&', pos);
+    if (end == std::string::npos) {end = text.size();}
+    std::string pair = text.substr(pos, end - pos);
+    size_t equals = pair.find('=');
+    if (!pair.empty()) {args[url_decode(pair.substr(0, equals))] = equals == std::string::npos ? "" : url_decode(pair.substr(equals + 1));}
+    pos = end + 1;
+  }
+}
+
+
+WiFiClient WiFiServer::accept() {
+  if (!listening) {return WiFiClient();}
+  for (sim_web_client *client : web_clients()) {
+    if (client->accepted) {continue;}
+    client->accepted = true;
+    client->accepted_at = sim_time_us();
+    return WiFiClient(client);
+  }
+  return WiFiClient();
+}
+
+
+void sim_web_server::on(const char *uri, HTTPMethod method, void (*handler)()) {
+  routes.push_back({uri, method, handler});
+}
+
+
+bool sim_web_server::serve(WiFiClient &connection) {
+  sim_web_client *client = connection.web_client();
+  if (connection.available() == 0) { // wait for the request to start, without holding up the caller
+    if (sim_time_us() - client->accepted_at <= HTTP_MAX_DATA_WAIT * 1000ULL) {return false;}
+    connection.stop();
+    return true;
+  }
+
+  // the library reads the request with a timeout once its first bytes have arrived, so a slow client holds up the caller
+  while (!request_complete(client->request.substr(0, client->arrived(sim_time_us())))) {
+    size_t arrived = client->arrived(sim_time_us());
+    uint64_t next_byte = client->start + arrived * client->byte_us;
+    if (arrived == client->request.size() || next_byte - sim_time_us() > HTTP_MAX_DATA_WAIT * 1000ULL) { // the request never finishes, drop the client
+      sim_charge_us(HTTP_MAX_DATA_WAIT * 1000ULL);
+      connection.stop();
+      return true;
+    }
+    sim_advance_us(next_byte - sim_time_us());
+  }
+  client->read = client->request.size();
+
+  const std::string &text = client->request;
+  std::string method = text.substr(0, text.find(' '));
+  size_t uri_start = method.size() + 1;
+  std::string uri = text.substr(uri_start, text.find(' ', uri_start) - uri_start);
+  args.clear();
+  size_t query = uri.find('?');
+  if (query != std::string::npos) {
+    parse_args(uri.substr(query + 1), args);
+    uri = uri.substr(0, query);
+  }
+  std::string body = text.substr(text.find("\r\n\r\n") + 4);
+  if (method == "POST" && strcasestr(text.c_str(), "Content-Type: application/x-www-form-urlencoded") != nullptr) {parse_args(body, args);}
+
+  current_client = client;
+  content_length = 0;
+  HTTPMethod request_method = (method == "POST") ? HTTP_POST : HTTP_GET;
+  bool handled = false;
+  for (const route &r : routes) {
+    if (r.uri == uri && (r.method == HTTP_ANY || r.method == request_method)) {
+      r.handler();
+      handled = true;
+      break;
+    }
+  }
+  if (!handled) {send(404, "text/plain", String("Not found: ") + uri.c_str());}
+  client->done = true;
+  current_client = nullptr;
+  return true;
+}
+
+
+void sim_web_server::send(int code, const char *content_type, const String &content) {
+  if (current_client == nullptr) {return;}
+  current_client->status = code;
+  current_client->content_type = content_type;
+  current_client->answered_at = sim_time_us();
+  if (content_length != CONTENT_LENGTH_UNKNOWN) {current_client->body = content.text;}
+  else {current_client->body.clear();} // the content follows with sendContent()
+}
+
+
+void sim_web_server::sendContent(const char *content, size_t length) {
+  if (current_client == nullptr) {return;}
+  current_client->body.append(content, length);
+}
+
+
+String sim_web_server::arg(const char *name) const {
+  auto found = args.find(name);
+  return String(found != args.end() ? found->second.c_str() : "");
+}
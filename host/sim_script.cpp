@@ -0,0 +1,173 @@
+// Host simulation: stand-in for the Google Sheets script (see sim_script.h)
+
+#include "sim_script.h"
+
+
+sim_google_script::sim_google_script() : post_endpoint(this, false), redirect_endpoint(this, true) {
+  config["target"] = "128";
+  config["filter"] = "500";
+  config["a"] = "8";
+  config["b"] = "16";
+  config["c"] = "24";
+  config["d"] = "32";
+  config["e"] = "40";
+  config["afterhours_start"] = "-1";
+  config["afterhours_stop"] = "-1";
+  sim_serve("script.google.com", 443, &post_endpoint);
+  sim_serve("script.googleusercontent.com", 443, &redirect_endpoint);
+}
+
+
+sim_google_script::~sim_google_script() {
+  sim_serve("script.google.com", 443, nullptr);
+  sim_serve("script.googleusercontent.com", 443, nullptr);
+}
+
+
+static std::string base64_decode(const std::string &text) {
+  static const std::string digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string decoded;
+  uint32_t bits = 0;
+  int count = 0;
+  for (char c : text) {
+    size_t digit = digits.find(c);
+    if (digit == std::string::npos) {continue;} // padding
+    bits = (bits << 6) | digit;
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      decoded += (char)((bits >> count) & 0xff);
+    }
+  }
+  return decoded;
+}
+
+
+// Reads a batch the same way decode_batch() in the script does (returns false if it is too short or has an unknown format)
+static bool decode_batch(const std::string &data, sim_script_batch &batch) {
+  size_t pos = 0;
+  bool ok = true;
+  auto next_byte = [&]() -> uint32_t {
+    if (pos >= data.size()) {ok = false; return 0;}
+    return (uint8_t)data[pos++];
+  };
+  auto next_varint = [&]() -> uint32_t {
+    uint32_t value = 0;
+    int shift = 0;
+    uint32_t b;
+    do {
+      b = next_byte();
+      value |= (b & 0x7f) << shift;
+      shift += 7;
+    } while ((b & 0x80) && ok && shift < 35);
+    return value;
+  };
+  batch.format = next_byte();
+  if (batch.format != 3) {return false;}
+  batch.command = next_byte();
+  batch.flow_meter = (next_byte() & 1) != 0;
+  uint32_t version_length = next_byte();
+  for (uint32_t i = 0; i < version_length; i++) {batch.config += (char)next_byte();}
+  if (batch.command == 0) {return ok;}
+  if (batch.flow_meter) {batch.pulses_per_gallon = next_varint();}
+  batch.first = next_varint();
+  batch.end = batch.first + next_varint();
+  uint32_t count = next_varint();
+  batch.duration = next_varint();
+  if (batch.flow_meter) {batch.pulses = next_varint();}
+  int64_t start = 0;
+  uint32_t sequence = batch.first;
+  for (uint32_t n = 0; n < count && ok; n++) {
+    sim_script_event event = {};
+    sequence += next_varint();
+    uint32_t change = next_varint();
+    start += (change & 1) ? -(int64_t)((change + 1) / 2) : (int64_t)(change / 2);
+    event.sequence = sequence++;
+    event.start = (uint32_t)start;
+    event.duration = next_varint();
+    event.mode = next_byte();
+    event.synced = (event.mode & 0x80) != 0;
+    event.mode &= 0x7f;
+    if (batch.flow_meter) {event.pulses = next_varint();}
+    batch.events.push_back(event);
+  }
+  return ok;
+}
+
+
+std::string sim_google_script::run(const std::string &body) {
+  sim_script_batch batch;
+  batch.received_at = sim_time_us();
+  if (!decode_batch(base64_decode(body), batch)) {return "Error in parsing request body: batch is too short";}
+  batches.push_back(batch);
+
+  if (batch.command == 1) { // insert_row
+    gallons += batch.flow_meter ? (double)batch.pulses / batch.pulses_per_gallon : batch.duration * conversion / 1000;
+  }
+  if (batch.command == 2) { // insert_events
+    for (const sim_script_event &event : batch.events) {
+      if (have_last_batch && batch.first >= last_first && event.sequence < last_end) {continue;} // already logged by an earlier try
+      if (event.duration == 0 || event.duration > 600000 || event.mode > 2) {continue;}
+      logged.push_back(event);
+      gallons += batch.flow_meter ? (double)event.pulses / batch.pulses_per_gallon : event.duration * conversion / 1000;
+    }
+    if (!have_last_batch || batch.first < last_first || batch.end > last_end) {
+      have_last_batch = true;
+      last_first = batch.first;
+      last_end = batch.end;
+    }
+  }
+
+  char number[32];
+  snprintf(number, sizeof(number), "%.6g", gallons);
+  std::string json = std::string("{\"gallons\":") + number + ",\"version\":\"" + version + "\"";
+  if (batch.command != 0 && reply_logged) {json += ",\"logged\":" + std::to_string(batch.end + logged_offset);}
+  if (batch.config != version) { // config values are only sent when they have changed
+    snprintf(number, sizeof(number), "%.6g", conversion);
+    json += std::string(",\"conversion\":") + number;
+    for (const auto &value : config) {json += ",\"" + value.first + "\":" + value.second;}
+  }
+  return json + "}";
+}
+
+
+// Answer a request once all of it has arrived
+void sim_google_script::endpoint::receive(sim_connection &connection) {
+  size_t header_end = connection.received.find("\r\n\r\n");
+  if (header_end == std::string::npos) {return;}
+  const char *length = strcasestr(connection.received.c_str(), "\r\nContent-Length:");
+  size_t body_length = (length != nullptr && length < connection.received.c_str() + header_end) ? atol(length + 17) : 0;
+  if (connection.received.size() < header_end + 4 + body_length) {return;}
+  std::string headers = connection.received.substr(0, header_end);
+  std::string body = connection.received.substr(header_end + 4, body_length);
+  connection.received.erase(0, header_end + 4 + body_length);
+
+  if (!redirect) {
+    script->posts++;
+    if (headers.compare(0, 5, "POST ") != 0 || script->post_status != 302) {
+      int status = headers.compare(0, 5, "POST ") != 0 ? 405 : script->post_status;
+      connection.reply("HTTP/1.1 " + std::to_string(status) + " Error\r\nContent-Length: 0\r\n\r\n", script->run_us);
+      return;
+    }
+    std::string key = std::to_string(script->next_key++);
+    script->responses[key] = script->run(body);
+    connection.reply("HTTP/1.1 302 Moved Temporarily\r\nContent-Type: text/html; charset=UTF-8\r\n"
+                     "Location: https://script.googleusercontent.com/macros/echo?user_content_key=" + key + "&lib=x\r\n"
+                     "Content-Length: 0\r\n\r\n", script->run_us);
+    return;
+  }
+
+  script->gets++;
+  size_t key_start = headers.find("user_content_key=");
+  std::string key = key_start == std::string::npos ? "" : headers.substr(key_start + 17, headers.find_first_of("& ", key_start + 17) - (key_start + 17));
+  auto response = script->responses.find(key);
+  if (headers.compare(0, 4, "GET ") != 0 || response == script->responses.end()) {
+    connection.reply("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n", script->redirect_us);
+    return;
+  }
+  char chunk_size[16];
+  snprintf(chunk_size, sizeof(chunk_size), "%zx", response->second.size());
+  connection.reply("HTTP/1.1 200 OK\r\nContent-Type: application/json; charset=utf-8\r\nTransfer-Encoding: chunked\r\n\r\n" +
+                   std::string(chunk_size) + "\r\n" + response->second + "\r\n0\r\n\r\n", script->redirect_us);
+  script->responses.erase(response);
+}
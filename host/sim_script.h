@@ -0,0 +1,66 @@
+//  Host simulation: stand-in for the Google Sheets script (google-sheets-script.gs)
+//  Serves https://script.google.com/macros/s/.../exec like Google does: the POST runs the script and is answered with a
+//  302 redirect to script.googleusercontent.com, where a GET returns the script's JSON response (chunked, like Google).
+//  Batches are decoded and logged with the same rules as the script, so tests can check what reached the spreadsheet.
+
+#pragma once
+
+#include "sim.h"
+
+struct sim_script_event {
+  uint32_t sequence;
+  uint32_t start;                     // unix time
+  uint32_t duration;                  // ms
+  uint8_t mode;                       // dispense_modes (without the synced flag)
+  bool synced;                        // was the clock synced when the event was saved?
+  uint32_t pulses;
+};
+
+struct sim_script_batch {
+  int format = 0;
+  int command = 0;                    // batch_commands
+  bool flow_meter = false;
+  std::string config;                 // config version the dispenser has
+  uint32_t pulses_per_gallon = 0;
+  uint32_t first = 0;
+  uint32_t end = 0;
+  uint32_t duration = 0;
+  uint32_t pulses = 0;
+  std::vector<sim_script_event> events;
+  uint64_t received_at = 0;           // virtual time the POST arrived (us)
+};
+
+class sim_google_script {
+  public:
+    sim_google_script();              // starts serving script.google.com and script.googleusercontent.com
+    ~sim_google_script();
+    std::vector<sim_script_batch> batches; // every batch POSTed, in order
+    std::vector<sim_script_event> logged;  // events added to the spreadsheet (a batch sent again only adds the events it did not log)
+    double gallons = 0;               // total gallons
+    std::string version = "1";        // config version
+    std::map<std::string, std::string> config; // config values (JSON text) sent when the dispenser's version is not version
+    double conversion = 0.0125;       // gallons per second (config "conversion")
+    uint64_t run_us = 1500000;        // time the script takes to run before the POST is answered (us)
+    uint64_t redirect_us = 200000;    // time the redirected GET takes to answer (us)
+    int post_status = 302;            // status the POST is answered with (anything else fails the publish)
+    bool reply_logged = true;         // send "logged" in the response (false is like a script from before it was added)
+    int logged_offset = 0;            // added to "logged" in the response (like a script that stopped part way through the batch)
+    unsigned long posts = 0;          // number of POSTs received
+    unsigned long gets = 0;           // number of redirected GETs received
+  private:
+    class endpoint : public sim_server {
+      public:
+        endpoint(sim_google_script *script, bool redirect) : script(script), redirect(redirect) {}
+        void receive(sim_connection &connection);
+        sim_google_script *script;
+        bool redirect;                // is this script.googleusercontent.com?
+    };
+    std::string run(const std::string &body); // run the script on a POSTed body, returns the JSON response
+    endpoint post_endpoint;
+    endpoint redirect_endpoint;
+    std::map<std::string, std::string> responses; // JSON responses waiting to be fetched, by user_content_key
+    unsigned long next_key = 1;
+    uint32_t last_first = 0;          // event numbers covered by the last batch logged (the script's last_batch property)
+    uint32_t last_end = 0;
+    bool have_last_batch = false;
+};
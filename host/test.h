@@ -0,0 +1,84 @@
+//  Host tests: checks and helpers for driving the dispenser logic on the virtual clock
+//  (each test includes main_v3.cpp first, so the helpers can use the dispenser's own pins and state)
+
+#pragma once
+
+#include "sim.h"
+
+static int check_failures = 0;
+
+// Report a failed check without stopping the test (set SIM_ECHO=1 to see the dispenser's serial output as well)
+#define check(condition) do { \
+    if (!(condition)) { \
+      printf("%s:%d: check failed: %s (at %.3f s)\n", __FILE__, __LINE__, #condition, sim_time_us() / 1e6); \
+      check_failures++; \
+    } \
+  } while (0)
+
+
+// Time the dispenser spends outside loop() on each pass (the interrupts and the rest of the ESP8266 core run here on the device)
+#define pass_gap_us       50
+
+
+// Run the loop until ms of virtual time have passed
+void run_for(uint64_t ms) {
+  uint64_t end = sim_time_us() + ms * 1000;
+  while (sim_time_us() < end) {
+    loop();
+    sim_advance_us(pass_gap_us);
+  }
+}
+
+
+// Run the loop until a condition is true or ms of virtual time have passed (returns the condition)
+template <class F> bool run_until(F condition, uint64_t ms) {
+  uint64_t end = sim_time_us() + ms * 1000;
+  while (!condition() && sim_time_us() < end) {
+    loop();
+    sim_advance_us(pass_gap_us);
+  }
+  return condition();
+}
+
+
+// Start the dispenser with nothing in front of the sensors and the button up
+void begin_dispenser() {
+  sim_serial_echo = getenv("SIM_ECHO") != nullptr;
+  sim_set_pin(ir1_input, HIGH);
+  sim_set_pin(ir2_input, HIGH);
+  sim_set_pin(switch1_input, LOW);
+  setup();
+}
+
+
+bool valve_is_open() {
+  return sim_pin_level(valve_output) == HIGH;
+}
+
+
+void place_glass() {
+  sim_set_pin(ir1_input, LOW);
+}
+
+
+void remove_glass() {
+  sim_set_pin(ir1_input, HIGH);
+}
+
+
+void press_button() {
+  sim_set_pin(switch1_input, HIGH);
+}
+
+
+void release_button() {
+  sim_set_pin(switch1_input, LOW);
+}
+
+
+// Print the result and return the exit code for ctest
+int test_result(const char *name) {
+  if (check_failures == 0) {printf("%s: passed\n", name);}
+  else {printf("%s: %d checks failed\n", name, check_failures);}
+  return check_failures == 0 ? 0 : 1;
+}
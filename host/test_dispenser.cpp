@@ -0,0 +1,53 @@
+// Host test: the dispenser starts, fills a glass, syncs the time, and publishes the event to the stand-in Google Sheets script
+
+#include "../main_v3.cpp"
+#include "test.h"
+#include "sim_script.h"
+
+sim_google_script script;
+
+
+int main() {
+  begin_dispenser();
+  check(!valve_is_open());
+  check(sim_led_count == led_count && sim_leds[0] == rgb_color(255, 0, 0)); // red until WiFi connects
+
+  // WiFi connects, the network services start and the time is synced
+  check(run_until([] {return network_started;}, 5000));
+  check(run_until([] {return time_synced;}, 2000));
+  check((uint32_t)now() - sim_utc_start < 10);
+
+  // a glass is filled
+  place_glass();
+  run_for(ir_input_delay + 20);
+  check(valve_is_open());
+  run_for(3000);
+  remove_glass();
+  run_for(turn_off_delay + 50);
+  check(!valve_is_open());
+  check(next_event == 1);
+  run_for(display_off_delay + 500);
+  check(!display_on);
+
+  // the event is published once the dispenser has been idle for log_delay, and the config comes back in the response
+  check(run_until([] {return unsent_event == 1;}, log_delay + 30000));
+  check(script.batches.size() >= 1);
+  check(script.logged.size() == 1);
+  if (script.logged.size() == 1) {
+    check(script.logged[0].sequence == 0);
+    check(script.logged[0].duration > 2900 && script.logged[0].duration < 3600);
+    check(script.logged[0].mode == dispense_sensor);
+    check(script.logged[0].synced);
+  }
+  check(run_until([] {return publish_state == publish_idle;}, publish_timeout));
+  check(function_2_oz == 16);
+  check(strcmp(config_version, script.version.c_str()) == 0);
+
+  // the status page reports the event as published
+  sim_web_client client("GET /status HTTP/1.1\r\nHost: water-dispenser.local\r\n\r\n");
+  check(run_until([&] {return client.done;}, 1000));
+  check(client.status == 200);
+  check(client.body.find("\"events_waiting\":0") != std::string::npos);
+
+  return test_result("dispenser");
+}
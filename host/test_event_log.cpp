@@ -0,0 +1,60 @@
+// Host test: events are only skipped once the file holding them has been reused, including at the boundaries between files
+
+#include "../main_v3.cpp"
+#include "test.h"
+
+
+// Save events until next_event reaches end
+void log_events_until(uint32_t end) {
+  while (next_event < end) {log_event(1000, dispense_sensor, 0);}
+}
+
+
+// Can every event waiting to be published still be read?
+bool unsent_events_readable() {
+  dispense_event event;
+  for (uint32_t sequence = unsent_event; sequence < next_event; sequence++) {
+    if (!read_event(sequence, event)) {return false;}
+  }
+  return true;
+}
+
+
+int main() {
+  sim_wifi_up = false; // nothing is published, so the log fills up
+  begin_dispenser();
+  const uint32_t log_size = events_per_segment * event_segments;
+
+  // every file is full, none has been reused yet
+  log_events_until(log_size);
+  check(unsent_event == 0);
+  check(dropped_events == 0);
+  check(unsent_events_readable());
+
+  // the first event in the reused file overwrites the oldest file
+  log_events_until(log_size + 1);
+  check(unsent_event == events_per_segment);
+  check(dropped_events == events_per_segment);
+  check(unsent_events_readable());
+
+  // the reused file is full, the second oldest file is still intact
+  log_events_until(log_size + events_per_segment);
+  check(unsent_event == events_per_segment);
+  check(dropped_events == events_per_segment);
+  check(unsent_events_readable());
+
+  // the same after a restart (the log is read back from flash)
+  begin_event_log();
+  check(next_event == log_size + events_per_segment);
+  check(unsent_event == events_per_segment);
+  check(unsent_events_readable());
+
+  // the next event reuses the second oldest file
+  unsigned long dropped_before = dropped_events;
+  log_events_until(log_size + events_per_segment + 1);
+  check(unsent_event == 2 * events_per_segment);
+  check(dropped_events - dropped_before == events_per_segment);
+  check(unsent_events_readable());
+
+  return test_result("event log");
+}
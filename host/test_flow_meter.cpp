@@ -0,0 +1,62 @@
+// Host test: automatic dispense with a flow meter, from slow pulse trains up to several kHz, and with a flow meter that stops counting
+
+#include "../main_v3.cpp"
+#include "test.h"
+
+const double pulse_rates[] = {20, 100, 500, 1000, 2000, 4000, 8000}; // flow meter pulse rates (Hz)
+uint64_t valve_opened_at = 0; // virtual time the valve was last opened (us)
+uint64_t valve_closed_at = 0; // virtual time the valve was last closed (us)
+
+
+// Note when the valve opens and closes
+void watch_valve(uint8_t pin, uint8_t level) {
+  if (pin != valve_output) {return;}
+  if (level == HIGH) {valve_opened_at = sim_time_us();}
+  else {valve_closed_at = sim_time_us();}
+}
+
+
+// Hold the button to the first preset and release it, returns true once the valve is open
+bool start_preset_1() {
+  press_button();
+  run_for(button_hold_time + 100);
+  release_button();
+  return run_until([] {return valve_is_open();}, 500);
+}
+
+
+int main() {
+  flow_meter_installed = true;
+  sim_wifi_up = false;
+  sim_write_hook = watch_valve;
+  begin_dispenser();
+  function_1_oz = 40; // set here instead of coming from Google Sheets
+  conversion_factor = 0.0125;
+  run_for(100);
+
+  // the valve closes once the flow meter has counted the amount selected, and no pulse is missed at any rate
+  for (double hz : pulse_rates) {
+    check(start_preset_1());
+    uint32_t selected = automatic_dispense_pulses;
+    check(selected == 40 * flow_pulses_per_gallon / 128);
+    sim_pulse_train(flow_input, hz, selected + 100);
+    check(run_until([] {return !valve_is_open();}, 60000));
+    dispense_event event;
+    check(read_event(next_event - 1, event));
+    check(event.pulses >= selected && event.pulses <= selected + hz * 2 / 1000 + 1); // closed within 2 ms of the last pulse needed
+    run_for(100 * 1000 / hz + display_off_delay + 500); // rest of the pulse train
+    check(flow_pulses == sim_pulses_sent(flow_input));
+    printf("%5.0f Hz: valve closed after %.1f ms, %u pulses dispensed (%u selected)\n", hz, (valve_closed_at - valve_opened_at) / 1000.0, event.pulses, selected);
+  }
+
+  // a flow meter that stops counting: the valve still closes, after flow_time_limit times the calculated dispense time
+  check(start_preset_1());
+  check(run_until([] {return !valve_is_open();}, automatic_dispense_time * flow_time_limit + 1000));
+  uint64_t time_limit = (uint64_t)automatic_dispense_time * flow_time_limit;
+  uint64_t open_ms = (valve_closed_at - valve_opened_at) / 1000;
+  check(open_ms + 2 >= time_limit && open_ms < time_limit + 50); // the task runs on whole ms, so allow for rounding
+  printf("flow meter not counting: valve closed after %lu ms (time limit %lu ms)\n", (unsigned long)open_ms, (unsigned long)time_limit);
+  check(error_status == 0);
+
+  return test_result("flow meter");
+}
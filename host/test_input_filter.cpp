@@ -0,0 +1,153 @@
+// Host test: sensor and pushbutton traces through the input filters (filter_sample() and filter_update() on their own, then the
+// same kind of traces on the simulated pins through the interrupts, the input queue and the loop)
+// Traces are written as "ms:level" edges, like the logic analyzer captures of the sensors they are modelled on.
+
+#include "../main_v3.cpp"
+#include "test.h"
+
+// IR sensor ghost triggers: dust and reflections pull the output LOW for a few ms
+const char *ghost_trace = "0:1 100:0 105:1 300:0 320:1 500:0 545:1 700:0 759:1 1000:0 1030:1 1040:0 1070:1";
+// longer ghost triggers, 60 to 99 ms (the sensor was read again after 100 ms before the filter, so these never opened the valve)
+const char *long_ghost_trace = "0:1 100:0 160:1 300:0 375:1 500:0 590:1 700:0 799:1 900:0 960:1 970:0 1050:1 1200:0 1299:1";
+// glass at the edge of the sensor's range: the output flickers with no part held for ir_input_delay
+const char *edge_trace = "0:1 100:0 130:1 140:0 185:1 190:0 240:1 260:0 300:1 310:0 355:1 380:0 430:1 500:0 550:1";
+// glass in range, then moved about near the edge while filling: short gaps under turn_off_delay, then taken away
+const char *filling_trace = "0:1 100:0 1500:1 1600:0 1620:1 1900:0 2300:1 2310:0 2340:1 2600:0 3500:1";
+// pushbutton press and release, both with contact bounce shorter than sw_input_delay
+const char *button_trace = "0:0 100:1 101:0 103:1 104:0 108:1 112:0 113:1 600:0 601:1 603:0 606:1 607:0";
+
+
+struct trace_edge {
+  unsigned long ms;
+  int level;
+};
+
+
+std::vector<trace_edge> parse_trace(const char *trace) {
+  std::vector<trace_edge> edges;
+  const char *pos = trace;
+  while (*pos != 0) {
+    char *end;
+    unsigned long ms = strtoul(pos, &end, 10);
+    int level = strtol(end + 1, &end, 10);
+    edges.push_back({ms, level});
+    pos = (*end == ' ') ? end + 1 : end;
+  }
+  return edges;
+}
+
+
+// Run a trace through a filter, sampled like the loop does (every edge, and an update every ms), and return the times the output changed (ms)
+std::vector<unsigned long> filter_trace(const char *trace, uint8_t input, unsigned long length_ms) {
+  input_filter filter = input_filters[input];
+  std::vector<trace_edge> edges = parse_trace(trace);
+  filter.raw = filter.output = input_active(input, edges[0].level);
+  filter.raw_change = 0;
+  std::vector<unsigned long> changes;
+  size_t next = 1;
+  for (unsigned long ms = 0; ms <= length_ms; ms++) {
+    bool output = filter.output;
+    while (next < edges.size() && edges[next].ms == ms) {
+      filter_sample(filter, input_active(input, edges[next].level), ms * 1000);
+      next++;
+    }
+    filter_update(filter, ms * 1000);
+    if (filter.output != output) {changes.push_back(ms);}
+  }
+  return changes;
+}
+
+
+int valve_opens = 0;
+int valve_closes = 0;
+
+
+// Count the valve opening and closing
+void count_valve(uint8_t pin, uint8_t level) {
+  static uint8_t valve_level = LOW;
+  if (pin != valve_output || level == valve_level) {return;}
+  valve_level = level;
+  if (level == HIGH) {valve_opens++;}
+  else {valve_closes++;}
+}
+
+
+// Play a trace on a pin starting now (the edges happen at their exact times while the loop runs)
+void play_trace(uint8_t pin, const char *trace) {
+  uint64_t start = sim_time_us();
+  for (const trace_edge &edge : parse_trace(trace)) {sim_schedule_pin(pin, edge.level, start + edge.ms * 1000);}
+}
+
+
+int main() {
+  std::vector<unsigned long> changes;
+
+  // ----- the filters on their own -----
+
+  changes = filter_trace(ghost_trace, input_ir1, 2000);
+  check(changes.empty());
+
+  changes = filter_trace(long_ghost_trace, input_ir1, 2000);
+  check(changes.empty()); // no ghost pulse is held for ir_input_delay, the 99 ms one included
+
+  changes = filter_trace(edge_trace, input_ir1, 2000);
+  check(changes.empty());
+
+  changes = filter_trace(filling_trace, input_ir1, 5000);
+  check(changes.size() == 2);
+  if (changes.size() == 2) {
+    check(changes[0] == 100 + ir_input_delay);     // on once held for ir_input_delay
+    check(changes[1] == 3500 + turn_off_delay);    // the gaps while filling are shorter than turn_off_delay
+  }
+
+  changes = filter_trace(button_trace, input_switch1, 1000);
+  check(changes.size() == 2);
+  if (changes.size() == 2) {
+    check(changes[0] == 113 + sw_input_delay);     // one press, sw_input_delay after the last bounce
+    check(changes[1] == 607 + sw_input_delay);     // one release
+  }
+
+  // a sensor held exactly ir_input_delay turns on, and one held 1 ms less does not
+  check(filter_trace("0:1 100:0 200:1", input_ir1, 1000).size() == 2);
+  check(filter_trace("0:1 100:0 199:1", input_ir1, 1000).empty());
+
+  // ----- the same traces on the dispenser -----
+
+  sim_wifi_up = false;
+  sim_write_hook = count_valve;
+  begin_dispenser();
+  run_for(100);
+
+  play_trace(ir1_input, ghost_trace);
+  run_for(2000);
+  check(valve_opens == 0);
+
+  play_trace(ir2_input, long_ghost_trace);
+  run_for(2000);
+  check(valve_opens == 0);
+
+  play_trace(ir2_input, edge_trace);
+  run_for(2000);
+  check(valve_opens == 0);
+
+  play_trace(ir1_input, filling_trace);
+  run_for(5000);
+  check(valve_opens == 1);
+  check(valve_closes == 1);
+  check(!valve_is_open());
+  run_for(display_off_delay + 500);
+
+  // button press and release with bounce opens the valve once (on release), the next press closes it
+  play_trace(switch1_input, button_trace);
+  run_for(1000);
+  check(valve_opens == 2);
+  check(valve_is_open());
+  play_trace(switch1_input, button_trace);
+  run_for(1000);
+  check(valve_opens == 2);
+  check(valve_closes == 2);
+  check(!valve_is_open());
+  check(dropped_inputs == 0);
+
+  return test_result("input filter");
+}
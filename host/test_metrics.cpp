@@ -0,0 +1,46 @@
+// Host test: the section histograms (bucket boundaries, and counts past what a 16 bit bucket holds) and the /metrics page sent in chunks
+
+#include "../main_v3.cpp"
+#include "test.h"
+
+
+int main() {
+  // every time falls in the bucket whose limit is the first at or above it, and no bucket is more than 50% wide
+  for (uint32_t us = 0; us < 20000000; us += (us < 10000 ? 1 : 997)) {
+    int bucket = profile_bucket(us);
+    if (bucket == profile_buckets - 1) {
+      check(us > profile_bucket_limit(profile_buckets - 2));
+      continue;
+    }
+    check(us <= profile_bucket_limit(bucket));
+    check(bucket == 0 || us > profile_bucket_limit(bucket - 1));
+  }
+  for (int bucket = 3; bucket < profile_buckets - 1; bucket++) {
+    uint32_t low = profile_bucket_limit(bucket - 1) + 1;
+    check(profile_bucket_limit(bucket) - low + 1 <= low / 2);
+  }
+
+  // the buckets keep counting once a section has run more than 65535 times
+  sim_wifi_up = false;
+  begin_dispenser();
+  for (int i = 0; i < 70000; i++) {profile_end(profile_error, hal_cycles());}
+  check(profiles[profile_error].buckets[0] == 70000);
+
+  // the metrics page is sent in chunks and has the same text that is printed on the serial monitor
+  sim_wifi_up = true;
+  check(run_until([] {return network_started;}, 5000));
+  sim_serial_output();
+  print_metrics(Serial);
+  run_for(5000); // let the serial FIFO empty
+  std::string printed = sim_serial_output();
+  sim_web_client client("GET /metrics HTTP/1.1\r\nHost: water-dispenser.local\r\n\r\n");
+  check(run_until([&] {return client.done;}, 1000));
+  check(client.status == 200);
+  check(client.body.size() > web_chunk_size);
+  check(client.body.find("dispenser_section_microseconds_bucket{section=\"error\",le=\"0\"} 70000") != std::string::npos);
+  check(client.body.substr(0, 50) == printed.substr(0, 50));
+  check(client.body.find("dispenser_uptime_milliseconds ") != std::string::npos);
+  check(client.body.back() == '\n');
+
+  return test_result("metrics");
+}
@@ -0,0 +1,121 @@
+// Host test: the MQTT sink against a stand-in broker (CONNACK, PUBACK matched to the packet ID, acknowledgement timeouts,
+// keepalive pings, refused connections), with mqtt_only so a batch is only removed from the event log once the broker has acknowledged it
+
+#define mqtt_only true
+#include "../main_v3.cpp"
+#include "test.h"
+#include "sim_script.h"
+#include "sim_broker.h"
+
+sim_google_script script;
+sim_mqtt_broker broker;
+
+
+// Fill a glass for about 2 s and wait for the display to turn off
+void fill_glass() {
+  place_glass();
+  run_for(ir_input_delay + 2000);
+  remove_glass();
+  run_for(turn_off_delay + display_off_delay + 500);
+}
+
+
+// Number of batches that have reached the broker
+size_t batches_received() {
+  size_t count = 0;
+  for (const sim_mqtt_message &message : broker.messages) {
+    if (message.topic == mqtt_topic "/batch") {count++;}
+  }
+  return count;
+}
+
+
+// The last batch that reached the broker
+sim_mqtt_message last_batch() {
+  for (size_t i = broker.messages.size(); i > 0; i--) {
+    if (broker.messages[i - 1].topic == mqtt_topic "/batch") {return broker.messages[i - 1];}
+  }
+  return sim_mqtt_message();
+}
+
+
+int main() {
+  mqtt_broker = "broker.local";
+  begin_dispenser();
+
+  // CONNECT is answered with CONNACK, and the dispenser says it is online (the broker says offline for it if the connection is lost)
+  check(run_until([] {return mqtt_state == mqtt_connected;}, 10000));
+  check(broker.connect_requests == 1 && mqtt_connects == 1);
+  check(broker.client_id == host_name);
+  check(broker.keepalive == mqtt_keepalive);
+  check(broker.will_topic == mqtt_topic "/status" && broker.will_message == "offline" && broker.will_retain);
+  check(run_until([] {return broker.retained.count(mqtt_topic "/status") > 0;}, 1000));
+  check(broker.retained[mqtt_topic "/status"].payload == "online");
+
+  // the broker is pinged once nothing has been sent for half the keepalive, and the connection stays open
+  unsigned long pings = broker.pings;
+  run_for(mqtt_keepalive * 500UL + 1000);
+  check(broker.pings == pings + 1);
+  check(mqtt_state == mqtt_connected && !mqtt_ping_waiting);
+
+  // a batch is only removed from the event log once its PUBACK arrives
+  broker.reply_us = 2000000;
+  fill_glass();
+  check(run_until([] {return batches_received() == 1;}, log_delay + 30000));
+  sim_mqtt_message batch = last_batch();
+  check(batch.qos == 1 && batch.retain);
+  check(batch.payload.size() > 2 && (uint8_t)batch.payload[0] == batch_format && (uint8_t)batch.payload[1] == command_insert_events);
+  check(batch.packet_id == mqtt_packet_id);
+  check(unsent_event == 0);
+  check(run_until([] {return unsent_event == 1;}, 3000));
+  check(mqtt_published == 1);
+  broker.reply_us = 20000;
+
+  // a PUBACK for another packet ID does not count: the batch times out, the connection is made again after mqtt_retry_delay,
+  // and the batch is sent again with a new packet ID
+  broker.puback_id_offset = 1;
+  fill_glass();
+  check(run_until([] {return batches_received() == 2;}, log_delay + 30000));
+  uint16_t first_id = last_batch().packet_id;
+  check(run_until([] {return mqtt_state == mqtt_disconnected;}, mqtt_ack_timeout + 1000));
+  check(unsent_event == 1 && mqtt_failures == 1);
+  broker.puback_id_offset = 0;
+  check(run_until([] {return mqtt_state == mqtt_connected;}, mqtt_retry_delay + 5000));
+  check(broker.connect_requests == 2);
+  check(run_until([] {return unsent_event == 2;}, log_delay + 30000));
+  check(batches_received() == 3 && last_batch().packet_id != first_id);
+
+  // no PUBACK at all: the same
+  broker.answer_publish = false;
+  fill_glass();
+  check(run_until([] {return batches_received() == 4;}, log_delay + 30000));
+  check(run_until([] {return mqtt_state == mqtt_disconnected;}, mqtt_ack_timeout + 1000));
+  check(unsent_event == 2 && mqtt_failures == 2);
+  broker.answer_publish = true;
+  check(run_until([] {return unsent_event == 3;}, mqtt_retry_delay + log_delay + 30000));
+  check(mqtt_published == 3);
+
+  // a ping that is not answered drops the connection, and it is made again
+  broker.answer_ping = false;
+  unsigned long connects = broker.connect_requests;
+  check(run_until([] {return mqtt_state == mqtt_disconnected;}, mqtt_keepalive * 500UL + mqtt_ack_timeout + 2000));
+  broker.answer_ping = true;
+  check(run_until([] {return mqtt_state == mqtt_connected;}, mqtt_retry_delay + 5000));
+  check(broker.connect_requests == connects + 1);
+
+  // a refused connection (CONNACK return code 5) is tried again after mqtt_retry_delay
+  broker.connack_code = 5;
+  mqtt_disconnect("test");
+  connects = broker.connect_requests;
+  check(run_until([&] {return broker.connect_requests == connects + 1;}, mqtt_retry_delay + 5000));
+  run_for(1000);
+  check(mqtt_state == mqtt_disconnected);
+  broker.connack_code = 0;
+  check(run_until([] {return mqtt_state == mqtt_connected;}, mqtt_retry_delay + 5000));
+  check(broker.connect_requests == connects + 2);
+
+  // nothing was published to Google Sheets, only config checks
+  for (const sim_script_batch &sheets_batch : script.batches) {check(sheets_batch.command == command_get_config);}
+
+  return test_result("mqtt");
+}
@@ -0,0 +1,35 @@
+// Host test: with mqtt_only nothing is published to Google Sheets, but the config still comes from it once WiFi connects
+// and when the button is held to the publish function (there is no MQTT broker here, so the usage data is not sent anywhere)
+
+#define mqtt_only true
+#include "../main_v3.cpp"
+#include "test.h"
+#include "sim_script.h"
+
+sim_google_script script;
+
+
+int main() {
+  begin_dispenser();
+  check(run_until([] {return network_started;}, 5000));
+  check(run_until([] {return function_2_oz == 16;}, 10000));
+  check(strcmp(config_version, "1") == 0);
+
+  // the config changes in Google Sheets and the button is held through every function to the publish
+  script.version = "2";
+  script.config["b"] = "20";
+  run_for(1000);
+  press_button();
+  run_for(8 * button_hold_time + 100);
+  release_button();
+  check(run_until([] {return function_2_oz == 20;}, publish_timeout));
+  check(strcmp(config_version, "2") == 0);
+  check(!valve_is_open());
+
+  // only config checks reached Google Sheets
+  check(!script.batches.empty());
+  for (const sim_script_batch &batch : script.batches) {check(batch.command == command_get_config);}
+  check(script.logged.empty());
+
+  return test_result("mqtt only");
+}
@@ -0,0 +1,62 @@
+// Host test: a batch is only removed from the event log once the script's response says it has been logged,
+// and sending it again does not log its events twice
+
+#include "../main_v3.cpp"
+#include "test.h"
+#include "sim_script.h"
+
+sim_google_script script;
+
+
+// Fill a glass for about ms
+void fill_glass(unsigned long ms) {
+  place_glass();
+  run_for(ir_input_delay + ms);
+  remove_glass();
+  run_for(turn_off_delay + display_off_delay + 500);
+}
+
+
+int main() {
+  begin_dispenser();
+  check(run_until([] {return network_started && publish_state == publish_idle;}, 10000));
+  fill_glass(2000);
+  check(next_event == 1);
+
+  // a response without "logged" (a script from before it was added): the events reach the sheet, but stay in the event log
+  script.reply_logged = false;
+  size_t batches = script.batches.size();
+  check(run_until([&] {return script.batches.size() > batches && publish_state == publish_idle;}, log_delay + 30000));
+  check(script.logged.size() == 1);
+  check(unsent_event == 0);
+
+  // a response that does not cover the whole batch: sent again after log_delay, the script skips the event it already has
+  script.reply_logged = true;
+  script.logged_offset = -1;
+  batches = script.batches.size();
+  check(run_until([&] {return script.batches.size() > batches && publish_state == publish_idle;}, log_delay + 30000));
+  check(script.logged.size() == 1);
+  check(unsent_event == 0);
+
+  // the redirect to the response is not followed because a glass arrives while the script runs: not confirmed either
+  script.logged_offset = 0;
+  script.run_us = 3000000;
+  batches = script.batches.size();
+  check(run_until([&] {return script.batches.size() > batches;}, log_delay + 30000));
+  place_glass();
+  run_for(ir_input_delay + 4000);
+  check(valve_is_open());
+  check(publish_state == publish_idle);
+  check(unsent_event == 0);
+  remove_glass();
+  run_for(turn_off_delay + display_off_delay + 500);
+  check(next_event == 2);
+
+  // a response that says the batch was logged: removed from the event log, with each event logged once
+  script.run_us = 1500000;
+  check(run_until([] {return unsent_event == 2;}, log_delay + 30000));
+  check(script.logged.size() == 2);
+  if (script.logged.size() == 2) {check(script.logged[0].sequence == 0 && script.logged[1].sequence == 1);}
+
+  return test_result("publish retry");
+}
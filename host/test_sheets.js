@@ -0,0 +1,311 @@
+// Host test: runs google-sheets-script.gs in node against stand-ins for the Apps Script services it uses, with batches encoded by
+// the dispenser itself (written by batch_fixtures): node test_sheets.js <google-sheets-script.gs> <batch fixtures>
+// Dates are formatted in CST (UTC-6) and the spreadsheet is a set of arrays, so only what the script writes is checked, not how Sheets shows it.
+
+var fs = require('fs');
+var vm = require('vm');
+var crypto = require('crypto');
+
+var script_path = process.argv[2];
+var fixtures = JSON.parse(fs.readFileSync(process.argv[3], 'utf8'));
+var check_failures = 0;
+
+
+// Report a failed check without stopping the test
+function check(condition, description) {
+  if (!condition) {
+    console.log('check failed: ' + description);
+    check_failures++;
+  }
+}
+
+
+// Compare two values as JSON (reports both if they differ)
+function check_equal(actual, expected, description) {
+  var actual_json = JSON.stringify(actual);
+  var expected_json = JSON.stringify(expected);
+  check(actual_json === expected_json, description + ': got ' + actual_json + ', expected ' + expected_json);
+}
+
+
+// A sheet: rows of values, with the parts of the Range API the script uses
+function sim_sheet(name) {
+  this.name = name;
+  this.rows = [];
+  this.cells = {}; // single cells set by A1 notation (Calculations sheet)
+}
+sim_sheet.prototype.getName = function() {return this.name;};
+sim_sheet.prototype.getLastRow = function() {return this.rows.length;};
+sim_sheet.prototype.appendRow = function(row) {this.rows.push(row.slice());};
+sim_sheet.prototype.getRange = function(row, column, rows, columns) {
+  var sheet = this;
+  if (typeof row === 'string') { // A1 notation
+    return {
+      setValue: function(value) {sheet.cells[row] = value;},
+      getValue: function() {return sheet.cells[row];},
+      getValues: function() {return sheet.cells[row];}
+    };
+  }
+  return {
+    setValues: function(values) {
+      for (var i = 0; i < values.length; i++) {sheet.rows[row - 1 + i] = values[i].slice();}
+    },
+    getValues: function() {
+      return sheet.rows.slice(row - 1, row - 1 + rows).map(function(values) {return values.slice(column - 1, column - 1 + columns);});
+    },
+    clearContent: function() {
+      for (var i = row - 1; i < row - 1 + rows && i < sheet.rows.length; i++) {sheet.rows[i] = ['', '', '', '', ''];}
+      while (sheet.rows.length > 0 && sheet.rows[sheet.rows.length - 1][0] === '') {sheet.rows.pop();}
+    }
+  };
+};
+
+
+// A spreadsheet with an empty log and the config block in the Calculations sheet, and the script loaded into it
+function load_script() {
+  var sheets = {'Sheet1': new sim_sheet('Sheet1'), 'Calculations': new sim_sheet('Calculations')};
+  sheets.Sheet1.appendRow(['Date', 'Time', 'Run Time', 'Ounces']);
+  var config = [];
+  for (var i = 0; i < 29; i++) {config.push([0]);}
+  config[0][0] = 0.0125; // conversion factor (gallons per second)
+  config[20][0] = 8;     // function 1 (oz)
+  sheets.Calculations.cells['B1:B29'] = config;
+  sheets.Calculations.cells['B2'] = 0; // total gallons
+  var properties = {};
+  var cache = {};
+  var logged = [];
+
+  var context = {
+    SpreadsheetApp: {openById: function() {
+      return {
+        getSheetByName: function(name) {return sheets[name] || null;},
+        insertSheet: function(name) {return sheets[name] = new sim_sheet(name);}
+      };
+    }},
+    PropertiesService: {getScriptProperties: function() {
+      return {
+        getProperty: function(key) {return key in properties ? properties[key] : null;},
+        setProperty: function(key, value) {properties[key] = String(value);},
+        deleteProperty: function(key) {delete properties[key];}
+      };
+    }},
+    CacheService: {getScriptCache: function() {
+      return {
+        get: function(key) {return key in cache ? cache[key] : null;},
+        put: function(key, value) {cache[key] = value;},
+        remove: function(key) {delete cache[key];}
+      };
+    }},
+    LockService: {getScriptLock: function() {return {waitLock: function() {}, releaseLock: function() {}};}},
+    ContentService: {
+      MimeType: {JSON: 'application/json'},
+      createTextOutput: function(text) {return {text: text, setMimeType: function() {return this;}};}
+    },
+    Utilities: {
+      DigestAlgorithm: {MD5: 'md5'},
+      computeDigest: function(algorithm, text) {
+        return Array.from(crypto.createHash(algorithm).update(text).digest()).map(function(b) {return b > 127 ? b - 256 : b;});
+      },
+      base64Decode: function(text) {
+        return Array.from(Buffer.from(text, 'base64')).map(function(b) {return b > 127 ? b - 256 : b;}); // signed bytes, like Apps Script
+      },
+      formatDate: function(date, zone, format) {
+        var cst = new Date(date.getTime() - 6 * 3600000).toISOString(); // CST is UTC-6
+        if (format === 'yyyy/MM/dd') {return cst.slice(0, 10).replace(/-/g, '/');}
+        var hour = Number(cst.slice(11, 13));
+        return ('0' + ((hour + 11) % 12 + 1)).slice(-2) + cst.slice(13, 16) + (hour < 12 ? ' AM' : ' PM');
+      }
+    },
+    console: {log: function(text) {logged.push(text);}},
+    Date: Date,
+    JSON: JSON,
+    Number: Number,
+    String: String,
+    Error: Error
+  };
+  vm.createContext(context);
+  vm.runInContext(fs.readFileSync(script_path, 'utf8'), context, {filename: script_path});
+  context.sheets = sheets;
+  context.properties = properties;
+  context.logged = logged;
+  return context;
+}
+
+
+// POST a fixture to the script and return the parsed JSON reply (null if it is not JSON)
+function post(script, fixture) {
+  var reply = script.doPost({postData: {contents: fixture.body}});
+  try {
+    return JSON.parse(reply.text);
+  }
+  catch (e) {
+    return null;
+  }
+}
+
+
+// ----- decode_batch(): every batch the dispenser encodes decodes to the values it was encoded from -----
+
+function test_decode() {
+  var script = load_script();
+  for (var name in fixtures) {
+    var fixture = fixtures[name];
+    var batch = script.decode_batch(fixture.body);
+    var expected = {'command': fixture.command, 'config': fixture.config};
+    var fields = ['pulses_per_gallon', 'first', 'end', 'duration', 'pulses', 'events'];
+    for (var i = 0; i < fields.length; i++) {
+      if (fixture[fields[i]] !== undefined) {expected[fields[i]] = fixture[fields[i]];}
+    }
+    check_equal(batch, expected, 'decode ' + name);
+  }
+
+  // a batch cut short and an unknown format are refused
+  var body = Buffer.from(fixtures.events.body, 'base64');
+  var threw = '';
+  try {
+    script.decode_batch(body.slice(0, body.length - 2).toString('base64'));
+  }
+  catch (e) {
+    threw = e.message;
+  }
+  check(threw === 'batch is too short', 'batch cut short is refused (' + threw + ')');
+  body[0] = 99;
+  var reply = script.doPost({postData: {contents: body.toString('base64')}});
+  check(reply.text.indexOf('unknown batch format 99') >= 0, 'unknown format is refused (' + reply.text + ')');
+
+  // format 2 (from a dispenser without the synced flag) still decodes, with the mode as it was sent
+  body = Buffer.from(fixtures.unsynced.body, 'base64');
+  body[0] = 2;
+  var batch = script.decode_batch(body.toString('base64'));
+  check(batch.events[0].synced === undefined && batch.events[0].mode === fixtures.unsynced.events[0].mode, 'format 2 decoded (' + JSON.stringify(batch.events) + ')');
+}
+
+
+// ----- insert_events: events saved before the clock was synced are logged when they arrive -----
+
+function test_unsynced() {
+  var script = load_script();
+  var today = script.Utilities.formatDate(new Date(), "CST", "yyyy/MM/dd");
+  post(script, fixtures.unsynced);
+  check_equal(table(script, 'Sheet1').map(function(row) {return row[0];}), [today], 'unsynced event logged today');
+
+  // the same event from a format 2 batch has no synced flag, and its start time looks right, so it is logged at that time
+  var body = Buffer.from(fixtures.unsynced.body, 'base64');
+  body[0] = 2;
+  script = load_script();
+  post(script, {'body': body.toString('base64')});
+  check_equal(table(script, 'Sheet1').map(function(row) {return row[0];}), ['2023/11/15'], 'format 2 event logged at its start time');
+}
+
+
+// ----- Daily and Monthly rollups: kept up to date as rows are logged, and rebuilt from the whole log by rebuild_rollups() -----
+
+// Rows of a sheet without its header
+function table(script, name) {
+  return script.sheets[name].rows.slice(1);
+}
+
+
+// Add up the log in Sheet1 by date (key_length characters of the date) the way the rollup tables should have it
+function expected_rollup(script, key_length) {
+  var totals = [];
+  var log = table(script, 'Sheet1');
+  for (var i = 0; i < log.length; i++) {
+    var key = log[i][0].substring(0, key_length);
+    var last = totals[totals.length - 1];
+    if (last === undefined || "'" + key !== last[0]) {
+      last = ["'" + key, 0, 0, 0, 0];
+      totals.push(last);
+    }
+    last[1] += 1;
+    last[2] += log[i][2];
+    last[3] += log[i][3];
+    last[4] = last[3] / 128;
+  }
+  return totals;
+}
+
+
+// Check both rollup tables against the log
+function check_rollups(script, description) {
+  check_equal(table(script, 'Daily'), expected_rollup(script, 10), 'Daily ' + description);
+  check_equal(table(script, 'Monthly'), expected_rollup(script, 7), 'Monthly ' + description);
+}
+
+
+function test_rollups() {
+  var script = load_script();
+  post(script, fixtures.events);
+  check_equal(table(script, 'Sheet1').map(function(row) {return row[0];}), ['2023/11/14', '2023/11/14', '2023/11/14', '2023/11/16'], 'log dates');
+  check_equal(table(script, 'Sheet1')[0], ['2023/11/14', '04:13 PM', 1200, 1.92], 'first log row');
+  check_rollups(script, 'after the first batch');
+  check(table(script, 'Daily').length === 2 && table(script, 'Monthly').length === 1, 'one row for each day and month');
+
+  post(script, fixtures.month_end); // into the next month
+  check_rollups(script, 'across the end of a month');
+  check_equal(table(script, 'Monthly').map(function(row) {return row[0];}), ["'2023/11", "'2023/12"], 'months');
+
+  // rebuilding gives the same tables, and rows logged afterwards carry on from them
+  var daily = JSON.stringify(table(script, 'Daily'));
+  var monthly = JSON.stringify(table(script, 'Monthly'));
+  script.rebuild_rollups();
+  check(JSON.stringify(table(script, 'Daily')) === daily, 'Daily unchanged by rebuild_rollups()');
+  check(JSON.stringify(table(script, 'Monthly')) === monthly, 'Monthly unchanged by rebuild_rollups()');
+  post(script, fixtures.next_day);
+  check_rollups(script, 'after a rebuild and another batch');
+
+  // rows edited out of the log by hand are taken out of the tables by a rebuild
+  script.sheets.Sheet1.rows.splice(1, 3); // the events of 2023/11/14
+  script.rebuild_rollups();
+  check_rollups(script, 'after rows were deleted from the log');
+  check(table(script, 'Daily')[0][0] === "'2023/11/16", 'deleted day removed from Daily');
+  check(script.total_gallons() === 0, 'total read again from Calculations B2 after a rebuild');
+}
+
+
+// ----- insert_events: a batch sent again (because the reply did not reach the dispenser) only logs the events the sheet does not have yet -----
+
+function test_retries() {
+  var script = load_script();
+  var reply = post(script, fixtures.events);
+  check(reply !== null && reply.logged === fixtures.events.end, 'reply says the batch was logged (' + JSON.stringify(reply) + ')');
+  check(table(script, 'Sheet1').length === 4, 'batch logged');
+  var log = JSON.stringify(table(script, 'Sheet1'));
+  var gallons = reply.gallons;
+
+  // the same batch again: nothing is added, and the reply still confirms it so the dispenser can move on
+  reply = post(script, fixtures.events);
+  check(JSON.stringify(table(script, 'Sheet1')) === log, 'batch sent twice is logged once');
+  check(reply.logged === fixtures.events.end && reply.gallons === gallons, 'same reply for a batch sent twice (' + JSON.stringify(reply) + ')');
+  check(script.logged.indexOf('events 0 to 3: 0 logged, 4 already logged, 0 rejected') >= 0, 'batch sent twice skipped');
+
+  // the batch sent again with a new event on the end: only the new event is added
+  reply = post(script, fixtures.events_retry);
+  check(table(script, 'Sheet1').length === 5, 'only the new event logged');
+  check_equal(table(script, 'Sheet1')[4].slice(2), [1500, 2.4], 'new event');
+  check(reply.logged === fixtures.events_retry.end, 'reply covers the new event (' + JSON.stringify(reply) + ')');
+  check(script.logged.indexOf('events 0 to 4: 1 logged, 4 already logged, 0 rejected') >= 0, 'events already logged skipped');
+  check_rollups(script, 'after a batch was sent again');
+
+  // a batch after it, and a running total, are confirmed too, a config check is not
+  reply = post(script, fixtures.large_numbers);
+  check(reply.logged === fixtures.large_numbers.end, 'next batch confirmed');
+  check(script.logged.indexOf('events 5 to 6: 2 logged, 0 already logged, 0 rejected') >= 0, 'next batch logged');
+  reply = post(script, fixtures.insert_row);
+  check(reply.logged === fixtures.insert_row.end, 'running total confirmed');
+  reply = post(script, fixtures.get_config);
+  check(reply.logged === undefined, 'config check does not confirm anything');
+}
+
+
+test_decode();
+test_rollups();
+test_unsynced();
+test_retries();
+if (check_failures === 0) {
+  console.log('google sheets script: passed');
+}
+else {
+  console.log('google sheets script: ' + check_failures + ' checks failed');
+}
+process.exit(check_failures === 0 ? 0 : 1);
@@ -0,0 +1,65 @@
+// Host test: time sync with a slow DNS server (the NTP server's address is looked up once while the dispenser is idle, later syncs reuse it
+// so a glass is never held up by a lookup, and it is looked up again after repeated timeouts) and the clock drift
+
+#include "../main_v3.cpp"
+#include "test.h"
+
+uint64_t valve_opened_at = 0; // virtual time the valve was last opened (us)
+
+
+// Note when the valve opens
+void watch_valve(uint8_t pin, uint8_t level) {
+  if (pin == valve_output && level == HIGH) {valve_opened_at = sim_time_us();}
+}
+
+
+int main() {
+  sim_dns_us = 5000000;        // a resolver that takes 5 s to answer
+  sim_clock_error_ppm = 100;   // the local clock runs slow
+  sim_write_hook = watch_valve;
+  begin_dispenser();
+  check(run_until([] {return time_synced;}, 20000));
+  check(time_syncs == 1);
+
+  // the hourly sync comes due while a glass is being filled: it waits until the dispenser is idle
+  place_glass();
+  run_for(ir_input_delay + 20);
+  check(valve_is_open());
+  schedule_task(task_time_sync, 0);
+  run_for(3000);
+  check(time_syncs == 1);
+  remove_glass();
+  check(run_until([] {return !valve_is_open();}, turn_off_delay + 50));
+  check(run_until([] {return time_syncs == 2;}, display_off_delay + 10000));
+
+  // a glass that arrives just as a sync starts opens the valve on time, as the address is not looked up again
+  run_for(1000);
+  unsigned long lookups = sim_dns_lookups;
+  uint64_t placed = sim_time_us();
+  place_glass();
+  schedule_task(task_time_sync, 0);
+  check(run_until([] {return valve_is_open();}, ir_input_delay + 50));
+  check(valve_opened_at - placed < (ir_input_delay + 10) * 1000ULL);
+  remove_glass();
+  check(run_until([] {return time_syncs == 3;}, turn_off_delay + display_off_delay + 10000));
+  check(sim_dns_lookups == lookups);
+
+  // the drift is measured once enough time has passed, and is positive because the local clock runs slow
+  check(run_until([] {return time_syncs == 4;}, time_sync + 10000));
+  check(clock_drift > 80 && clock_drift < 120);
+
+  // the server stops answering: its address is looked up again after ntp_lookup_failures timeouts in a row
+  sim_dns_us = 20000;
+  sim_ntp_up = false;
+  unsigned long failures = time_sync_failures;
+  lookups = sim_dns_lookups;
+  schedule_task(task_time_sync, 0);
+  check(run_until([&] {return time_sync_failures == failures + ntp_lookup_failures;}, 60000));
+  check(sim_dns_lookups == lookups);
+  sim_ntp_up = true;
+  check(run_until([] {return time_syncs == 5;}, time_sync));
+  check(sim_dns_lookups == lookups + 1);
+  check(sim_last_dns_lookup > sim_time_us() - 1000000);
+
+  return test_result("time sync");
+}
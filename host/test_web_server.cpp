@@ -0,0 +1,77 @@
+// Host test: web clients on the local network (a slow client does not hold up the valve, whether it starts while a glass is being filled
+// or just before, and config values that are not numbers are refused)
+
+#include "../main_v3.cpp"
+#include "test.h"
+
+uint64_t valve_opened_at = 0; // virtual time the valve was last opened (us)
+uint64_t valve_closed_at = 0; // virtual time the valve was last closed (us)
+
+
+// Note when the valve opens and closes
+void watch_valve(uint8_t pin, uint8_t level) {
+  if (pin != valve_output) {return;}
+  if (level == HIGH) {valve_opened_at = sim_time_us();}
+  else {valve_closed_at = sim_time_us();}
+}
+
+
+// Post form values to /config and return the status code of the answer
+int post_config(const std::string &form) {
+  sim_web_client client("POST /config HTTP/1.1\r\nHost: water-dispenser.local\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+                        "Content-Length: " + std::to_string(form.size()) + "\r\n\r\n" + form);
+  check(run_until([&] {return client.done;}, 1000));
+  return client.status;
+}
+
+
+int main() {
+  sim_write_hook = watch_valve;
+  begin_dispenser();
+  check(run_until([] {return network_started;}, 5000));
+  run_for(100);
+
+  // a client that sends its request slowly (one byte every 20 ms) while a glass is being filled: the valve still closes on time
+  place_glass();
+  run_for(ir_input_delay + 20);
+  check(valve_is_open());
+  sim_web_client slow_client("GET /status HTTP/1.1\r\nHost: water-dispenser.local\r\nUser-Agent: slow\r\n\r\n", 20000);
+  uint64_t removed = sim_time_us() + 500000;
+  sim_schedule_pin(ir1_input, HIGH, removed); // the glass is taken away while the request is still arriving
+  check(run_until([] {return !valve_is_open();}, turn_off_delay + 1000));
+  check(valve_closed_at - removed < (turn_off_delay + 10) * 1000ULL);
+  check(!slow_client.done); // answered once the dispenser is idle
+  check(run_until([&] {return slow_client.done;}, display_off_delay + 5000));
+  check(slow_client.status == 200);
+  check(slow_client.answered_at > valve_closed_at + display_off_delay * 1000ULL);
+
+  // a slow client that starts while the dispenser is idle, with a glass placed 100 ms later: the valve still opens on time,
+  // as the request is only handed to the web server once all of it has arrived
+  run_for(1000);
+  sim_web_client idle_client("GET /status HTTP/1.1\r\nHost: water-dispenser.local\r\nUser-Agent: slow\r\n\r\n", 20000);
+  uint64_t placed = sim_time_us() + 100000;
+  sim_schedule_pin(ir1_input, LOW, placed);
+  check(run_until([] {return valve_is_open();}, ir_input_delay + 1000));
+  check(valve_opened_at - placed < (ir_input_delay + 10) * 1000ULL);
+  run_for(2000);
+  remove_glass();
+  check(run_until([&] {return idle_client.done;}, turn_off_delay + display_off_delay + 5000));
+  check(idle_client.status == 200);
+  check(idle_client.answered_at > valve_closed_at + display_off_delay * 1000ULL);
+  run_for(1000);
+
+  // config values that are not numbers get a 400 and change nothing
+  check(post_config("a=20") == 200);
+  check(function_1_oz == 20);
+  check(post_config("a=abc") == 400);
+  check(post_config("a=16oz") == 400);
+  check(post_config("a=") == 400);
+  check(post_config("b=24&conversion=abc") == 400);
+  check(post_config("conversion=0.01x") == 400);
+  check(function_1_oz == 20);
+  check(function_2_oz != 24);
+  check(post_config("afterhours_start=-1&conversion=0.0125") == 200);
+  check(afterhours_start == -1 && conversion_factor > 0.0124 && conversion_factor < 0.0126);
+
+  return test_result("web server");
+}
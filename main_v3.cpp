@@ -6,40 +6,86 @@
 //  ===========================================
 
 
+#ifdef host_simulation
+#include "host/sim.h"                 // stand-ins for the Arduino core and libraries on a Linux host (see CMakeLists.txt)
+#else
 #include <Arduino.h>
 #include <Adafruit_NeoPixel.h>
 #include <ESP8266WiFi.h>
 #include <ESP8266mDNS.h>
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
-#include <HTTPSRedirect.h>
-#include <NTPClient.h>
 #include <Wire.h>
 #include <ArduinoJson.h>
 #include <Timezone.h>
+#include <LittleFS.h>
+#include <ESP8266WebServer.h>
+#endif
 
 #define valve_output      D1          // valve output pin
 #define ir1_input         D5          // ir 1 sensor input pin
 #define ir2_input         D6          // ir 2 sensor input pin
 #define switch1_input     D7          // pushbutton input pin
 #define led_pin           D8          // NeoPixel ring signal pin
+#define flow_input        D2          // flow meter pulse input pin (optional hall effect flow sensor, see flow_meter_installed)
 
 #define led_count         28          // number of LEDs in NeoPixel ring
 #define pwm_intervals     20          // number of intervals in the fade in/out for loops for fading LEDs
-#define ir_input_delay    100         // how long to wait once an IR sensor is triggered before opening valve (to prevent false triggers)
-#define sw_input_delay    30          // how long to wait once switch is pressed before opening valve (debounce)
+#define ir_input_delay    100         // how long an IR sensor must be continuously triggered before opening valve (to prevent false triggers, anything shorter is a ghost)
+#define sw_input_delay    30          // how long the switch must be continuously pressed or released before it is handled (debounce)
 #define log_delay         240000      // amount of time to wait before publishing data to Google Sheets
 #define display_off_delay 3000        // amount of time to wait once valve is closed before turning off the display LEDs
 #define error_time        300000      // amount of time valve can be open before automatically turning off and displaying an error (protect against blocked or failed sensor, disconnected or shorted wiring, etc)
 #define cycle_time        250         // amount of time valve must remain closed before reopening (allow valve to fully close before attempting to reopen and prevent rapid on/off switching of valve)
-#define turn_off_delay    400         // amount of time to wait to turn off valve after sensor no longer detects an object
+#define turn_off_delay    400         // amount of time to wait to turn off valve after sensor no longer detects an object (how long both IR sensors must be continuously clear)
 #define button_hold_time  850         // amount of time to hold button down before next button hold function (used to select different automatic dispense preset amounts: 16oz, 24oz, 32oz, etc.)
 #define led_blink         700         // amount of time delay between flashing LEDs during auto dispense mode
-#define time_check        300000      // how often to check the time from the NPT server
+#define time_check        300000      // how often to check the current hour for afterhours mode
+#define time_sync         3600000     // how often to get the time from the NTP server
+#define time_sync_retry   2000        // how long to wait before the first retry if the NTP server does not answer (doubles after each failure, up to time_sync)
+#define time_sync_timeout 2000        // amount of time to wait for an answer from the NTP server
+#define ntp_lookup_failures 3         // look up the NTP server's address again after this many requests in a row get no answer (pool.ntp.org servers come and go)
+#define config_check      3600000     // how often to check Google Sheets for config changes when there is no data to publish
 #define dim_factor        10          // factor by which to dim the LEDs during afterhours times
+#define flow_pulses_per_gallon 1703   // number of flow meter pulses for each gallon of water (a YF-S201 sensor gives about 450 pulses per liter)
+#define flow_time_limit   2           // with a flow meter, automatic dispense still stops after this many times the calculated dispense time (in case the flow meter stops counting)
+#define publish_slice     256         // maximum number of response bytes to read from Google Sheets per pass through the loop while publishing
+#define publish_timeout   15000       // amount of time to wait for Google Sheets before giving up on publishing data
+#define response_parse_timeout 100   // amount of time to wait for the rest of the response body while parsing it
+#define response_line_size 800        // maximum length of a response header line (the redirect location from Google is several hundred characters long)
+#define event_segments    8           // number of files in the dispense event log (the oldest file is reused once all of them are full)
+#define events_per_segment 256        // number of dispense events stored in each event log file (log uses event_segments * events_per_segment * 16 bytes of flash)
+#define publish_batch_size 100        // maximum number of dispense events to publish to Google Sheets per request
+#define batch_format      3           // version of the binary batch format (increase when the layout written by start_publish_batch() changes)
+#define event_synced      0x80        // set in the mode of a dispense event saved once the time had been synced (the start time of any other event is counted from compile time)
+#define batch_header_room 56          // space left at the start of batch_data for the batch header (written once the events have been encoded)
+#define batch_data_size   (batch_header_room + publish_batch_size * 16) // size of the buffer a batch is encoded in (an event takes at most 16 bytes)
+#define config_layout     1           // layout of the config saved to flash (increase when saved_config changes so an old config is not loaded into the new layout)
+#define input_queue_size  32          // number of sensor and pushbutton changes that can be waiting to be handled by the loop (must be a power of 2)
+#define led_queue_size    4           // number of LED animations that can be queued to run after the current one
+#define idle_limit        20          // longest time the loop will wait for the next scheduled task when there is nothing else to do (ms)
+#define task_retry_delay  1000        // how long to wait before trying a background task again if the dispenser is being used
+#define latency_samples   64          // number of recent samples kept for each latency measurement (used to calculate the percentiles)
+#define profile_buckets   48          // number of histogram buckets for each profiled section (2 per power of 2, the last bucket holds anything over ~12.6 s)
+#define web_port          80          // port the status, config and metrics are served on (http://water-dispenser.local/status)
+#define web_chunk_size    256         // bytes of the metrics sent to the web client at a time
+#define web_request_size  512         // longest request checked for completeness before it is handed to the web server (a longer one is handed over once this much has arrived)
+#define web_request_timeout 5000      // amount of time a web client may take to send its whole request before it is dropped
+#define host_name         "water-dispenser" // name the dispenser is advertised as over mDNS (water-dispenser.local)
+#ifndef mqtt_only
+#define mqtt_only         false       // set to true to publish usage data only to the MQTT broker (Google Sheets is then only used to check for config changes)
+#endif
+#define mqtt_port         1883        // port of the MQTT broker (plain TCP, see mqtt_broker)
+#define mqtt_topic        "water-dispenser" // topic each batch is published under (mqtt_topic/batch, with the connection state in mqtt_topic/status)
+#define mqtt_keepalive    60          // MQTT keepalive (seconds), the broker is pinged once nothing has been sent for half of this
+#define mqtt_ack_timeout  5000        // amount of time to wait for the MQTT broker to acknowledge a connection, message or ping
+#define mqtt_retry_delay  30000       // amount of time to wait before connecting to the MQTT broker again after the connection failed or was lost
+#define mqtt_packet_size  192         // size of the buffer MQTT packets are built in (bytes)
+#define mqtt_header_room  5           // space left at the start of mqtt_packet for the fixed header (packet type and up to 4 bytes of length)
 
 bool debug_mode = false;              // debug mode disables the valve from turning on and enables green lights when publishing (water usage data will still be calculated and published)
 bool display_orange_led = false;      // ***NOTE: need to increase turn_off_delay to ~800 if this is true***     display orange LEDs in IR mode when object is out of sensor range when water is dispensing when set to true
+bool flow_meter_installed = false;    // set to true if a flow meter is connected to flow_input (automatic dispense then stops once the measured amount has been dispensed, and the measured amount is published instead of the amount calculated from run time)
 
 int led_brightness = 255;             // NeoPixel brightness (max = 255)
 int ir1_state;                        // state of IR sensor 1: LOW if object detected, HIGH if no object detected
@@ -50,7 +96,6 @@ int current_hour = 12;                // current hour of the day (0 to 23) (valu
 int total_gallons = 0;                // total gallons of water used  (default value set, but will import value from Google Sheets at startup and after publishing data)
 int oz_target = 128;                  // total ounces daily target    (default value set, but will import value from Google Sheets at startup and after publishing data)
 int filter_change = 500;              // what value to change filter  (default value set, but will import value from Google Sheets at startup and after publishing data)
-int brightness;                       // used in the fade_in and fade_out loops to calculate and set LED brightness
 int button_press_multiplier = 1;      // used to determine the next function when holding down the button
 int function_1_oz = 0;                // automatic dispense ounces (default value set, but will import value from Google Sheets at startup and after publishing data)
 int function_2_oz = 0;                // automatic dispense ounces (default value set, but will import value from Google Sheets at startup and after publishing data)
@@ -59,15 +104,14 @@ int function_4_oz = 0;                // automatic dispense ounces (default valu
 int function_5_oz = 0;                // automatic dispense ounces (default value set, but will import value from Google Sheets at startup and after publishing data)
 int automatic_dispense_oz = 0;        // how much water to dispense automatically (based on which amount was selected when the button is held down)
 int automatic_dispense_time = 0;      // calculated length of time to keep water on when automatically dispensing
+uint32_t automatic_dispense_pulses = 0; // number of flow meter pulses to dispense when automatically dispensing (used instead of automatic_dispense_time if there is a flow meter)
 int afterhours_start = -1;            // beginning hour of afterhours time (0 to 23, with 0 being midnight and 23 being 11pm, -1 to disable) (default value set, but will import value from Google Sheets at startup and after publishing data)
 int afterhours_stop = -1;             // ending hour of afterhours time    (0 to 23, with 0 being midnight and 23 being 11pm, -1 to disable) (default value set, but will import value from Google Sheets at startup and after publishing data)
 
 bool display_on = false;              // is the display on?
 bool led_on = false;                  // is the LED ring on?
 bool valve_open = false;              // is the valve open?
-bool data_published = false;          // has current data been published? 
 bool case_off = false;                // is the button function set to off? (the case when the button is held down long enough to cycle through all the preset functions and should now not dispense any water when button is released)
-bool restart_clock = true;            // does the timer used to determine when to check the current time need to be restarted? (has time been checked?)
 bool afterhours = false;              // used for afterhours settings (dim LEDs)
 bool orange_led = false;              // used in fade_out function call if the fade out color should be orange (when using IR sensors) instead of blue (when using push button)
 
@@ -75,19 +119,22 @@ bool button_pressed = false;          // mode of operation: button pressed
 bool auto_dispense = false;           // mode of operation: button pressed and held down for automatic operation using a timer
 bool sensor_triggered = false;        // mode of operation: IR sensor
 
+bool button_down = false;             // has the current button press been handled? (button actions happen once per press)
+bool button_holding = false;          // is the button being held down to select an automatic dispense function?
+
 unsigned long current_time = 0;       // used to get the current time
 unsigned long timer_start = 0;        // used to start timer to keep track of how long the valve is open
 unsigned long run_time = 0;           // used to calculate how long the valve was open
 unsigned long run_total = 0;          // used to keep track of total run time before publishing time
-unsigned long log_timer = 0;          // used to determine when to publish data
-unsigned long clock_timer = 0;        // used to determine when to check the current time
-unsigned long display_timer = 0;      // used to determine when to turn off the display LEDs
-unsigned long turn_off_timer = 0;     // used to determine when to turn off the value when the IR sensors are no longer triggered 
-unsigned long blink_time = 0;         // used to determine when to blink the LED during auto dispense mode
+unsigned long pulse_total = 0;        // used to keep track of total flow meter pulses before publishing
+unsigned long valve_close_time = 0;   // used to keep the valve closed for cycle_time before it is reopened
 unsigned long button_press_time = 0;  // used to determine when the button was pressed
+unsigned long setup_time = 0;         // how long setup() took (ms after startup)
+unsigned long network_up_time = 0;    // when WiFi first connected (ms after startup, 0 if not connected yet)
+unsigned long first_dispense_time = 0; // when the valve was first opened (ms after startup, 0 if not opened yet)
+bool network_started = false;         // have the network services (OTA, NTP, metrics) been started?
 
 float conversion_factor = 0.0000;     // gallons per second conversion factor (default value set, but will update from Google Sheets at startup and after publishing data)
-float R = (pwm_intervals * log10(2))/(log10(255));  // used to calculate the 'R' value for fading LEDs
 
 
 // Enter network credentials
@@ -99,22 +146,229 @@ const char* ssid = STASSID;
 const char* password = STAPSK;
 
 // Enter Google Script ID here
-const char *GScriptId = "enter_google_script_id_here"";
+const char *GScriptId = "enter_google_script_id_here";
 #define gs_version_number "Version 48" // the version of the Google Scripts deployment listed above (not required, only for printing out version number at boot)
 
-// Enter command and Google Sheets sheet name here
-String payload_base =  "{\"command\": \"insert_row\", \"sheet_name\": \"Sheet1\", \"values\": ";
-String payload = "";
+// Commands understood by the Google Sheets script (sent in the batch header)
+enum batch_commands {command_get_config, command_insert_row, command_insert_events}; // insert_row logs the batch totals as one row, insert_events logs a row for each event
 
 // Information for reading and writing to Google Sheets (do not edit)
 const char* host = "script.google.com";
 const int httpsPort = 443;
 const char* fingerprint = "";
 String url = String("/macros/s/") + GScriptId + "/exec?cal";
-String return_string = "";
 
-// Define HTTPSRedirect client
-HTTPSRedirect* client = nullptr;
+// Enter the IP address or name of the MQTT broker here (leave empty to only publish to Google Sheets)
+const char *mqtt_broker = "";
+
+// Publishing is split into steps so that each pass through the loop only does a small amount of work
+enum publish_states {
+  publish_idle,                       // not publishing
+  publish_connect,                    // DNS lookup, TCP connection and TLS handshake
+  publish_send,                       // send the request
+  publish_status,                     // read the response status line
+  publish_headers,                    // read the response headers
+  publish_body,                       // read the response body
+  publish_parse,                      // parse the response and assign the config values from Google Sheets
+};
+publish_states publish_state = publish_idle;  // current step of publishing data
+WiFiClientSecure publish_client;              // TLS connection used to publish data
+bool publish_config_only = false;             // is the current request only checking for config changes? (no data is being published)
+bool publish_posted = false;                  // has the data been received by Google Sheets? (only the redirect to the response is left to follow)
+unsigned long publish_timer = 0;              // used to determine if the server has taken too long to respond
+char request_host[64];                        // host the current request is sent to
+const uint8_t *request_data = nullptr;        // body of the current request (sent base64 encoded since the script only gets the body as text)
+size_t request_length = 0;                    // number of bytes in request_data
+String request_path = "";                     // path of the current request
+char response_line[response_line_size];       // line of the response currently being read
+int response_line_length = 0;                 // number of characters read into response_line
+int response_status = 0;                      // HTTP status code of the response
+long response_length = -1;                    // remaining length of the response body (-1 if not given)
+bool response_chunked = false;                // is the response body sent in chunks?
+long chunk_remaining = 0;                     // remaining length of the current chunk of the response body
+char config_version[16] = "";                 // version of the config values last received from Google Sheets (sent with each request so unchanged config is not sent back)
+uint32_t publish_min_heap = 0;                // lowest free heap seen while publishing (bytes)
+StaticJsonDocument<384> config_doc;           // config values parsed from the response (fixed size so parsing does not use the heap)
+StaticJsonDocument<256> config_filter;        // fields to keep from the response (any other fields are skipped so they cannot overflow config_doc)
+
+// Telemetry sinks (each batch of usage data is sent to every sink that can take it, and is only removed once every required sink has received it)
+enum sink_ids {sink_sheets, sink_mqtt, sink_count};
+struct telemetry_sink {
+  const char *name;
+  bool required;                      // must the sink receive a batch before it is removed from the total or event log?
+  bool (*send)();                     // start sending the batch being published (returns false if the sink cannot take it right now)
+  void (*update)();                   // carry out the next step of sending, a little at a time on every pass through the loop
+};
+unsigned long published_total = 0;            // run time in the batch being published
+unsigned long published_pulses = 0;           // flow meter pulses in the batch being published
+uint8_t sinks_pending = 0;                    // sinks still sending the batch being published (one bit per sink_ids)
+uint8_t sinks_required = 0;                   // sinks that must receive the batch being published (one bit per sink_ids)
+bool batch_received = false;                  // has every required sink received the batch so far?
+uint8_t batch_data[batch_data_size];          // batch being published, encoded once and sent as is to every sink (the header is written in front of the events)
+size_t batch_offset = 0;                      // position of the start of the encoded batch in batch_data
+size_t batch_length = 0;                      // number of bytes in the encoded batch
+uint8_t config_request[24];                   // encoded request that only checks for config changes (batch header with no data)
+unsigned long batch_encode_time = 0;          // time taken to read and encode the last batch (us)
+
+// MQTT connection (kept open between batches so each batch only costs one small message and its acknowledgement)
+enum mqtt_states {
+  mqtt_disconnected,                  // not connected, or waiting for mqtt_retry_delay before connecting again
+  mqtt_connecting,                    // waiting for the broker to accept the connection
+  mqtt_connected,                     // ready to publish
+};
+mqtt_states mqtt_state = mqtt_disconnected;   // current state of the connection to the MQTT broker
+WiFiClient mqtt_client;                       // TCP connection to the MQTT broker
+uint8_t mqtt_packet[mqtt_packet_size];        // packet being sent to the broker (built in place so sending does not use the heap)
+uint8_t mqtt_response[4];                     // start of the packet being received from the broker (only short acknowledgements are expected)
+uint8_t mqtt_response_length = 0;             // number of bytes of the packet received so far
+uint16_t mqtt_packet_id = 0;                  // packet ID of the last batch published
+bool mqtt_waiting = false;                    // is a batch waiting to be acknowledged by the broker?
+bool mqtt_ping_waiting = false;               // is a ping waiting to be answered by the broker?
+bool mqtt_retry_waiting = false;              // has a connection failed? (wait for mqtt_retry_delay before trying again)
+unsigned long mqtt_timer = 0;                 // time the connection, batch or ping being waited on was sent, or the last connection failed (ms)
+unsigned long mqtt_last_send = 0;             // time a packet was last sent to the broker (ms)
+unsigned long mqtt_connects = 0;              // number of connections accepted by the broker since startup
+unsigned long mqtt_published = 0;             // number of batches acknowledged by the broker since startup
+unsigned long mqtt_failures = 0;              // number of batches the broker did not acknowledge since startup
+
+// TLS sessions are cached for script.google.com and the host it redirects to so that later connections can resume them instead of doing a full handshake
+// (connections are not kept open between requests because there is only enough memory for one TLS connection and each publish uses both hosts)
+BearSSL::Session script_session;              // TLS session for script.google.com
+BearSSL::Session redirect_session;            // TLS session for the host the script response is redirected to
+char redirect_session_host[64] = "";          // host the redirect session belongs to
+unsigned long tls_handshakes = 0;             // number of TLS handshakes since startup
+unsigned long tls_resumed = 0;                // number of TLS handshakes that resumed a cached session
+unsigned long tls_handshake_time = 0;         // total time spent on TLS handshakes since startup (ms)
+
+// Latency measurements (printed after each publish so changes to the timing of the dispenser show up as numbers on the serial monitor)
+struct latency_stats {
+  const char *name;                   // what is being measured
+  unsigned long count;                // number of samples since startup
+  unsigned long max;                  // longest sample since startup (us)
+  unsigned long samples[latency_samples]; // most recent samples (us)
+};
+latency_stats open_latency = {"input triggered to valve open"};     // includes ir_input_delay or sw_input_delay
+latency_stats close_latency = {"input cleared to valve closed"};    // includes turn_off_delay for the IR sensors
+latency_stats loop_latency = {"loop iteration"};                    // work done in one pass through the loop (not counting the wait for the next task)
+
+// Profiled sections of the loop (the time each one takes is counted in a log-linear histogram using the CPU cycle counter)
+enum profile_sections {profile_loop, profile_publish, profile_leds, profile_check_time, profile_error, profile_tasks, profile_section_count};
+const char *const profile_names[profile_section_count] = {"loop", "publish", "leds", "check_time", "error", "tasks"};
+struct section_profile {
+  uint32_t buckets[profile_buckets];  // number of times the section took the time covered by each bucket
+  uint32_t count;                     // number of times the section has run
+  uint64_t total;                     // total time spent in the section (us)
+  uint32_t max;                       // longest time the section has taken (us)
+};
+section_profile profiles[profile_section_count];
+uint32_t loop_start_cycles = 0;               // cycle count at the start of the current pass through the loop
+uint32_t max_stall = 0;                       // longest time any one section (other than the whole loop) has taken (us)
+profile_sections max_stall_section = profile_loop; // section that took max_stall
+// Listens for web clients, but only hands a client to the web server once its whole request has arrived
+// (the web server reads a request with a timeout of several seconds once it has started, so a slow client would hold up the loop)
+class complete_request_server : public WiFiServer {
+  public:
+    using WiFiServer::WiFiServer;
+    WiFiClient accept();
+    WiFiClient available() {return accept();} // (what the web server calls on cores before 3.1)
+  private:
+    WiFiClient waiting;                       // client whose request is still arriving
+    unsigned long waiting_since = 0;          // time waiting was accepted (ms)
+};
+esp8266webserver::ESP8266WebServerTemplate<complete_request_server> web_server(web_port); // serves /status, /config and /metrics on the local network (one request is handled per pass through the loop)
+StaticJsonDocument<768> status_doc;           // status or config being sent to a web client
+char status_json[768];                        // status_doc serialized as JSON
+
+// Scheduled tasks (timed work is run once its deadline has passed, listed from highest to lowest priority)
+// (the sensors and pushbutton are handled on every pass through the loop before any task is run, and only one task is run per pass)
+enum task_ids {
+  task_error_check,                   // stop the valve if it has been open for longer than error_time
+  task_auto_dispense,                 // close the valve once the automatic dispense time is up
+  task_reopen_valve,                  // open the valve once it has been closed for cycle_time
+  task_blink,                         // blink the LEDs during automatic dispense mode
+  task_display_off,                   // turn off the display LEDs once the valve has been closed for display_off_delay
+  task_check_time,                    // check the current hour for afterhours mode
+  task_time_sync,                     // get the time from the NTP server
+  task_publish,                       // publish data to Google Sheets
+  task_check_config,                  // check Google Sheets for config changes
+  task_count
+};
+struct scheduled_task {
+  bool scheduled;                     // is the task waiting to run?
+  unsigned long deadline;             // time the task should run (ms)
+};
+scheduled_task tasks[task_count];
+
+// Sensor and pushbutton changes are captured by interrupts and queued with the time they happened until the loop handles them
+// (the interrupts only write input_queue_head and the loop only writes input_queue_tail, so the queue does not need interrupts disabled)
+enum inputs {input_ir1, input_ir2, input_switch1, input_count};
+struct input_event {
+  unsigned long time;                 // time the input changed (us)
+  uint8_t input;                      // which input changed (inputs)
+  uint8_t level;                      // level of the input after the change
+};
+volatile input_event input_queue[input_queue_size];
+volatile uint8_t input_queue_head = 0;            // position the next change will be queued at
+volatile uint8_t input_queue_tail = 0;            // position of the next change to be handled
+volatile uint8_t input_level[input_count];        // last level queued for each input
+volatile unsigned long dropped_inputs = 0;        // number of changes that could not be queued because the queue was full
+volatile unsigned long coalesced_inputs = 0;      // number of interrupts where the input had already changed back (no change was queued)
+unsigned long handled_dropped_inputs = 0;         // value of dropped_inputs the last time the inputs were read directly
+unsigned long trigger_edge_time = 0;              // time an IR sensor was last triggered or the pushbutton was last released (us)
+volatile uint32_t flow_pulses = 0;                // number of flow meter pulses since startup (only written by the flow meter interrupt)
+uint32_t valve_open_pulses = 0;                   // value of flow_pulses when the valve was opened
+unsigned long clear_edge_time = 0;                // time an IR sensor last stopped detecting an object or the pushbutton was last pressed (us)
+
+// Input filters (the filtered output of an input only changes once the input has held its new state for the assert or deassert time)
+struct input_filter {
+  unsigned long assert_time;          // how long the input must be continuously active before the output turns on (us)
+  unsigned long deassert_time;        // how long the input must be continuously inactive before the output turns off (us)
+  bool raw;                           // is the input active? (unfiltered)
+  bool output;                        // filtered output
+  unsigned long raw_change;           // time the unfiltered input last changed (us)
+};
+input_filter input_filters[input_count] = {
+  {ir_input_delay * 1000UL, turn_off_delay * 1000UL, false, false, 0},  // IR sensor 1 (active when LOW)
+  {ir_input_delay * 1000UL, turn_off_delay * 1000UL, false, false, 0},  // IR sensor 2 (active when LOW)
+  {sw_input_delay * 1000UL, sw_input_delay * 1000UL, false, false, 0},  // pushbutton  (active when HIGH)
+};
+
+// Dispense event log (each time the valve is closed an event is saved to flash so that usage data survives a reset until it is published)
+enum dispense_modes {dispense_sensor, dispense_button, dispense_auto};
+struct dispense_event {
+  uint32_t sequence;                  // event number (increases by one for every event)
+  uint32_t start;                     // time the valve was opened (unix time)
+  uint32_t duration;                  // how long the valve was open (ms)
+  uint32_t mode : 8;                  // how the water was dispensed (dispense_modes, plus event_synced)
+  uint32_t pulses : 24;               // number of flow meter pulses while the valve was open (0 if there is no flow meter)
+};
+uint32_t next_event = 0;              // number of the next dispense event to be saved
+uint32_t unsent_event = 0;            // number of the first dispense event that has not been published
+uint32_t batch_start = 0;             // number of the first event in the batch being published
+uint32_t batch_end = 0;               // number of the event after the last event in the batch being published
+bool batch_full = false;              // were there more events waiting than could be published in one batch?
+bool event_log_ready = false;         // has the event log been opened?
+File event_file;                      // event log file last read from
+uint32_t event_file_segment = 0;      // which part of the log event_file holds
+unsigned long dropped_events = 0;     // number of events that were overwritten before they could be published
+unsigned long event_writes = 0;       // number of events saved since startup
+unsigned long event_write_time = 0;   // total time spent saving events since startup (us)
+
+// Last config received from Google Sheets, saved to flash so all features work straight after startup and while Google Sheets cannot be reached
+struct saved_config {
+  uint16_t layout;                    // config_layout when the config was saved
+  uint16_t length;                    // size of the saved config (bytes)
+  float conversion_factor;
+  int32_t total_gallons;
+  int32_t oz_target;
+  int32_t filter_change;
+  int32_t function_oz[5];             // automatic dispense presets (function_1_oz to function_5_oz)
+  int8_t afterhours_start;
+  int8_t afterhours_stop;
+  char version[16];                   // config_version
+  uint32_t crc;                       // CRC-32 of everything above (the config is not loaded if it does not match)
+};
+saved_config last_saved_config;       // config currently saved in flash (used to only rewrite the file when a value has changed)
 
 // US Central Time Zone (Chicago, IL)
 TimeChangeRule myDST = {"CDT", Second, Sun, Mar, 2, -300}; // Daylight time = UTC - 5 hours
@@ -122,16 +376,147 @@ TimeChangeRule mySTD = {"CST", First, Sun, Nov, 2, -360};  // Standard time = UT
 Timezone myTZ(myDST, mySTD);
 TimeChangeRule *tcr; // pointer to the time change rule, use to get TZ abbrev
 
-// Declare NeoPixel strip object
+// NTP time sync (the request is sent by task_time_sync and the answer is picked up on a later pass through the loop so it never waits for the server)
+const char* ntp_server = "pool.ntp.org";
+WiFiUDP ntp_udp;
+IPAddress ntp_address;                // address of ntp_server (looked up once, as the lookup can block for seconds, and again after ntp_lookup_failures requests get no answer)
+unsigned int ntp_timeouts = 0;        // number of requests in a row the NTP server did not answer
+bool time_synced = false;             // has the time been received from the NTP server?
+bool time_sync_waiting = false;       // is a request waiting for an answer from the NTP server?
+unsigned long time_sync_sent = 0;     // time the request was sent (ms)
+unsigned long time_sync_backoff = time_sync_retry; // how long to wait before trying again after the next failure (ms)
+time_t sync_time = 0;                 // UTC time from the last answer (unix time)
+unsigned long sync_millis = 0;        // value of hal_millis() when the time was sync_time
+double clock_drift = 0;               // how fast the local clock runs compared to the NTP server (ppm, positive if the local clock runs slow)
+bool drift_measured = false;          // has clock_drift been measured yet?
+unsigned long time_syncs = 0;         // number of answers received from the NTP server since startup
+unsigned long time_sync_failures = 0; // number of requests the NTP server did not answer since startup
+
+// Hardware abstraction layer (the dispenser logic reads the clock and inputs, drives the valve and LEDs, and checks the heap and WiFi only through these functions)
+// (build with host_simulation defined to leave them undefined so a host build can link the same logic against a virtual clock, simulated pins, a simulated LED ring and
+// a simulated network, see host/sim.h; the serial port, flash file system and network clients are used through stand-ins with the same API)
+#ifdef host_simulation
+unsigned long hal_millis();                                 // current time (ms)
+unsigned long hal_micros();                                 // current time (us)
+void hal_delay(unsigned long ms);                           // wait (advances the virtual clock)
+int hal_read(uint8_t pin);                                  // read an input pin
+void hal_write(uint8_t pin, uint8_t level);                 // set an output pin
+void hal_begin_leds(uint8_t brightness);                    // start the LED ring
+void hal_show_leds(const uint32_t *colors, int count);      // show a frame on the LED ring
+uint32_t hal_cycles();                                      // CPU cycle counter (used for profiling)
+uint32_t hal_cycles_per_us();                               // CPU cycles per microsecond
+uint32_t hal_free_heap();                                   // free heap (bytes)
+uint32_t hal_max_free_block();                              // largest block that can be allocated (bytes)
+uint8_t hal_heap_fragmentation();                           // heap fragmentation (percent)
+void hal_wifi_begin(const char *ssid, const char *password); // connect to WiFi in the background (reconnects by itself)
+bool hal_wifi_connected();                                  // is WiFi connected?
+String hal_local_ip();                                      // IP address on the local network
+bool hal_host_by_name(const char *host, IPAddress &address); // look up the address of a host (blocks until the DNS server answers)
+#else
 Adafruit_NeoPixel strip(led_count, led_pin, NEO_GRB + NEO_KHZ800);
 
+unsigned long hal_millis() {return millis();}
+unsigned long IRAM_ATTR hal_micros() {return micros();}     // (IRAM_ATTR since it is called from the input interrupts)
+void hal_delay(unsigned long ms) {delay(ms);}
+int IRAM_ATTR hal_read(uint8_t pin) {return digitalRead(pin);}
+void hal_write(uint8_t pin, uint8_t level) {digitalWrite(pin, level);}
+void hal_begin_leds(uint8_t brightness) {
+  strip.begin();                      // initialize NeoPixel ring object (required)
+  strip.setBrightness(brightness);
+}
+void hal_show_leds(const uint32_t *colors, int count) {
+  for (int j = 0; j < count; j++) {
+    strip.setPixelColor(j, colors[j]);
+  }
+  strip.show();
+}
+uint32_t hal_cycles() {return ESP.getCycleCount();}
+uint32_t hal_cycles_per_us() {return ESP.getCpuFreqMHz();}
+uint32_t hal_free_heap() {return ESP.getFreeHeap();}
+uint32_t hal_max_free_block() {return ESP.getMaxFreeBlockSize();}
+uint8_t hal_heap_fragmentation() {return ESP.getHeapFragmentation();}
+void hal_wifi_begin(const char *ssid, const char *password) {
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
+  WiFi.begin(ssid, password);
+}
+bool hal_wifi_connected() {return WiFi.status() == WL_CONNECTED;}
+String hal_local_ip() {return WiFi.localIP().toString();}
+bool hal_host_by_name(const char *host, IPAddress &address) {return WiFi.hostByName(host, address) == 1;}
+#endif
+
+// Pack a color for the LED ring (same layout as Adafruit_NeoPixel::Color())
+constexpr uint32_t rgb_color(uint8_t red, uint8_t green, uint8_t blue) {
+  return ((uint32_t)red << 16) | ((uint32_t)green << 8) | blue;
+}
+
+// LED color palette (amount of red, green, and blue in each color out of 4, scaled by the fade step brightness)
+enum led_color {led_blue, led_red, led_green, led_purple, led_orange};
+struct palette_color {
+  uint8_t red;
+  uint8_t green;
+  uint8_t blue;
+};
+constexpr palette_color led_palette[] PROGMEM = {
+  {0, 0, 4},  // led_blue
+  {4, 0, 0},  // led_red
+  {0, 4, 0},  // led_green
+  {4, 0, 4},  // led_purple
+  {3, 1, 0},  // led_orange
+};
+
+// LED frame buffer (colors last written to each pixel, used to skip strip.show() when nothing has changed since interrupts are disabled during each show)
+uint32_t led_frame[led_count];        // color of each pixel in the LED ring
+bool led_frame_changed = false;       // has a pixel changed since the last strip.show()?
+
+// Exponential LED fade curve, brightness = 2^(step/R) - 1 = 255^(step/pwm_intervals) - 1, calculated at compile time and stored in flash
+// (the ESP8266 has no FPU so calculating this with pow() for every frame is slow)
+constexpr double fade_pow(double base, int exponent) {
+  double result = 1;
+  for (int k = 0; k < exponent; k++) {result *= base;}
+  return result;
+}
+constexpr double fade_root(double x, int n) { // n-th root of x using Newton's method
+  double root = 1 + (x - 1) / n;
+  for (int k = 0; k < 100; k++) {root = ((n - 1) * root + x / fade_pow(root, n - 1)) / n;}
+  return root;
+}
+struct fade_table {
+  uint8_t level[pwm_intervals + 1];   // brightness at each fade step
+};
+constexpr fade_table make_fade_table(int divisor) {
+  fade_table table = {};
+  for (int i = 0; i <= pwm_intervals; i++) {
+    table.level[i] = (int)(fade_pow(fade_root(255, pwm_intervals), i) - 1 + 0.000001) / divisor;
+  }
+  return table;
+}
+constexpr fade_table fade_levels PROGMEM = make_fade_table(1);                  // brightness at each fade step
+constexpr fade_table fade_levels_dimmed PROGMEM = make_fade_table(dim_factor);  // brightness at each fade step during afterhours timeframe
+
+// LED animations (fades are advanced one frame per pass through the loop by update_leds() instead of using delay())
+struct led_animation {
+  led_color color;                    // color of the animation
+  int target;                         // fade step to fade towards (0 = off, pwm_intervals = full brightness)
+  int wait;                           // amount of time between fade steps (ms)
+  int pulses;                         // number of times to fade in and back out (0 for a single fade, -1 to flash until cancelled)
+  bool blink_builtin;                 // toggle the on-board LED each time the animation changes direction
+};
+led_animation animation;                        // animation currently running
+led_animation animation_queue[led_queue_size];  // animations waiting to run after the current one has finished
+int animation_queue_count = 0;                  // number of animations in the queue
+int animation_step = 0;                         // current fade step of the LED ring (0 to pwm_intervals)
+bool animation_running = false;                 // is an animation currently running?
+unsigned long animation_frame_time = 0;         // used to determine when to show the next frame of the animation
+
 
 // Function to return the compile date and time as a time_t value
 time_t compileTime()
 {
     const time_t FUDGE(10); // fudge factor to allow for compile time (seconds, YMMV)
     const char *compDate = __DATE__, *compTime = __TIME__, *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
-    char chMon[4], *m;
+    char chMon[4];
+    const char *m;
     tmElements_t tm;
 
     strncpy(chMon, compDate, 3);
@@ -150,684 +535,2311 @@ time_t compileTime()
 }
 
 
-void setup() {
-  
-  Serial.begin(9600);
-  Serial.flush();
-
-  pinMode(LED_BUILTIN, OUTPUT);         // initialize on-board LED as output
-  pinMode(valve_output, OUTPUT);        // initialize pin as digital output   (solenoid valve)
-  pinMode(ir1_input, INPUT);            // initialize pin as digital input    (infrared sensor 1)
-  pinMode(ir2_input, INPUT);            // initialize pin as digital input    (infrared sensor 2)
-  pinMode(switch1_input, INPUT);        // initialize pin as digital input    (pushbutton)
-  
-  digitalWrite(LED_BUILTIN, HIGH);      // LED off
-  digitalWrite(valve_output, LOW);      // valve closed
-
-  strip.begin();                        // initialize NeoPixel ring object (required)
-  strip.show();                         // turn off all pixels ASAP
-  strip.setBrightness(led_brightness);  // set brightness
-
-  // Show red LEDs while system is connecting to the internet and to Google server
-  for(int j = 0; j < strip.numPixels(); j++) {
-    strip.setPixelColor(j,255,0,0);
-    strip.show();
-    delay(3);
+// Set the color of one pixel in the frame buffer
+void set_pixel(int j, uint32_t pixel_color) {
+  if (led_frame[j] != pixel_color) {
+    led_frame[j] = pixel_color;
+    led_frame_changed = true;
   }
+}
 
-  // Print startup info
-  Serial.println("");
-  Serial.print("Water Dispenser ");
-  Serial.println(version_number);
-  Serial.print("Google Scripts deployment: ");
-  Serial.println(gs_version_number);
 
-  // Set the time
-  setTime(myTZ.toUTC(compileTime()));
-  
+// Push the frame buffer to the LED ring only if a pixel has changed
+void show_frame() {
+  if (led_frame_changed) {
+    hal_show_leds(led_frame, led_count);
+    led_frame_changed = false;
+  }
+}
 
-  // ----- Required for OTA programming -----
 
-  Serial.println("Booting");
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(ssid, password);
-  while (WiFi.waitForConnectResult() != WL_CONNECTED) {
-    Serial.println("Connection Failed! Rebooting...");
-    delay(5000);
-    ESP.restart();
+// Open the TLS connection used for publishing, resuming the cached session for the host if there is one
+bool open_connection(const char *connect_host) {
+  BearSSL::Session *session = &script_session;
+  if (strcmp(connect_host, host) != 0) {
+    if (strcmp(connect_host, redirect_session_host) != 0) { // redirected to a different host, start a new session
+      redirect_session = BearSSL::Session();
+      strncpy(redirect_session_host, connect_host, sizeof(redirect_session_host) - 1);
+    }
+    session = &redirect_session;
+  }
+  br_ssl_session_parameters previous = *session->getSession();
+
+  publish_client.setInsecure();
+  publish_client.setSession(session);
+  unsigned long handshake_start = hal_millis();
+  bool connected = publish_client.connect(connect_host, httpsPort);
+  tls_handshake_time += hal_millis() - handshake_start;
+  tls_handshakes++;
+
+  // session ID stays the same when the server accepts the cached session
+  br_ssl_session_parameters *current = session->getSession();
+  if (connected && previous.session_id_len > 0 && previous.session_id_len == current->session_id_len && memcmp(previous.session_id, current->session_id, previous.session_id_len) == 0) {
+    tls_resumed++;
   }
+  return connected;
+}
 
-  ArduinoOTA.onStart([]() {
-    String type;
-    if (ArduinoOTA.getCommand() == U_FLASH) {
-      type = "sketch";
-    } else { // U_FS
-      type = "filesystem";
-    }
-    Serial.println("Start updating " + type);
-  });
-  ArduinoOTA.onEnd([]() {
-    Serial.println("\nEnd");
-  });
-  ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
-    Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
-  });
-  ArduinoOTA.onError([](ota_error_t error) {
-    Serial.printf("Error[%u]: ", error);
-    if (error == OTA_AUTH_ERROR) {
-      Serial.println("Auth Failed");
-    } else if (error == OTA_BEGIN_ERROR) {
-      Serial.println("Begin Failed");
-    } else if (error == OTA_CONNECT_ERROR) {
-      Serial.println("Connect Failed");
-    } else if (error == OTA_RECEIVE_ERROR) {
-      Serial.println("Receive Failed");
-    } else if (error == OTA_END_ERROR) {
-      Serial.println("End Failed");
-    }
-  });
-  ArduinoOTA.begin();
-  Serial.print("IP address: ");
-  Serial.println(WiFi.localIP());
+
+// Print how many TLS handshakes have been done and how long they took
+void print_connection_stats() {
+  Serial.print("TLS handshakes: ");
+  Serial.print(tls_handshakes);
+  Serial.print(" (");
+  Serial.print(tls_resumed);
+  Serial.print(" resumed), average handshake time: ");
+  Serial.print(tls_handshakes > 0 ? tls_handshake_time / tls_handshakes : 0);
+  Serial.println(" ms");
+}
 
 
-  // ----- Required for writing to Google Sheets -----
+// Add a sample to a latency measurement
+void record_latency(latency_stats &stats, unsigned long latency) {
+  stats.samples[stats.count % latency_samples] = latency;
+  stats.count++;
+  if (latency > stats.max) {stats.max = latency;}
+}
 
-  // Use HTTPSRedirect class to create a new TLS connection
-  client = new HTTPSRedirect(httpsPort);
-  client->setInsecure();
-  client->setPrintResponseBody(true);
-  client->setContentTypeHeader("application/json");
-  Serial.print("Connecting to ");
-  Serial.println(host);
 
-  // Try to connect for a maximum of 5 times
-  bool flag = false;
-  for (int i=0; i<5; i++){
-    int retval = client->connect(host, httpsPort);
-    if (retval == 1) {
-       flag = true;
-       Serial.println("Connected");
-       break;
-    }
-    else
-      Serial.println("Connection failed. Retrying...");
+// Print the median, 99th percentile (of the most recent samples) and maximum of a latency measurement
+void print_latency(const latency_stats &stats) {
+  unsigned long sorted[latency_samples];
+  int n = stats.count < latency_samples ? stats.count : latency_samples;
+  for (int i = 0; i < n; i++) { // insertion sort (only a few samples)
+    unsigned long sample = stats.samples[i];
+    int j = i;
+    for (; j > 0 && sorted[j - 1] > sample; j--) {sorted[j] = sorted[j - 1];}
+    sorted[j] = sample;
   }
-
-  if (!flag){
-    Serial.print("Could not connect to server: ");
-    Serial.println(host);
-    Serial.println("Exiting...");
+  Serial.print("latency ");
+  Serial.print(stats.name);
+  if (n == 0) {
+    Serial.println(": no samples");
     return;
   }
+  Serial.print(": p50 ");
+  Serial.print(sorted[(n - 1) * 50 / 100]);
+  Serial.print(" us, p99 ");
+  Serial.print(sorted[(n - 1) * 99 / 100]);
+  Serial.print(" us, max ");
+  Serial.print(stats.max);
+  Serial.print(" us (");
+  Serial.print(stats.count);
+  Serial.println(" samples)");
+}
 
-  // Delete HTTPSRedirect object
-  delete client;
-  client = nullptr;
 
-  // Turn off LEDs at the end of startup
-  for(int j = 0; j < strip.numPixels(); j++) {
-    strip.setPixelColor(j,0,0,0);
-    strip.show();
-  }
+// Print all of the latency measurements
+void print_latency_stats() {
+  print_latency(open_latency);
+  print_latency(close_latency);
+  print_latency(loop_latency);
+}
+
 
-  Serial.println("Ready");
+// Get the histogram bucket for a section time (2 linear steps for each power of 2, so each bucket is at most 50% wide)
+int profile_bucket(uint32_t us) {
+  if (us < 2) {return us;}
+  int power = 31 - __builtin_clz(us);
+  int bucket = power * 2 + ((us >> (power - 1)) & 1);
+  return bucket < profile_buckets ? bucket : profile_buckets - 1;
 }
 
 
-// Format and print a time_t value with a time zone appended, assign the local time zone and daylight savings adjusted hour to current_hour
-void printDateTime(time_t t, const char *tz)
-{
-    char buf[32];
-    char m[4];    // temporary storage for month string (DateStrings.cpp uses shared buffer)
-    strcpy(m, monthShortStr(month(t)));
-    sprintf(buf, "%.2d:%.2d:%.2d %s %.2d %s %d %s",
-        hour(t), minute(t), second(t), dayShortStr(weekday(t)), day(t), m, year(t), tz);
-    Serial.println(buf);
-    current_hour =  hour(t);
+// Get the longest time counted in a histogram bucket (us)
+uint32_t profile_bucket_limit(int bucket) {
+  if (bucket < 2) {return bucket;}
+  int power = bucket / 2;
+  return ((uint32_t)(3 + bucket % 2) << (power - 1)) - 1;
 }
 
 
-// Fade LEDs on
-void fade_in(String fade_color, int wait) {
-  for(int i = 0; i <= pwm_intervals; i++) {
-    brightness = pow (2, (i / R)) - 1;
-    for(int j = 0; j < strip.numPixels(); j++) {
-      if(fade_color == "blue") { 
-        if (!afterhours) {strip.setPixelColor(j,0,0,brightness);}             // LEDs set to full brightness
-        if (afterhours)  {strip.setPixelColor(j,0,0,brightness/dim_factor);}  // LEDs dimmed during afterhours timeframe
-      }
-      if (fade_color == "red") {
-        if (!afterhours) {strip.setPixelColor(j,brightness,0,0);}
-        if (afterhours)  {strip.setPixelColor(j,brightness/dim_factor,0,0);}
-      }
-      if (fade_color == "green") {
-        if (!afterhours) {strip.setPixelColor(j,0,brightness,0);}
-        if (afterhours)  {strip.setPixelColor(j,0,brightness/dim_factor,0);}
-      }
-      if (fade_color == "purple") {
-        if (!afterhours) {strip.setPixelColor(j,brightness,0,brightness);}
-        if (afterhours)  {strip.setPixelColor(j,brightness/dim_factor,0,brightness/dim_factor);}
-      }      
-    }
-    strip.show();
-    delay(wait);
+// Count the time a section took since it started at start_cycles
+void profile_end(profile_sections section, uint32_t start_cycles) {
+  uint32_t us = (hal_cycles() - start_cycles) / hal_cycles_per_us();
+  section_profile &profile = profiles[section];
+  profile.buckets[profile_bucket(us)]++;
+  profile.count++;
+  profile.total += us;
+  if (us > profile.max) {profile.max = us;}
+  if (section != profile_loop && us > max_stall) {
+    max_stall = us;
+    max_stall_section = section;
   }
-  led_on = true;
 }
 
 
-// Fade LEDs off
-void fade_out(String fade_color, int wait) {
-  for(int i = pwm_intervals; i >= 0; i--){
-    brightness = pow (2, (i / R)) - 1;
-    for(int j = 0; j < strip.numPixels(); j++) {
-      if(fade_color == "blue") {
-        if (!afterhours) {strip.setPixelColor(j,0,0,brightness);}             // LEDs set to full brightness
-        if (afterhours)  {strip.setPixelColor(j,0,0,brightness/dim_factor);}  // LEDs dimmed during afterhours timeframe
-      }
-      if (fade_color == "red") {
-        if (!afterhours) {strip.setPixelColor(j,brightness,0,0);}
-        if (afterhours)  {strip.setPixelColor(j,brightness/dim_factor,0,0);}
-      }
-      if (fade_color == "green") {
-        if (!afterhours) {strip.setPixelColor(j,0,brightness,0);}
-        if (afterhours)  {strip.setPixelColor(j,0,brightness/dim_factor,0);}
-      }
-      if (fade_color == "purple") {
-        if (!afterhours) {strip.setPixelColor(j,brightness,0,brightness);}
-        if (afterhours)  {strip.setPixelColor(j,brightness/dim_factor,0,brightness/dim_factor);}
-      }
-      if (fade_color == "orange") {
-        if (!afterhours) {strip.setPixelColor(j,  brightness*0.75,              brightness*0.25,             0);}
-        if (afterhours)  {strip.setPixelColor(j, (brightness/dim_factor)*0.75, (brightness/dim_factor)*0.25, 0);}
-      }         
+// Print the section histograms, longest stall and heap stats in the Prometheus text format
+void print_metrics(Print &out) {
+  out.println("# TYPE dispenser_section_microseconds histogram");
+  for (int i = 0; i < profile_section_count; i++) {
+    section_profile &profile = profiles[i];
+    uint32_t cumulative = 0;
+    for (int b = 0; b < profile_buckets - 1; b++) {
+      if (profile.buckets[b] == 0) {continue;} // only print the buckets that have been used
+      cumulative += profile.buckets[b];
+      out.print("dispenser_section_microseconds_bucket{section=\"");
+      out.print(profile_names[i]);
+      out.print("\",le=\"");
+      out.print(profile_bucket_limit(b));
+      out.print("\"} ");
+      out.println(cumulative);
     }
-    strip.show();
-    delay(wait);
+    out.print("dispenser_section_microseconds_bucket{section=\"");
+    out.print(profile_names[i]);
+    out.print("\",le=\"+Inf\"} ");
+    out.println(profile.count);
+    out.print("dispenser_section_microseconds_sum{section=\"");
+    out.print(profile_names[i]);
+    out.print("\"} ");
+    out.println(profile.total);
+    out.print("dispenser_section_microseconds_count{section=\"");
+    out.print(profile_names[i]);
+    out.print("\"} ");
+    out.println(profile.count);
   }
-  strip.clear();
-  strip.show();
-  led_on = false;
-  orange_led = false;
+  out.println("# TYPE dispenser_section_max_microseconds gauge");
+  for (int i = 0; i < profile_section_count; i++) {
+    out.print("dispenser_section_max_microseconds{section=\"");
+    out.print(profile_names[i]);
+    out.print("\"} ");
+    out.println(profiles[i].max);
+  }
+  out.println("# TYPE dispenser_max_stall_microseconds gauge");
+  out.print("dispenser_max_stall_microseconds{section=\"");
+  out.print(profile_names[max_stall_section]);
+  out.print("\"} ");
+  out.println(max_stall);
+  out.println("# TYPE dispenser_free_heap_bytes gauge");
+  out.print("dispenser_free_heap_bytes ");
+  out.println(hal_free_heap());
+  out.println("# TYPE dispenser_max_free_block_bytes gauge");
+  out.print("dispenser_max_free_block_bytes ");
+  out.println(hal_max_free_block());
+  out.println("# TYPE dispenser_heap_fragmentation_percent gauge");
+  out.print("dispenser_heap_fragmentation_percent ");
+  out.println(hal_heap_fragmentation());
+  out.println("# TYPE dispenser_time_syncs_total counter");
+  out.print("dispenser_time_syncs_total ");
+  out.println(time_syncs);
+  out.println("# TYPE dispenser_time_sync_failures_total counter");
+  out.print("dispenser_time_sync_failures_total ");
+  out.println(time_sync_failures);
+  out.println("# TYPE dispenser_clock_drift_ppm gauge");
+  out.print("dispenser_clock_drift_ppm ");
+  out.println(clock_drift);
+  out.println("# TYPE dispenser_batch_bytes gauge");
+  out.print("dispenser_batch_bytes ");
+  out.println(batch_length);
+  out.println("# TYPE dispenser_batch_encode_microseconds gauge");
+  out.print("dispenser_batch_encode_microseconds ");
+  out.println(batch_encode_time);
+  out.println("# TYPE dispenser_mqtt_connects_total counter");
+  out.print("dispenser_mqtt_connects_total ");
+  out.println(mqtt_connects);
+  out.println("# TYPE dispenser_mqtt_published_total counter");
+  out.print("dispenser_mqtt_published_total ");
+  out.println(mqtt_published);
+  out.println("# TYPE dispenser_mqtt_failures_total counter");
+  out.print("dispenser_mqtt_failures_total ");
+  out.println(mqtt_failures);
+  out.println("# TYPE dispenser_setup_milliseconds gauge");
+  out.print("dispenser_setup_milliseconds ");
+  out.println(setup_time);
+  out.println("# TYPE dispenser_network_up_milliseconds gauge");
+  out.print("dispenser_network_up_milliseconds ");
+  out.println(network_up_time);
+  out.println("# TYPE dispenser_first_dispense_milliseconds gauge");
+  out.print("dispenser_first_dispense_milliseconds ");
+  out.println(first_dispense_time);
+  out.println("# TYPE dispenser_uptime_milliseconds counter");
+  out.print("dispenser_uptime_milliseconds ");
+  out.println(hal_millis());
 }
 
 
-/*// Show LED animations or flashing lights if button is held down long enough just for fun
-void LED_animation() {
-  for (int i = 0; i < 10; i++) {
-    fade_in("red", 7);
-    fade_out("red", 7);
-    fade_in("green", 7);
-    fade_out("green", 7);
-    fade_in("purple", 7);
-    fade_out("purple", 7);
-    fade_in("blue", 7);
-    fade_out("blue", 7);
+// Sends what is printed to it to the web client in chunks, so the metrics never have to be held in memory all at once
+struct chunked_response : public Print {
+  char chunk[web_chunk_size]; // text waiting to be sent
+  size_t length = 0;          // number of bytes in chunk
+
+  size_t write(uint8_t data) override {
+    chunk[length++] = data;
+    if (length == sizeof(chunk)) {send_chunk();}
+    return 1;
   }
-}*/
 
+  void send_chunk() {
+    if (length > 0) {web_server.sendContent(chunk, length);}
+    length = 0;
+  }
+};
 
-// Check the time (get current hour of 0 to 23)
-void check_time() {
-  if (restart_clock) {
-    clock_timer = millis(); // used to check how long it has been since last checked the time
-    restart_clock = false;
-  }
-  current_time = millis();
-  if (current_time - clock_timer > time_check) { // time_check is how often to check the time
-    restart_clock = true;
-    time_t utc = now();                     // gets current UTC time
-    time_t local = myTZ.toLocal(utc, &tcr); // gets current local time
-    //printDateTime(utc, "UTC");            // sets current_hour and prints UTC time
-    printDateTime(local, tcr -> abbrev);    // sets current_hour and prints local time
-    //Serial.print("current hour: "); Serial.println(current_hour); //current_hour assigned in printDateTime function
-    
-    // Turn afterhours on or off based on current time and inputs from Google Sheets with the following if/elseif block
-    // if afterhours start time or afterhours stop time == -1 disable afterhours functions
-    if (afterhours_start == -1 || afterhours_stop == -1) {
-      afterhours = false;
-      Serial.println("afterhours mode: disabled"); 
-    }
-    // if afterhours start time > afterhours stop time (example: start at hour 23 and end at 8)
-    else if (afterhours_start > afterhours_stop) {
-      if (current_hour >= afterhours_start || current_hour < afterhours_stop) { // check to see if time is during afterhours
-        afterhours = true;
-        Serial.println("afterhours mode: ON"); 
-      }
-      else {
-        afterhours = false;
-        Serial.println("afterhours mode: OFF"); 
-      }
-    }
-    // if afterhours start time == afterhours stop time (example: start at hour 2 and end at 2)
-    else if (afterhours_start == afterhours_stop) {
-      afterhours = false;
-      Serial.println("afterhours mode: OFF"); 
-     
-    }
-    // if afterhours start time < afterhours stop time (example: start at hour 0 and end at 8)
-    else if (afterhours_start < afterhours_stop) {
-      if (current_hour >= afterhours_start && current_hour < afterhours_stop) { // check to see if time is during afterhours
-        afterhours = true;
-        Serial.println("afterhours mode: ON"); 
-      }
-      else {
-        afterhours = false;
-        Serial.println("afterhours mode: OFF"); 
-      }
-    }
-  } 
+
+// Send the metrics to a client that requested /metrics
+void handle_metrics() {
+  chunked_response response;
+  web_server.setContentLength(CONTENT_LENGTH_UNKNOWN); // sent with chunked transfer encoding
+  web_server.send(200, "text/plain; version=0.0.4", "");
+  print_metrics(response);
+  response.send_chunk();
+  web_server.sendContent(""); // an empty chunk ends the response
 }
 
 
-// Handle errors based on error_status value
-void error() {
+// Print the metrics to the serial monitor when 'm' is sent, or the latency measurements when 'l' is sent (same format as the host scenario runner)
+void check_serial() {
+  while (Serial.available() > 0) {
+    char command = Serial.read();
+    if (command == 'm') {print_metrics(Serial);}
+    if (command == 'l') {print_latency_stats();}
+  }
+}
 
-  Serial.print("error status ");
-  Serial.println(error_status);
 
-  // error_status 1: water running for too long
-  // close valve and flash red LEDs, board must be reset manually before used again
-  while (error_status == 1) {
-    digitalWrite(valve_output, LOW);
-    fade_in("red", 10);
-    digitalWrite(LED_BUILTIN, LOW);
-    fade_out("red", 10);
-    digitalWrite(LED_BUILTIN, HIGH);
-    delay(50);
-  }
+// Schedule a task to run after wait ms (replaces any earlier deadline for the task)
+void schedule_task(task_ids task, unsigned long wait) {
+  tasks[task].deadline = hal_millis() + wait;
+  tasks[task].scheduled = true;
+}
 
-  // error_status 2: could not connect to Google Sheets (only enabled when debug mode is on)
-  // allow program to continue and try to publish data again later
-  if(error_status == 2 && debug_mode == true) {
-    // flash onboard LED and green NeoPixels
-    for(int k = 0; k <= 3; k++) {
-      fade_out("green", 1);
-      digitalWrite(LED_BUILTIN, LOW);
-      fade_in("green", 1);
-      digitalWrite(LED_BUILTIN, HIGH);
+
+// Stop a task from running
+void cancel_task(task_ids task) {
+  tasks[task].scheduled = false;
+}
+
+
+// Has the deadline for a task passed? (compares the time left as a signed value so it still works when hal_millis() rolls over)
+bool task_due(task_ids task, unsigned long now) {
+  return tasks[task].scheduled && (long)(now - tasks[task].deadline) >= 0;
+}
+
+
+// Get the UTC time from the last NTP answer and the local clock, corrected for clock drift (used as the TimeLib sync provider, returns 0 until the time has been synced)
+time_t synced_clock() {
+  if (!time_synced) {return 0;}
+  double elapsed = hal_millis() - sync_millis;
+  return sync_time + (time_t)((elapsed + elapsed * clock_drift / 1e6) / 1000);
+}
+
+
+// A time sync failed, try again after time_sync_backoff (which doubles each time, up to time_sync)
+void time_sync_failed(const char *reason) {
+  Serial.println(reason);
+  time_sync_failures++;
+  schedule_task(task_time_sync, time_sync_backoff);
+  time_sync_backoff = min(time_sync_backoff * 2, (unsigned long)time_sync);
+}
+
+
+// Send a request to the NTP server (run by task_time_sync, waits while the dispenser is being used in case the server's address has to be looked up)
+void start_time_sync() {
+  if (valve_open || display_on) {
+    schedule_task(task_time_sync, task_retry_delay);
+    return;
+  }
+  if (!hal_wifi_connected()) {
+    schedule_task(task_time_sync, time_sync_retry);
+    return;
+  }
+  if (!ntp_address.isSet() || ntp_timeouts >= ntp_lookup_failures) { // later syncs go to the same address, so the lookup is not repeated every hour
+    ntp_timeouts = 0;
+    if (!hal_host_by_name(ntp_server, ntp_address)) {
+      ntp_address = IPAddress();
+      time_sync_failed("could not look up the NTP server");
+      return;
     }
-    fade_out("green", 1);
-    delay(10);
   }
+  uint8_t packet[48] = {};
+  packet[0] = 0x23; // NTP version 4, client mode
+  if (!ntp_udp.beginPacket(ntp_address, 123) || ntp_udp.write(packet, sizeof(packet)) != sizeof(packet) || !ntp_udp.endPacket()) {
+    time_sync_failed("could not send NTP request");
+    return;
+  }
+  time_sync_sent = hal_millis(); // once the server's address has been looked up, so the lookup does not count towards the round trip or the timeout
+  time_sync_waiting = true;
+}
 
-  // error_status 3: filter change warning
-  // flash red LEDs then allow program to continue, reset error_status back to zero because the turn_off function will check for change filter each time valve is turned off
-  if (error_status == 3) {
-    // flash onboard LED and red NeoPixels
-    for(int k = 0; k <= 4; k++) {
-      fade_in("red", 7);
-      digitalWrite(LED_BUILTIN, HIGH);
-      fade_out("red", 7);
-      digitalWrite(LED_BUILTIN, LOW);
+
+// Check for an answer from the NTP server without waiting for it, and update the drift of the local clock
+void update_time_sync() {
+  if (!time_sync_waiting) {return;}
+  unsigned long receive_millis = hal_millis();
+  if (ntp_udp.parsePacket() < 48) {
+    if (receive_millis - time_sync_sent > time_sync_timeout) { // no answer, try again later
+      time_sync_waiting = false;
+      ntp_timeouts++;
+      time_sync_failed("NTP server did not answer");
     }
-    error_status = 0;   
+    return;
+  }
+  uint8_t packet[48];
+  ntp_udp.read(packet, sizeof(packet));
+  time_sync_waiting = false;
+  ntp_timeouts = 0;
+  uint32_t seconds = (uint32_t)packet[40] << 24 | (uint32_t)packet[41] << 16 | (uint32_t)packet[42] << 8 | packet[43]; // transmit time (seconds since 1900)
+  uint32_t fraction_ms = (uint32_t)(((uint64_t)packet[44] << 8 | packet[45]) * 1000 >> 16);          // transmit time (fraction of a second)
+  if (seconds == 0) {return;} // not a valid answer, try again at the next sync
+  time_t server_time = seconds - 2208988800UL;                                        // unix time
+  unsigned long server_millis = time_sync_sent + (receive_millis - time_sync_sent) / 2 - fraction_ms; // local time the server's clock was at server_time (assumes the request and answer took the same time)
+
+  // measure the drift of the local clock against the server since the last sync (only once enough time has passed for the measurement to be accurate)
+  if (time_synced && server_millis - sync_millis > time_sync / 2) {
+    double local_elapsed = server_millis - sync_millis;
+    double server_elapsed = (double)(server_time - sync_time) * 1000;
+    double drift = (server_elapsed - local_elapsed) / local_elapsed * 1e6;
+    clock_drift = drift_measured ? (clock_drift + drift) / 2 : drift; // smooth out the network delay in each measurement
+    drift_measured = true;
   }
+  Serial.print("time synced, clock was off by ");
+  Serial.print((long)(server_time - now()));
+  Serial.print(" s, drift ");
+  Serial.print(clock_drift);
+  Serial.println(" ppm");
+
+  bool first_sync = !time_synced;
+  sync_time = server_time;
+  sync_millis = server_millis;
+  time_synced = true;
+  time_syncs++;
+  time_sync_backoff = time_sync_retry;
+  setTime(synced_clock());
+  schedule_task(task_time_sync, time_sync);
+  if (first_sync) {schedule_task(task_check_time, 0);} // update afterhours mode now that the time is known
 }
 
 
-// Open valve and turn on NeoPixels
-void turn_on() {
-  if (!valve_open) {
-    if (debug_mode == false) {digitalWrite(valve_output, HIGH);} // valve open
-    digitalWrite(LED_BUILTIN, LOW);   // LED on
-    timer_start = millis();           // time when valve turned on
-    blink_time = timer_start;
-    valve_open = true;
-    if (debug_mode == true) {Serial.println("**DEBUG MODE**");}
-    Serial.print("valve open at ");
-    Serial.println(timer_start);
-  }
-  if (!led_on) {  // turn on blue LEDs
-    fade_in("blue", 5);
-    display_on = true;
-  }  
+// Get the name of the event log file that holds a dispense event
+void event_file_name(char *name, uint32_t sequence) {
+  sprintf(name, "/events/%u", (unsigned int)((sequence / events_per_segment) % event_segments));
 }
 
 
-// Close valve
-void turn_off() {
-  if (valve_open) {
-    digitalWrite(LED_BUILTIN, HIGH); // LED off
-    digitalWrite(valve_output, LOW); // valve closed
-    current_time = millis();         // get current time
-    valve_open = false;
-    button_pressed = false;
-    sensor_triggered = false;
-    button_press_multiplier = 1; // reset back to 1 after valve is off
-    auto_dispense = false;
-    Serial.print("valve closed at ");
-    Serial.println(current_time);
-    run_time = (current_time - timer_start); // calculate how long valve was open
-    Serial.print("valve was open for ");
-    Serial.print(run_time);
-    Serial.println(" ms");
-    run_total = run_total + run_time; // keep track of total time valve has been open until data is published
-    display_timer = current_time;
-    delay(cycle_time); // allow valve to fully close before continuing
+// Read a dispense event from the event log
+bool read_event(uint32_t sequence, dispense_event &event) {
+  uint32_t segment = sequence / events_per_segment;
+  if (!event_file || event_file_segment != segment) { // keep the last file read open since events are usually read in order
+    char name[16];
+    event_file.close();
+    event_file_name(name, sequence);
+    event_file = LittleFS.open(name, "r");
+    event_file_segment = segment;
   }
+  if (!event_file || !event_file.seek((sequence % events_per_segment) * sizeof(dispense_event))) {return false;}
+  if (event_file.read((uint8_t *)&event, sizeof(event)) != sizeof(event)) {return false;}
+  return event.sequence == sequence;
 }
 
 
-// Publish and receive data from Google Sheets
-void publish_data() {
-  current_time = millis();
-  if (current_time - log_timer > log_delay) {
-    static bool flag = false;
-    if (!flag) {
-        client = new HTTPSRedirect(httpsPort);
-        client->setInsecure();
-        flag = true;
-        client->setPrintResponseBody(true);
-        client->setContentTypeHeader("application/json");
-    }
-    if (client != nullptr) {
-      if (!client->connected()) {
-        client->connect(host, httpsPort);
-      }
-    }
-    else {
-      Serial.println("Error creating client object!");
-    }
-
-    if (debug_mode == true) {fade_in("green", 5);}
-    payload = payload_base + "\"" + run_total + "\"}"; 
-    Serial.println("");
-    if (debug_mode == true) {Serial.println("**DEBUG MODE**");}
-    Serial.print("payload received: ");
-    if(client->POST(url, host, payload)){ // attempt to publish
-      Serial.print("total run time published: ");
-      Serial.println(run_total);
-      data_published = true;
-      run_total = 0;
-      digitalWrite(LED_BUILTIN, HIGH);
-      return_string = client->getResponseBody();
-      const size_t capacity = JSON_OBJECT_SIZE(11) + 150; //create json doc and allocate memory (use https://arduinojson.org/v6/assistant/ to determine memory)
-      DynamicJsonDocument doc(capacity);
-      deserializeJson(doc, return_string ); // get data from Google Sheets json string and assign values to appropriate variables
-      total_gallons = doc["gallons"];
-      conversion_factor = doc["conversion"];
-      oz_target = doc["target"];
-      filter_change = doc["filter"];
-      function_1_oz = doc["a"];
-      function_2_oz = doc["b"];
-      function_3_oz = doc["c"];
-      function_4_oz = doc["d"];
-      function_5_oz = doc["e"];
-      afterhours_start = doc["afterhours_start"];
-      afterhours_stop = doc["afterhours_stop"];
-      Serial.print("total gallons: ");
-      Serial.println(total_gallons);
-      Serial.print("filter change: ");
-      Serial.println(filter_change);      
-      Serial.print("conversion factor: ");
-      Serial.println(conversion_factor, 4);
-      Serial.print("oz_target: ");
-      Serial.println(oz_target);
-      Serial.print("automatic dispense presets: ");
-      Serial.print(function_1_oz);  
-      Serial.print(",");
-      Serial.print(function_2_oz);  
-      Serial.print(",");
-      Serial.print(function_3_oz);  
-      Serial.print(",");
-      Serial.print(function_4_oz);  
-      Serial.print(",");
-      Serial.println(function_5_oz);  
-      Serial.print("afterhours: from "); Serial.print(afterhours_start); Serial.print(" to "); Serial.println(afterhours_stop);
-      Serial.print("payload sent: ");
-      Serial.println(payload);
-      Serial.println("");
-      if (debug_mode == true) {fade_out("green", 5);}
-    }
-    else { // publish has failed
-      error_status = 2;
-      log_timer = millis(); //restart the timer and try to publish again later
-      error();
-    }                                                                            
+// Save the number of the first dispense event that has not been published yet
+void save_unsent_event() {
+  File file = LittleFS.open("/events/sent", "w");
+  if (file) {
+    file.write((const uint8_t *)&unsent_event, sizeof(unsent_event));
+    file.close();
   }
 }
 
 
-void loop() {
-  ArduinoOTA.handle(); // required for OTA programming
-
-  // Publish data to Google Sheets
-  if (!valve_open && !display_on && !data_published) {
-    publish_data();
+// Skip any events that were overwritten before they could be published (once the log is full the oldest file is reused)
+void skip_overwritten_events() {
+  uint32_t oldest_event = 0;
+  if (next_event > events_per_segment * event_segments) {
+    oldest_event = ((next_event - 1) / events_per_segment - (event_segments - 1)) * events_per_segment; // the file holding the newest event is the only one reused so far
+  }
+  if (unsent_event < oldest_event) {
+    dropped_events += oldest_event - unsent_event;
+    unsent_event = oldest_event;
   }
+}
 
-  // Read status of sensors and pushbutton
-  ir1_state = digitalRead(ir1_input);         // get status of IR sensor 1
-  ir2_state = digitalRead(ir2_input);         // get status of IR sensor 2
-  switch1_state = digitalRead(switch1_input); // get status of pushbutton
-  
 
-  // Button has been pressed (press on, press off, hold down for automatic dispense functions)
-  if (switch1_state == HIGH && !sensor_triggered) {
-    delay(sw_input_delay);
-    switch1_state = digitalRead(switch1_input);
-    if (switch1_state == HIGH) {
-      if (!valve_open) {
-        button_pressed = true;
-        button_press_time = millis();
-        
-        while (!valve_open && switch1_state == HIGH) { // enter while loop if button is still pressed
-          switch1_state = digitalRead(switch1_input);  // check if button still held down
-          current_time = millis();
-          if (current_time - button_press_time > (button_hold_time * button_press_multiplier)) { // execute the cases below when button has been held down for correct amount of time (ex: case 1 executed when button held down for 1 second, case 2 at 2 seconds, etc.)
-            if (function_1_oz != 0) { // only run automatic dispense function if data has been imported from google sheets, otherwise auto shut off won't work as the function_x_oz variables will all still be set to zero
-              switch (button_press_multiplier) {
-                case 1:
-                  Serial.print("Function 1: ");
-                  Serial.print(function_1_oz);
-                  Serial.println("oz");
-                  auto_dispense = true;
-                  fade_in("purple", 7);
-                  fade_out("purple", 7);
-                  automatic_dispense_oz = function_1_oz;
-                  button_press_multiplier ++;
-                  break;
-                case 2:                  
-                  Serial.print("Function 2: ");
-                  Serial.print(function_2_oz);
-                  Serial.println("oz");
-                  auto_dispense = true;
-                  fade_in("purple", 7);
-                  fade_out("purple", 7);
-                  automatic_dispense_oz = function_2_oz;
-                  button_press_multiplier ++;
-                  break;
-                case 3:                    
-                  Serial.print("Function 3: ");
-                  Serial.print(function_3_oz);
-                  Serial.println("oz");
-                  auto_dispense = true;
-                  fade_in("purple", 7);
-                  fade_out("purple", 7);
-                  automatic_dispense_oz = function_3_oz;
-                  button_press_multiplier ++;
-                  break;
-                case 4:                
-                  Serial.print("Function 4: ");
-                  Serial.print(function_4_oz);
-                  Serial.println("oz");
-                  auto_dispense = true;
-                  fade_in("purple", 7);
-                  fade_out("purple", 7);
-                  automatic_dispense_oz = function_4_oz;
-                  button_press_multiplier ++;
-                  break;    
-                case 5:      
-                  Serial.print("Function 5: ");
-                  Serial.print(function_5_oz);
-                  Serial.println("oz");
-                  auto_dispense = true;
-                  fade_in("purple", 7);
-                  fade_out("purple", 7);
-                  automatic_dispense_oz = function_5_oz;
-                  button_press_multiplier ++;
-                  break;   
-                case 6:
-                  Serial.println("Function 6: Off");
-                  auto_dispense = false;
-                  case_off = true;
-                  button_press_multiplier ++;
-                  break;
-                case 7:
-                  Serial.println("Function 7: empty");            
-                  button_press_multiplier ++;
-                  break;
-                case 8:
-                  Serial.println("Function 8: publish/retrieve data");
-                  fade_in("green", 5);
-                  log_timer = log_delay + 1; // set the log timer greater than the log delay
-                  publish_data();
-                  fade_out("green", 5);
-                  log_timer = millis(); // reset the log timer                     
-                  button_press_multiplier ++;
-                  break;                              
-                default: // default case if none of the above cases match
-                  break;
-              }
-            }
-            else{ // publish data if the button has been held down but data has not yet been imported from Google Sheets
-              fade_in("green", 5);
-              case_off = true;
-              log_timer = log_delay + 1; // set the log timer greater than the log delay
-              publish_data();
-              fade_out("green", 5);
-              log_timer = millis(); // reset the log timer
-            }
-          }
-          yield(); // required to keep from crashing in while loop
-        } // end while
-        
-        // when button is released, turn on water unless button was held down to the 'off' function 
-        if (case_off) { 
-          button_pressed = false;
-          button_press_multiplier = 1;
-          Serial.println("automatic dispense off");
-          case_off = false;
-        }
-        else {
-          turn_on();  
-        }
-        
-        // if automatically dispensing, calculate how long to leave water on
-        if (auto_dispense) {
-          automatic_dispense_time = automatic_dispense_oz / (conversion_factor * 0.001 * 128); 
-          Serial.print("automatically dispensing ");
-          Serial.print(automatic_dispense_oz);
-          Serial.print("oz (");
-          Serial.print(automatic_dispense_time);
-          Serial.println("ms)");
-        }
+// Open the dispense event log, find where the log ends, and add up the run time of the events that have not been published yet
+void begin_event_log() {
+  if (!LittleFS.begin()) {
+    Serial.println("Formatting file system");
+    if (!LittleFS.format() || !LittleFS.begin()) {
+      Serial.println("Could not start file system, dispense events will not be saved");
+      return;
+    }
+  }
 
-      }
-      else if (valve_open) {  
-        turn_off();
+  // the newest event is the last event in the file with the highest event number
+  next_event = 0;
+  for (int i = 0; i < event_segments; i++) {
+    char name[16];
+    sprintf(name, "/events/%d", i);
+    File file = LittleFS.open(name, "r");
+    if (file && file.size() >= sizeof(dispense_event)) {
+      dispense_event event;
+      file.seek((file.size() / sizeof(dispense_event) - 1) * sizeof(dispense_event));
+      if (file.read((uint8_t *)&event, sizeof(event)) == sizeof(event) && event.sequence + 1 > next_event) {
+        next_event = event.sequence + 1;
       }
     }
-  } // end of button press
-  
+    file.close();
+  }
 
-  // If automatically dispensing, turn valve off automatically based on calculated dispense time
-  if (valve_open && auto_dispense) {
-    current_time = millis();
-    if (current_time - timer_start > automatic_dispense_time) {
-      turn_off();
-    }
+  File file = LittleFS.open("/events/sent", "r");
+  unsent_event = 0;
+  if (file) {
+    file.read((uint8_t *)&unsent_event, sizeof(unsent_event));
+    file.close();
   }
 
+  if (unsent_event > next_event) {unsent_event = next_event;}
+  skip_overwritten_events();
 
-  // If button pressed, check for error if valve has been left open too long (if pressed and forgotten about)
-  if (valve_open && button_pressed) {
-    current_time = millis();
-    if (auto_dispense) { // if automatically dispensing, flash LEDs instead of LEDs being solid on to indicate automatic dispense mode is activated
-      if (current_time - blink_time > led_blink) {
-        digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
-        if (led_on) {fade_out("blue", 1); } else { fade_in("blue", 1);}
-        blink_time = current_time;
-      }
+  run_total = 0;
+  pulse_total = 0;
+  dispense_event event;
+  for (uint32_t sequence = unsent_event; sequence < next_event; sequence++) {
+    if (read_event(sequence, event)) {
+      run_total += event.duration;
+      pulse_total += event.pulses;
     }
   }
+  event_log_ready = true;
 
+  Serial.print("dispense events waiting to be published: ");
+  Serial.print(next_event - unsent_event);
+  Serial.print(" (");
+  Serial.print(run_total);
+  Serial.println(" ms)");
+}
 
-  // IR sensor has been triggered
-  if ((ir1_state == LOW || ir2_state == LOW) && !button_pressed) {
-    if (display_orange_led){ // if displaying orange LEDs when object is out of sensor range, this is required to turn LEDs blue when back in range
-      if (led_on) {
-        for(int j = 0; j < strip.numPixels(); j++) {
-          if (!afterhours) {strip.setPixelColor(j,0,0,led_brightness);}
-          if (afterhours)  {strip.setPixelColor(j,0,0,led_brightness/dim_factor);}
-        }
-        strip.show();
-      }
-    }
-    if (!sensor_triggered) { // only delay if the water isn't on yet (prevent false triggers), no need for delay once water is on as that is handled by turn_off_delay
-      delay(ir_input_delay);
-      ir1_state = digitalRead(ir1_input);
-      ir2_state = digitalRead(ir2_input);      
-    }
-    if (ir1_state == LOW || ir2_state == LOW) {
-      turn_on();
-      turn_off_timer = millis();
-      sensor_triggered = true;
-      if(display_orange_led) {orange_led = true;}
-    }    
+
+// Add a dispense event to the end of the event log (once all files are full the oldest file is reused)
+void log_event(unsigned long duration, dispense_modes mode, uint32_t pulses) {
+  if (!event_log_ready) {return;}
+  unsigned long write_start = hal_micros();
+
+  dispense_event event = {};
+  event.sequence = next_event;
+  event.start = now() - duration / 1000;
+  event.duration = duration;
+  event.mode = mode | (time_synced ? event_synced : 0);
+  event.pulses = pulses;
+
+  char name[16];
+  event_file_name(name, next_event);
+  if (event_file_segment == next_event / events_per_segment) {event_file.close();} // file is about to change
+  File file = LittleFS.open(name, (next_event % events_per_segment == 0) ? "w" : "a");
+  if (!file || file.write((const uint8_t *)&event, sizeof(event)) != sizeof(event)) {
+    Serial.println("could not save dispense event");
+    file.close();
+    return;
   }
+  file.close();
+  next_event++;
+
+  skip_overwritten_events(); // the oldest file may have just been reused
+
+  event_write_time += hal_micros() - write_start;
+  event_writes++;
+  Serial.print("dispense event saved in ");
+  Serial.print(hal_micros() - write_start);
+  Serial.print(" us (average ");
+  Serial.print(event_write_time / event_writes);
+  Serial.print(" us, ");
+  Serial.print(dropped_events);
+  Serial.println(" events dropped)");
+}
 
 
-  // Turn off water when in IR sensor mode
-  if (sensor_triggered && (ir1_state == HIGH && ir2_state == HIGH)) {
-    if(display_orange_led){ // display orange LEDs if object out of sensor range when water is on
-      for(int j = 0; j < strip.numPixels(); j++) {
-        if (!afterhours) {strip.setPixelColor(j,  led_brightness*0.75,              led_brightness*0.25,             0);}
-        if (afterhours)  {strip.setPixelColor(j, (led_brightness/dim_factor)*0.75, (led_brightness/dim_factor)*0.25, 0);}
-      }    
-      strip.show();
-    }
-    current_time = millis();
-    if (current_time - turn_off_timer > turn_off_delay) {
-      turn_off();
-    }
-  }
-
-
-  // Turn display LEDs off after valve is closed and after display_off_delay amount of time has passed after valve cloased
-  if (!valve_open && display_on) {
-    current_time = millis();
-    if (current_time - display_timer > display_off_delay) {
-      if (led_on) { // turn off LEDs if they are currently on (could be off if flashing in automatic dispense mode)
-        if (orange_led) {fade_out("orange", 10);}
-        else {fade_out("blue", 10);}
-      } 
-      display_on = false;
-      data_published = false;
-      log_timer = millis(); // start log timer
-      if(total_gallons > filter_change) { // check to see if filter needs to be changed
-        error_status = 3;
-        error();
-      }
-    }
+// Calculate the CRC-32 of a saved config
+uint32_t config_crc(const uint8_t *data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int k = 0; k < 8; k++) {crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));}
   }
+  return ~crc;
+}
 
 
-  // Report error if valve has been open for longer than the specified error_time
-  if (valve_open){
-    current_time = millis();
-    if (current_time - timer_start > error_time) {
-      error_status = 1;
-      error();
-    }
-  }
+// Copy the current config values into a saved config record
+void fill_saved_config(saved_config &config) {
+  memset(&config, 0, sizeof(config));
+  config.layout = config_layout;
+  config.length = sizeof(config);
+  config.conversion_factor = conversion_factor;
+  config.total_gallons = total_gallons;
+  config.oz_target = oz_target;
+  config.filter_change = filter_change;
+  config.function_oz[0] = function_1_oz;
+  config.function_oz[1] = function_2_oz;
+  config.function_oz[2] = function_3_oz;
+  config.function_oz[3] = function_4_oz;
+  config.function_oz[4] = function_5_oz;
+  config.afterhours_start = afterhours_start;
+  config.afterhours_stop = afterhours_stop;
+  memcpy(config.version, config_version, sizeof(config.version)); // config_version is always terminated, and the same size
+  config.crc = config_crc((const uint8_t *)&config, offsetof(saved_config, crc));
+}
 
 
-  // check current time when system not in use
-  if (!display_on && !sensor_triggered && !button_pressed) {
-    check_time();
+// Load the config saved in flash (the file system is started by begin_event_log)
+void load_config() {
+  if (!event_log_ready) {return;}
+  saved_config config;
+  File file = LittleFS.open("/config", "r");
+  if (!file) {
+    Serial.println("no saved config, waiting for Google Sheets");
+    return;
   }
+  bool complete = file.read((uint8_t *)&config, sizeof(config)) == sizeof(config);
+  file.close();
+  if (!complete || config.layout != config_layout || config.length != sizeof(config) ||
+      config.crc != config_crc((const uint8_t *)&config, offsetof(saved_config, crc))) {
+    Serial.println("saved config is not valid, waiting for Google Sheets");
+    return;
+  }
+  conversion_factor = config.conversion_factor;
+  total_gallons = config.total_gallons;
+  oz_target = config.oz_target;
+  filter_change = config.filter_change;
+  function_1_oz = config.function_oz[0];
+  function_2_oz = config.function_oz[1];
+  function_3_oz = config.function_oz[2];
+  function_4_oz = config.function_oz[3];
+  function_5_oz = config.function_oz[4];
+  afterhours_start = config.afterhours_start;
+  afterhours_stop = config.afterhours_stop;
+  memcpy(config_version, config.version, sizeof(config.version));
+  config_version[sizeof(config_version) - 1] = '\0';
+  last_saved_config = config;
+  Serial.print("saved config loaded, version: ");
+  Serial.println(config_version);
+}
+
+
+// Save the config to flash if any value has changed since it was last saved (written to a temporary file first so a reset while saving cannot leave a partial config)
+void save_config() {
+  if (!event_log_ready) {return;}
+  saved_config config;
+  fill_saved_config(config);
+  if (memcmp(&config, &last_saved_config, sizeof(config)) == 0) {return;} // nothing has changed, do not wear out the flash
+  File file = LittleFS.open("/config.tmp", "w");
+  if (!file || file.write((const uint8_t *)&config, sizeof(config)) != sizeof(config)) {
+    Serial.println("could not save config");
+    file.close();
+    return;
+  }
+  file.close();
+  if (!LittleFS.rename("/config.tmp", "/config")) {
+    Serial.println("could not save config");
+    return;
+  }
+  last_saved_config = config;
+  Serial.println("config saved");
+}
+
+
+// Add the config values to a JSON object (same names as the config values sent by Google Sheets)
+void add_config_json(JsonObject config) {
+  config["version"] = config_version;
+  config["conversion"] = conversion_factor;
+  config["target"] = oz_target;
+  config["filter"] = filter_change;
+  config["a"] = function_1_oz;
+  config["b"] = function_2_oz;
+  config["c"] = function_3_oz;
+  config["d"] = function_4_oz;
+  config["e"] = function_5_oz;
+  config["afterhours_start"] = afterhours_start;
+  config["afterhours_stop"] = afterhours_stop;
+}
+
+
+// Has the whole request (headers, and the body given by Content-Length) arrived from a web client? (looks at it without reading it)
+bool web_request_complete(WiFiClient &client) {
+  static char text[web_request_size + 1];
+  size_t length = client.peekBytes((uint8_t *)text, web_request_size);
+  if (length == web_request_size) {return true;} // too long to check, the web server reads the rest
+  text[length] = '\0';
+  char *header_end = strstr(text, "\r\n\r\n");
+  if (header_end == nullptr) {return false;}
+  long body_length = 0;
+  for (char *line = strstr(text, "\r\n"); line != nullptr && line < header_end; line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {body_length = atol(line + 17);}
+  }
+  return (long)length >= (header_end + 4 - text) + body_length;
+}
+
+
+// Hand the web server a client once its whole request has arrived (called by handleClient(), clients that take longer than web_request_timeout are dropped)
+WiFiClient complete_request_server::accept() {
+  if (!waiting.connected()) {
+    waiting = WiFiServer::accept();
+    if (!waiting.connected()) {return WiFiClient();}
+    waiting_since = hal_millis();
+  }
+  if (web_request_complete(waiting)) {
+    WiFiClient client = waiting;
+    waiting = WiFiClient();
+    return client;
+  }
+  if (hal_millis() - waiting_since > web_request_timeout) {waiting.stop();}
+  return WiFiClient();
+}
+
+
+// Send status_doc to the web client as JSON
+void send_status_doc() {
+  serializeJson(status_doc, status_json, sizeof(status_json));
+  web_server.send(200, "application/json", status_json);
+}
+
+
+// Send the current state, counters and config to a client that requested /status
+void handle_status() {
+  status_doc.clear();
+  status_doc["uptime"] = hal_millis();
+  status_doc["valve_open"] = valve_open;
+  status_doc["display_on"] = display_on;
+  status_doc["mode"] = sensor_triggered ? "sensor" : auto_dispense ? "auto" : button_pressed ? "button" : "idle";
+  status_doc["afterhours"] = afterhours;
+  status_doc["error"] = error_status;
+  status_doc["gallons"] = total_gallons;
+  status_doc["run_total"] = run_total;
+  status_doc["events_waiting"] = next_event - unsent_event;
+  status_doc["events_dropped"] = dropped_events;
+  status_doc["mqtt_connected"] = (mqtt_state == mqtt_connected);
+  status_doc["time_synced"] = time_synced;
+  status_doc["time"] = (uint32_t)now();
+  status_doc["free_heap"] = hal_free_heap();
+  add_config_json(status_doc.createNestedObject("config"));
+  send_status_doc();
+}
+
+
+// Send the config to a client that requested /config
+void handle_config() {
+  status_doc.clear();
+  add_config_json(status_doc.to<JsonObject>());
+  send_status_doc();
+}
+
+
+// Read an integer config value from a web request if it was sent, returns false if it is not a number or is outside of the range allowed
+bool read_config_arg(const char *name, int &value, int min_value, int max_value) {
+  if (!web_server.hasArg(name)) {return true;}
+  String text = web_server.arg(name);
+  char *end;
+  long new_value = strtol(text.c_str(), &end, 10);
+  if (end == text.c_str() || *end != 0) {return false;} // toInt() would read this as 0
+  if (new_value < min_value || new_value > max_value) {return false;}
+  value = new_value;
+  return true;
+}
+
+
+// Change config values from a client that posted to /config (for example: curl -d "a=16&b=24" http://water-dispenser.local/config)
+// the new values are used straight away and saved to flash, and are kept until they are changed in Google Sheets
+void handle_config_update() {
+  int new_values[9] = {oz_target, filter_change, function_1_oz, function_2_oz, function_3_oz, function_4_oz, function_5_oz, afterhours_start, afterhours_stop};
+  float new_conversion = conversion_factor;
+  bool valid = read_config_arg("target", new_values[0], 0, 10000) &&
+               read_config_arg("filter", new_values[1], 0, 100000) &&
+               read_config_arg("a", new_values[2], 0, 1000) &&
+               read_config_arg("b", new_values[3], 0, 1000) &&
+               read_config_arg("c", new_values[4], 0, 1000) &&
+               read_config_arg("d", new_values[5], 0, 1000) &&
+               read_config_arg("e", new_values[6], 0, 1000) &&
+               read_config_arg("afterhours_start", new_values[7], -1, 23) &&
+               read_config_arg("afterhours_stop", new_values[8], -1, 23);
+  if (web_server.hasArg("conversion")) {
+    String text = web_server.arg("conversion");
+    char *end;
+    new_conversion = strtod(text.c_str(), &end);
+    if (end == text.c_str() || *end != 0 || new_conversion <= 0) {valid = false;}
+  }
+  if (!valid) {
+    web_server.send(400, "text/plain", "config value not a number or out of range");
+    return;
+  }
+  oz_target = new_values[0];
+  filter_change = new_values[1];
+  function_1_oz = new_values[2];
+  function_2_oz = new_values[3];
+  function_3_oz = new_values[4];
+  function_4_oz = new_values[5];
+  function_5_oz = new_values[6];
+  afterhours_start = new_values[7];
+  afterhours_stop = new_values[8];
+  conversion_factor = new_conversion;
+  Serial.println("config changed from the local network");
+  save_config();
+  schedule_task(task_check_time, 0); // apply the afterhours hours straight away
+  handle_config();
+}
+
+
+// Queue a change of a sensor or pushbutton input (called from the input interrupts)
+void IRAM_ATTR queue_input(uint8_t input, uint8_t pin) {
+  uint8_t level = hal_read(pin);
+  if (level == input_level[input]) { // input changed and changed back before the interrupt ran
+    coalesced_inputs++;
+    return;
+  }
+  input_level[input] = level;
+  uint8_t head = input_queue_head;
+  if ((uint8_t)(head - input_queue_tail) >= input_queue_size) { // queue is full, the loop will read the inputs directly instead
+    dropped_inputs++;
+    return;
+  }
+  input_queue[head & (input_queue_size - 1)].time = hal_micros();
+  input_queue[head & (input_queue_size - 1)].input = input;
+  input_queue[head & (input_queue_size - 1)].level = level;
+  input_queue_head = head + 1; // only update the head once the event has been written
+}
+
+
+// Input interrupts
+void IRAM_ATTR ir1_changed()     {queue_input(input_ir1, ir1_input);}
+void IRAM_ATTR ir2_changed()     {queue_input(input_ir2, ir2_input);}
+void IRAM_ATTR switch1_changed() {queue_input(input_switch1, switch1_input);}
+void IRAM_ATTR flow_pulse()      {flow_pulses++;} // only count the pulse so the interrupt is short enough for high pulse rates
+
+
+// Update the filtered output of an input filter
+void filter_update(input_filter &filter, unsigned long update_time) {
+  if (filter.raw != filter.output) {
+    unsigned long hold_time = filter.raw ? filter.assert_time : filter.deassert_time;
+    if (update_time - filter.raw_change >= hold_time) {filter.output = filter.raw;}
+  }
+}
+
+
+// Feed a sample of an input into its filter
+void filter_sample(input_filter &filter, bool active, unsigned long sample_time) {
+  filter_update(filter, sample_time); // apply any change that was complete before this sample
+  if (active != filter.raw) {
+    filter.raw = active;
+    filter.raw_change = sample_time;
+  }
+}
+
+
+// Is an input active at the given level? (IR sensors are LOW when an object is detected, pushbutton is HIGH when pressed)
+bool input_active(uint8_t input, int level) {
+  if (input == input_switch1) {return level == HIGH;}
+  return level == LOW;
+}
+
+
+// Handle the input changes queued by the interrupts and update the filtered state of the sensors and pushbutton
+void read_inputs() {
+  uint8_t head = input_queue_head;
+  while (input_queue_tail != head) {
+    uint8_t tail = input_queue_tail & (input_queue_size - 1);
+    uint8_t input = input_queue[tail].input;
+    bool active = input_active(input, input_queue[tail].level);
+    filter_sample(input_filters[input], active, input_queue[tail].time);
+    bool opens_valve = (input == input_switch1) ? !active : active; // the valve opens when an IR sensor is triggered or the pushbutton is released
+    if (opens_valve) {trigger_edge_time = input_queue[tail].time;}
+    else {clear_edge_time = input_queue[tail].time;}                // IR sensor cleared or pushbutton pressed
+    input_queue_tail++;
+  }
+
+  // read the inputs directly if any changes were dropped because the queue was full
+  unsigned long sample_time = hal_micros();
+  if (dropped_inputs != handled_dropped_inputs) {
+    handled_dropped_inputs = dropped_inputs;
+    filter_sample(input_filters[input_ir1], input_active(input_ir1, hal_read(ir1_input)), sample_time);
+    filter_sample(input_filters[input_ir2], input_active(input_ir2, hal_read(ir2_input)), sample_time);
+    filter_sample(input_filters[input_switch1], input_active(input_switch1, hal_read(switch1_input)), sample_time);
+  }
+  for (int i = 0; i < input_count; i++) {
+    filter_update(input_filters[i], sample_time);
+  }
+
+  ir1_state = input_filters[input_ir1].output ? LOW : HIGH;
+  ir2_state = input_filters[input_ir2].output ? LOW : HIGH;
+  switch1_state = input_filters[input_switch1].output ? HIGH : LOW;
+}
+
+
+void setup() {
+  
+  Serial.begin(9600);
+  Serial.flush();
+
+  pinMode(LED_BUILTIN, OUTPUT);         // initialize on-board LED as output
+  pinMode(valve_output, OUTPUT);        // initialize pin as digital output   (solenoid valve)
+  pinMode(ir1_input, INPUT);            // initialize pin as digital input    (infrared sensor 1)
+  pinMode(ir2_input, INPUT);            // initialize pin as digital input    (infrared sensor 2)
+  pinMode(switch1_input, INPUT);        // initialize pin as digital input    (pushbutton)
+
+  // Capture sensor and pushbutton changes with interrupts
+  input_level[input_ir1] = hal_read(ir1_input);
+  input_level[input_ir2] = hal_read(ir2_input);
+  input_level[input_switch1] = hal_read(switch1_input);
+  for (int i = 0; i < input_count; i++) {
+    input_filters[i].raw = input_filters[i].output = input_active(i, input_level[i]);
+  }
+  attachInterrupt(digitalPinToInterrupt(ir1_input), ir1_changed, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(ir2_input), ir2_changed, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(switch1_input), switch1_changed, CHANGE);
+  if (flow_meter_installed) {
+    pinMode(flow_input, INPUT_PULLUP);  // initialize pin as digital input    (flow meter, open collector output)
+    attachInterrupt(digitalPinToInterrupt(flow_input), flow_pulse, FALLING);
+  }
+  
+  hal_write(LED_BUILTIN, HIGH);         // LED off
+  hal_write(valve_output, LOW);         // valve closed
+
+  hal_begin_leds(led_brightness);       // initialize NeoPixel ring and set brightness
+  hal_show_leds(led_frame, led_count);  // turn off all pixels ASAP
+
+  // Show red LEDs until WiFi has connected (the dispenser can already be used)
+  for(int j = 0; j < led_count; j++) {
+    set_pixel(j, rgb_color(255,0,0));
+  }
+  show_frame();
+
+  // Print startup info
+  Serial.println("");
+  Serial.print("Water Dispenser ");
+  Serial.println(version_number);
+  Serial.print("Google Scripts deployment: ");
+  Serial.println(gs_version_number);
+
+  // Set the time (the compile time is used until the time is received from the NTP server)
+  setTime(myTZ.toUTC(compileTime()));
+  setSyncProvider(synced_clock);
+  setSyncInterval(60);
+
+  // Load dispense events that have not been published yet and the last config received from Google Sheets
+  begin_event_log();
+  load_config();
+
+  // Schedule the background tasks (any data that has not been published yet is sent once the dispenser has been idle for log_delay)
+  schedule_task(task_check_time, time_check);
+  schedule_task(task_publish, log_delay);
+  
+
+  // ----- Network -----
+
+  // Connect to WiFi in the background (the dispenser works without a network, and OTA programming, the time and publishing start once WiFi is connected)
+  hal_wifi_begin(ssid, password);
+
+  setup_time = hal_millis();
+  Serial.print("Ready (startup took ");
+  Serial.print(setup_time);
+  Serial.println(" ms)");
+}
+
+
+// Start the network services once WiFi has connected for the first time (WiFi reconnects by itself after that)
+void start_network() {
+  network_started = true;
+  network_up_time = hal_millis();
+  Serial.print("WiFi connected ");
+  Serial.print(network_up_time);
+  Serial.print(" ms after startup, IP address: ");
+  Serial.println(hal_local_ip());
+
+  // ----- Required for OTA programming -----
+
+  ArduinoOTA.onStart([]() {
+    String type;
+    if (ArduinoOTA.getCommand() == U_FLASH) {
+      type = "sketch";
+    } else { // U_FS
+      type = "filesystem";
+    }
+    Serial.println("Start updating " + type);
+  });
+  ArduinoOTA.onEnd([]() {
+    Serial.println("\nEnd");
+  });
+  ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
+    Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
+  });
+  ArduinoOTA.onError([](ota_error_t error) {
+    Serial.printf("Error[%u]: ", error);
+    if (error == OTA_AUTH_ERROR) {
+      Serial.println("Auth Failed");
+    } else if (error == OTA_BEGIN_ERROR) {
+      Serial.println("Begin Failed");
+    } else if (error == OTA_CONNECT_ERROR) {
+      Serial.println("Connect Failed");
+    } else if (error == OTA_RECEIVE_ERROR) {
+      Serial.println("Receive Failed");
+    } else if (error == OTA_END_ERROR) {
+      Serial.println("End Failed");
+    }
+  });
+  ArduinoOTA.setHostname(host_name);
+  ArduinoOTA.begin();
+
+  // Get the time from the NTP server in the background
+  ntp_udp.begin(2390);
+  schedule_task(task_time_sync, 0);
+
+  // Get the config from Google Sheets once the dispenser is idle (with mqtt_only nothing is published to Google Sheets, so this is the only way the config arrives)
+  schedule_task(task_check_config, 0);
+
+  // Serve the status and config on the local network, and the loop profile and heap stats for scraping
+  web_server.on("/status", HTTP_GET, handle_status);
+  web_server.on("/config", HTTP_GET, handle_config);
+  web_server.on("/config", HTTP_POST, handle_config_update);
+  web_server.on("/metrics", HTTP_GET, handle_metrics);
+  web_server.begin();
+  MDNS.addService("http", "tcp", web_port); // the mDNS responder is started by ArduinoOTA
+
+  // Turn off the red startup LEDs unless the dispenser is already being used
+  if (!display_on && !animation_running) {
+    for(int j = 0; j < led_count; j++) {
+      set_pixel(j, 0);
+    }
+    show_frame();
+  }
+}
+
+
+// Format and print a time_t value with a time zone appended, assign the local time zone and daylight savings adjusted hour to current_hour
+void printDateTime(time_t t, const char *tz)
+{
+    char buf[32];
+    char m[4];    // temporary storage for month string (DateStrings.cpp uses shared buffer)
+    strcpy(m, monthShortStr(month(t)));
+    sprintf(buf, "%.2d:%.2d:%.2d %s %.2d %s %d %s",
+        hour(t), minute(t), second(t), dayShortStr(weekday(t)), day(t), m, year(t), tz);
+    Serial.println(buf);
+    current_hour =  hour(t);
+}
+
+
+// Set all LEDs in the ring to a color at the given fade step (0 = off, pwm_intervals = full brightness)
+void draw_leds(led_color color, int step) {
+  int brightness;
+  if (!afterhours) {brightness = pgm_read_byte(&fade_levels.level[step]);}       // LEDs set to full brightness
+  if (afterhours)  {brightness = pgm_read_byte(&fade_levels_dimmed.level[step]);} // LEDs dimmed during afterhours timeframe
+  uint32_t pixel_color = rgb_color(brightness * pgm_read_byte(&led_palette[color].red) / 4,
+                                   brightness * pgm_read_byte(&led_palette[color].green) / 4,
+                                   brightness * pgm_read_byte(&led_palette[color].blue) / 4);
+  for(int j = 0; j < led_count; j++) {
+    set_pixel(j, pixel_color);
+  }
+  show_frame();
+}
+
+
+// Start an LED animation from the current fade step (retargets any fade already in progress)
+void start_animation(const led_animation &next) {
+  animation = next;
+  animation_running = true;
+  animation_frame_time = hal_millis() - animation.wait; // show the first frame on the next call to update_leds()
+}
+
+
+// Run an LED animation now (cancelling anything queued), or queue it to run once the current animations have finished
+void animate(const led_animation &next, bool queued) {
+  led_on = (next.target > 0 && next.pulses == 0); // are the LEDs on once this animation has finished?
+  if (!queued) {
+    animation_queue_count = 0;
+    start_animation(next);
+  }
+  else if (!animation_running) {
+    start_animation(next);
+  }
+  else if (animation_queue_count < led_queue_size) {
+    animation_queue[animation_queue_count] = next;
+    animation_queue_count++;
+  }
+}
+
+
+// Fade LEDs on
+void fade_in(led_color fade_color, int wait) {
+  animate({fade_color, pwm_intervals, wait, 0, false}, false);
+}
+
+
+// Fade LEDs off
+void fade_out(led_color fade_color, int wait) {
+  animate({fade_color, 0, wait, 0, false}, false);
+}
+
+
+// Flash LEDs (fade in and back out) a number of times once the current animation has finished, -1 to flash until cancelled
+void flash_leds(led_color flash_color, int wait, int pulses, bool blink_builtin = false) {
+  animate({flash_color, pwm_intervals, wait, pulses, blink_builtin}, true);
+}
+
+
+// Show a solid color at full brightness immediately, cancelling any running animation
+void show_leds(led_color color) {
+  animation_queue_count = 0;
+  animation_running = false;
+  animation_step = pwm_intervals;
+  draw_leds(color, animation_step);
+}
+
+
+// Advance the current LED animation by at most one frame (called on every pass through the loop so animations never block it)
+void update_leds() {
+  if (!animation_running) {return;}
+  unsigned long frame_time = hal_millis();
+  if (frame_time - animation_frame_time < (unsigned long)animation.wait) {return;}
+  animation_frame_time = frame_time;
+
+  if (animation_step != animation.target) {
+    animation_step += (animation_step < animation.target) ? 1 : -1;
+    draw_leds(animation.color, animation_step);
+    if (animation_step != animation.target) {return;}
+  }
+
+  // fade has reached its target, turn around if flashing
+  if (animation.pulses != 0) {
+    if (animation.blink_builtin) {hal_write(LED_BUILTIN, !hal_read(LED_BUILTIN));}
+    if (animation.target > 0) {
+      animation.target = 0;
+      return;
+    }
+    if (animation.pulses > 0) {animation.pulses--;}
+    if (animation.pulses != 0) {
+      animation.target = pwm_intervals;
+      return;
+    }
+  }
+
+  // animation has finished, start the next one in the queue
+  if (animation_step == 0) {orange_led = false;}
+  animation_running = false;
+  if (animation_queue_count > 0) {
+    led_animation next = animation_queue[0];
+    for (int k = 1; k < animation_queue_count; k++) {animation_queue[k - 1] = animation_queue[k];}
+    animation_queue_count--;
+    start_animation(next);
+  }
+}
+
+
+/*// Show LED animations or flashing lights if button is held down long enough just for fun
+void LED_animation() {
+  for (int i = 0; i < 10; i++) {
+    fade_in(led_red, 7);
+    fade_out(led_red, 7);
+    fade_in(led_green, 7);
+    fade_out(led_green, 7);
+    fade_in(led_purple, 7);
+    fade_out(led_purple, 7);
+    fade_in(led_blue, 7);
+    fade_out(led_blue, 7);
+  }
+}*/
+
+
+// Check the time (get current hour of 0 to 23)
+void check_time() {
+  time_t utc = now();                     // gets current UTC time
+  time_t local = myTZ.toLocal(utc, &tcr); // gets current local time
+  //printDateTime(utc, "UTC");            // sets current_hour and prints UTC time
+  printDateTime(local, tcr -> abbrev);    // sets current_hour and prints local time
+  //Serial.print("current hour: "); Serial.println(current_hour); //current_hour assigned in printDateTime function
+  
+  // Turn afterhours on or off based on current time and inputs from Google Sheets with the following if/elseif block
+  // if afterhours start time or afterhours stop time == -1 disable afterhours functions
+  if (afterhours_start == -1 || afterhours_stop == -1) {
+    afterhours = false;
+    Serial.println("afterhours mode: disabled"); 
+  }
+  // if afterhours start time > afterhours stop time (example: start at hour 23 and end at 8)
+  else if (afterhours_start > afterhours_stop) {
+    if (current_hour >= afterhours_start || current_hour < afterhours_stop) { // check to see if time is during afterhours
+      afterhours = true;
+      Serial.println("afterhours mode: ON"); 
+    }
+    else {
+      afterhours = false;
+      Serial.println("afterhours mode: OFF"); 
+    }
+  }
+  // if afterhours start time == afterhours stop time (example: start at hour 2 and end at 2)
+  else if (afterhours_start == afterhours_stop) {
+    afterhours = false;
+    Serial.println("afterhours mode: OFF"); 
+   
+  }
+  // if afterhours start time < afterhours stop time (example: start at hour 0 and end at 8)
+  else if (afterhours_start < afterhours_stop) {
+    if (current_hour >= afterhours_start && current_hour < afterhours_stop) { // check to see if time is during afterhours
+      afterhours = true;
+      Serial.println("afterhours mode: ON"); 
+    }
+    else {
+      afterhours = false;
+      Serial.println("afterhours mode: OFF"); 
+    }
+  }
+}
+
+
+// Handle errors based on error_status value
+void error() {
+  uint32_t section_start = hal_cycles();
+
+  Serial.print("error status ");
+  Serial.println(error_status);
+
+  // error_status 1: water running for too long
+  // close valve and keep flashing red LEDs, board must be reset manually before used again (loop stops dispensing while error_status is 1)
+  if (error_status == 1) {
+    hal_write(valve_output, LOW);
+    run_time = hal_millis() - timer_start;
+    run_total = run_total + run_time;
+    pulse_total = pulse_total + (flow_pulses - valve_open_pulses);
+    log_event(run_time, button_pressed ? dispense_button : dispense_sensor, flow_pulses - valve_open_pulses);
+    hal_write(LED_BUILTIN, HIGH);
+    fade_out(led_red, 1);
+    flash_leds(led_red, 10, -1, true);
+  }
+
+  // error_status 2: could not connect to Google Sheets (only enabled when debug mode is on)
+  // allow program to continue and try to publish data again later
+  if(error_status == 2 && debug_mode == true) {
+    // flash onboard LED and green NeoPixels
+    flash_leds(led_green, 1, 4, true);
+  }
+
+  // error_status 3: filter change warning
+  // flash red LEDs then allow program to continue, reset error_status back to zero because the turn_off function will check for change filter each time valve is turned off
+  if (error_status == 3) {
+    // flash onboard LED and red NeoPixels once the display has faded out
+    flash_leds(led_red, 7, 5, true);
+    error_status = 0;   
+  }
+  profile_end(profile_error, section_start);
+}
+
+
+// Read a line of the server response into response_line without waiting for data that has not arrived yet
+// returns true once a complete line has been read (budget is the number of bytes that can still be read this pass through the loop)
+bool read_response_line(int &budget) {
+  while (budget > 0 && publish_client.available()) {
+    char c = publish_client.read();
+    budget--;
+    if (c == '\n') {
+      response_line[response_line_length] = '\0';
+      response_line_length = 0;
+      return true;
+    }
+    if (c != '\r' && response_line_length < response_line_size - 1) {
+      response_line[response_line_length] = c;
+      response_line_length++;
+    }
+  }
+  return false;
+}
+
+
+// Restart the publish timeout and move on to the next publish state
+void next_publish_state(publish_states next) {
+  publish_state = next;
+  publish_timer = hal_millis();
+}
+
+
+// A sink has finished sending the batch being published, remove the batch from the total or event log once every sink has finished and every required sink has received it
+// (a batch that is sent again after a required sink failed may reach the other sinks twice, so each MQTT message carries the event numbers it covers)
+void sink_finished(sink_ids sink, bool received) {
+  if (!(sinks_pending & (1 << sink))) {return;}
+  sinks_pending &= ~(1 << sink);
+  if (!received && (sinks_required & (1 << sink))) {batch_received = false;}
+  if (sinks_pending != 0) {return;}
+  if (!batch_received) { // try to publish again later
+    schedule_task(task_publish, log_delay);
+    return;
+  }
+  run_total = run_total - published_total;
+  pulse_total = pulse_total - published_pulses;
+  if (event_log_ready) {
+    unsent_event = batch_end;
+    save_unsent_event();
+    if (batch_full) {schedule_task(task_publish, 0);} // publish the next batch straight away
+  }
+}
+
+
+// Stop publishing and close the connection to the server (a batch the script has not confirmed logging is sent again later)
+void stop_publish() {
+  publish_client.stop();
+  publish_state = publish_idle;
+  response_line_length = 0;
+  if (!publish_config_only) {sink_finished(sink_sheets, false);} // does nothing once the reply has been read
+}
+
+
+// Handle a failed publish, try again after log_delay
+void publish_failed(const char *reason) {
+  Serial.print("publish failed: ");
+  Serial.println(reason);
+  stop_publish();
+  if (!publish_posted) {
+    error_status = 2;
+    error();
+  }
+}
+
+
+// Data has been received by Google Sheets (the batch is only removed from the total or event log once the script's response says it has been logged, see apply_config())
+void publish_received() {
+  publish_posted = true;
+  if (publish_config_only) {return;}
+  hal_write(LED_BUILTIN, HIGH);
+}
+
+
+// The script's response says it has logged the batch up to batch_end, remove the published run time from the total (the valve may have been used again since the payload was sent)
+// (a batch that is not confirmed is sent again, and the script skips the events it already has)
+void publish_confirmed(bool logged) {
+  if (publish_config_only) {return;}
+  if (!logged) {
+    Serial.println("batch not logged by google sheets");
+    return; // stop_publish() sends it again later
+  }
+  Serial.print("total run time published: ");
+  Serial.println(published_total);
+  sink_finished(sink_sheets, true);
+}
+
+
+// Reads the response body straight from the TLS connection (removing the chunked transfer encoding) so it can be parsed without copying it into a String first
+class response_body_stream : public Stream {
+  public:
+    int available() {
+      if (response_chunked && chunk_remaining == 0) { // read the size of the next chunk (or the line break after a chunk)
+        int budget = publish_slice;
+        while (read_response_line(budget)) {
+          if (response_line[0] == '\0') {continue;}
+          chunk_remaining = strtol(response_line, nullptr, 16);
+          break;
+        }
+        if (chunk_remaining == 0) {return 0;}
+      }
+      if (!response_chunked && response_length == 0) {return 0;}
+      int waiting = publish_client.available();
+      long remaining = response_chunked ? chunk_remaining : response_length;
+      if (remaining > 0 && waiting > remaining) {waiting = remaining;}
+      return waiting;
+    }
+    int read() {
+      if (available() == 0) {return -1;}
+      if (response_chunked) {chunk_remaining--;}
+      else if (response_length > 0) {response_length--;}
+      return publish_client.read();
+    }
+    int peek() {
+      if (available() == 0) {return -1;}
+      return publish_client.peek();
+    }
+    size_t write(uint8_t) {
+      return 0;
+    }
+};
+response_body_stream response_body;
+
+
+// Assign the config values returned from Google Sheets
+void apply_config() {
+  config_filter.clear();
+  config_filter["gallons"] = true;
+  config_filter["version"] = true;
+  config_filter["conversion"] = true;
+  config_filter["target"] = true;
+  config_filter["filter"] = true;
+  config_filter["a"] = true;
+  config_filter["b"] = true;
+  config_filter["c"] = true;
+  config_filter["d"] = true;
+  config_filter["e"] = true;
+  config_filter["afterhours_start"] = true;
+  config_filter["afterhours_stop"] = true;
+  config_filter["logged"] = true;
+
+  // get data from Google Sheets json response and assign values to appropriate variables
+  response_body.setTimeout(response_parse_timeout);
+  DeserializationError json_error = deserializeJson(config_doc, response_body, DeserializationOption::Filter(config_filter));
+  if (hal_free_heap() < publish_min_heap) {publish_min_heap = hal_free_heap();}
+  Serial.print("payload received: ");
+  serializeJson(config_doc, Serial);
+  Serial.println("");
+  if (json_error) {
+    Serial.print("could not read response: ");
+    Serial.println(json_error.c_str());
+    return;
+  }
+  publish_confirmed(!config_doc["logged"].isNull() && (uint32_t)config_doc["logged"] == batch_end); // the number after the last event the script logged
+  schedule_task(task_check_config, config_check); // no need to check for config changes until config_check after this response
+  total_gallons = config_doc["gallons"];
+  Serial.print("total gallons: ");
+  Serial.println(total_gallons);
+  if (config_doc.containsKey("target")) { // config values are only sent when they have changed since config_version
+    conversion_factor = config_doc["conversion"];
+    oz_target = config_doc["target"];
+    filter_change = config_doc["filter"];
+    function_1_oz = config_doc["a"];
+    function_2_oz = config_doc["b"];
+    function_3_oz = config_doc["c"];
+    function_4_oz = config_doc["d"];
+    function_5_oz = config_doc["e"];
+    afterhours_start = config_doc["afterhours_start"];
+    afterhours_stop = config_doc["afterhours_stop"];
+    strncpy(config_version, config_doc["version"] | "", sizeof(config_version) - 1);
+    Serial.print("config version: ");
+    Serial.println(config_version);
+    Serial.print("filter change: ");
+    Serial.println(filter_change);      
+    Serial.print("conversion factor: ");
+    Serial.println(conversion_factor, 4);
+    Serial.print("oz_target: ");
+    Serial.println(oz_target);
+    Serial.print("automatic dispense presets: ");
+    Serial.print(function_1_oz);  
+    Serial.print(",");
+    Serial.print(function_2_oz);  
+    Serial.print(",");
+    Serial.print(function_3_oz);  
+    Serial.print(",");
+    Serial.print(function_4_oz);  
+    Serial.print(",");
+    Serial.println(function_5_oz);  
+    Serial.print("afterhours: from "); Serial.print(afterhours_start); Serial.print(" to "); Serial.println(afterhours_stop);
+  }
+  else {
+    Serial.println("config unchanged");
+  }
+  save_config(); // only written if a value has changed
+  Serial.print("request sent: ");
+  Serial.print(request_length);
+  Serial.println(" bytes");
+  print_connection_stats();
+  print_latency_stats();
+  Serial.print("lowest free heap while publishing: ");
+  Serial.print(publish_min_heap);
+  Serial.println(" bytes");
+  Serial.println("");
+  if (debug_mode == true) {flash_leds(led_green, 5, 1);}
+}
+
+
+// Add a number to an encoded batch, 7 bits per byte with the high bit set on every byte but the last (numbers under 128 take one byte)
+size_t encode_varint(uint8_t *data, size_t pos, uint32_t value) {
+  while (value >= 0x80) {
+    data[pos++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  data[pos++] = value;
+  return pos;
+}
+
+
+// Add the start of a batch header: format, command, flags (bit 0 set if there is a flow meter) and config_version (its length first)
+size_t encode_batch_header(uint8_t *data, batch_commands command) {
+  size_t pos = 0;
+  size_t version_length = strlen(config_version);
+  data[pos++] = batch_format;
+  data[pos++] = command;
+  data[pos++] = flow_meter_installed ? 1 : 0;
+  data[pos++] = version_length;
+  memcpy(data + pos, config_version, version_length);
+  return pos + version_length;
+}
+
+
+// Send data base64 encoded, a few bytes at a time so no buffer is needed for the whole encoded body
+void write_base64(Print &out, const uint8_t *data, size_t length) {
+  static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char chunk[64];
+  size_t chunk_length = 0;
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t bits = (uint32_t)data[i] << 16;
+    if (i + 1 < length) {bits |= (uint32_t)data[i + 1] << 8;}
+    if (i + 2 < length) {bits |= data[i + 2];}
+    chunk[chunk_length++] = digits[(bits >> 18) & 0x3f];
+    chunk[chunk_length++] = digits[(bits >> 12) & 0x3f];
+    chunk[chunk_length++] = (i + 1 < length) ? digits[(bits >> 6) & 0x3f] : '=';
+    chunk[chunk_length++] = (i + 2 < length) ? digits[bits & 0x3f] : '=';
+    if (chunk_length == sizeof(chunk)) {
+      out.write((const uint8_t *)chunk, chunk_length);
+      chunk_length = 0;
+    }
+  }
+  if (chunk_length > 0) {out.write((const uint8_t *)chunk, chunk_length);}
+}
+
+
+// Start publishing the batch being published to Google Sheets, or only checking for config changes (the publish is carried out a little at a time by update_publish())
+void start_publish(bool config_only = false) {
+  if (publish_state != publish_idle) {return;}
+  publish_config_only = config_only;
+  publish_min_heap = hal_free_heap();
+  if (config_only) { // only check for config changes
+    request_data = config_request;
+    request_length = encode_batch_header(config_request, command_get_config);
+  }
+  else {
+    request_data = batch_data + batch_offset;
+    request_length = batch_length;
+  }
+  strcpy(request_host, host);
+  request_path = url;
+  publish_posted = false;
+  Serial.println("");
+  if (debug_mode == true) {Serial.println("**DEBUG MODE**");}
+  next_publish_state(publish_connect);
+}
+
+
+// Check Google Sheets for config changes if nothing has been published for a while (run by task_check_config)
+void check_config() {
+  if (valve_open || display_on || publish_state != publish_idle || !hal_wifi_connected()) {
+    schedule_task(task_check_config, task_retry_delay);
+    return;
+  }
+  schedule_task(task_check_config, config_check);
+  start_publish(true);
+}
+
+
+// Stop a publish that has not reached Google Sheets yet so it does not hold up dispensing water (it will be sent again later)
+void abort_publish() {
+  if (publish_state == publish_idle) {return;}
+  if (!publish_posted && publish_state > publish_send) {return;} // request has already been sent, finish reading the response a little at a time
+  Serial.println("publish interrupted");
+  stop_publish();
+}
+
+
+// Carry out the next step of publishing data to Google Sheets, doing a limited amount of work per pass through the loop
+void update_publish() {
+  if (publish_state == publish_idle) {return;}
+  if (hal_millis() - publish_timer > publish_timeout) {
+    publish_failed("timed out");
+    return;
+  }
+  int budget = publish_slice; // number of response bytes that can be read this pass through the loop
+  if (hal_free_heap() < publish_min_heap) {publish_min_heap = hal_free_heap();}
+
+  switch (publish_state) {
+    case publish_connect: // DNS lookup, TCP connection and TLS handshake
+      if (valve_open || display_on) {return;} // wait until the dispenser is not being used
+      if (!open_connection(request_host)) {
+        publish_failed("could not connect");
+        return;
+      }
+      next_publish_state(publish_send);
+      break;
+
+    case publish_send:
+      if (!publish_posted) {
+        publish_client.print("POST ");
+        publish_client.print(request_path);
+        publish_client.print(" HTTP/1.1\r\nHost: ");
+        publish_client.print(request_host);
+        publish_client.print("\r\nContent-Type: text/plain\r\nContent-Length: ");
+        publish_client.print((unsigned long)((request_length + 2) / 3 * 4)); // length once base64 encoded
+        publish_client.print("\r\nConnection: close\r\n\r\n");
+        write_base64(publish_client, request_data, request_length);
+      }
+      else { // follow the redirect to get the response from the script
+        publish_client.print("GET ");
+        publish_client.print(request_path);
+        publish_client.print(" HTTP/1.1\r\nHost: ");
+        publish_client.print(request_host);
+        publish_client.print("\r\nConnection: close\r\n\r\n");
+      }
+      response_status = 0;
+      response_length = -1;
+      response_chunked = false;
+      chunk_remaining = 0;
+      next_publish_state(publish_status);
+      break;
+
+    case publish_status:
+      if (!read_response_line(budget)) {return;}
+      if (strncmp(response_line, "HTTP/1.", 7) != 0) {
+        publish_failed("invalid response");
+        return;
+      }
+      response_status = atoi(response_line + 9);
+      if (!publish_posted && response_status != 200 && response_status != 302) {
+        publish_failed(response_line);
+        return;
+      }
+      if (!publish_posted) {publish_received();} // script has run once Google has responded to the POST
+      next_publish_state(publish_headers);
+      break;
+
+    case publish_headers:
+      while (read_response_line(budget)) {
+        if (response_line[0] == '\0') { // end of headers
+          if (response_status == 302) { // follow the redirect to script.googleusercontent.com unless the dispenser is being used
+            publish_client.stop();
+            if (valve_open || display_on || request_path.length() == 0) {
+              stop_publish();
+              return;
+            }
+            next_publish_state(publish_connect);
+            return;
+          }
+          if (response_status != 200) {
+            publish_failed("could not get response");
+            return;
+          }
+          next_publish_state(publish_body);
+          return;
+        }
+        if (strncasecmp(response_line, "Location: https://", 18) == 0) {
+          char *path = strchr(response_line + 18, '/');
+          if (path != nullptr && path - (response_line + 18) < (int)sizeof(request_host)) {
+            strncpy(request_host, response_line + 18, path - (response_line + 18));
+            request_host[path - (response_line + 18)] = '\0';
+            request_path = path;
+          }
+          else {
+            request_path = "";
+          }
+        }
+        if (strncasecmp(response_line, "Content-Length:", 15) == 0) {
+          response_length = atol(response_line + 15);
+        }
+        if (strncasecmp(response_line, "Transfer-Encoding:", 18) == 0 && strstr(response_line, "chunked") != nullptr) {
+          response_chunked = true;
+        }
+      }
+      break;
+
+    case publish_body: // wait for the start of the body to arrive, it is then parsed straight from the connection
+      if (response_body.available() > 0) {
+        next_publish_state(publish_parse);
+      }
+      else if (!publish_client.connected()) {
+        publish_failed("connection closed");
+      }
+      break;
+
+    case publish_parse:
+      apply_config();
+      stop_publish();
+      break;
+
+    default:
+      break;
+  }
+}
+
+
+// Send the batch being published to Google Sheets
+bool send_sheets() {
+  if (mqtt_only || publish_state != publish_idle) {return false;}
+  start_publish();
+  return true;
+}
+
+
+// Add a string to the MQTT packet being built (strings are sent with their length first)
+int mqtt_add_string(int pos, const char *text) {
+  int length = strlen(text);
+  mqtt_packet[pos++] = length >> 8;
+  mqtt_packet[pos++] = length & 0xff;
+  memcpy(mqtt_packet + pos, text, length);
+  return pos + length;
+}
+
+
+// Send the MQTT packet built in mqtt_packet from mqtt_header_room up to end followed by any data, with the fixed header for the packet type written in front of it
+bool mqtt_send(uint8_t type, int end, const uint8_t *data = nullptr, size_t data_length = 0) {
+  uint8_t header[mqtt_header_room];
+  int header_length = 0;
+  unsigned long length = end - mqtt_header_room + data_length;
+  header[header_length++] = type;
+  do { // remaining length is sent 7 bits at a time
+    header[header_length] = length & 0x7f;
+    length >>= 7;
+    if (length > 0) {header[header_length] |= 0x80;}
+    header_length++;
+  } while (length > 0);
+  int start = mqtt_header_room - header_length;
+  memcpy(mqtt_packet + start, header, header_length);
+  size_t size = end - start;
+  if (mqtt_client.write(mqtt_packet + start, size) != size) {return false;}
+  if (data_length > 0 && mqtt_client.write(data, data_length) != data_length) {return false;}
+  mqtt_last_send = hal_millis();
+  return true;
+}
+
+
+// Publish a retained message to the MQTT broker (acknowledged messages are sent with QoS 1 and use the next packet ID)
+bool mqtt_publish(const char *topic, const uint8_t *message, size_t length, bool acknowledged) {
+  if (mqtt_header_room + 2 + strlen(topic) + 2 > mqtt_packet_size) {return false;}
+  int pos = mqtt_add_string(mqtt_header_room, topic);
+  if (acknowledged) {
+    mqtt_packet_id++;
+    if (mqtt_packet_id == 0) {mqtt_packet_id = 1;} // packet ID 0 is not allowed
+    mqtt_packet[pos++] = mqtt_packet_id >> 8;
+    mqtt_packet[pos++] = mqtt_packet_id & 0xff;
+  }
+  return mqtt_send(acknowledged ? 0x33 : 0x31, pos, message, length); // PUBLISH with retain, QoS 1 or QoS 0
+}
+
+
+// Close the connection to the MQTT broker (a batch waiting to be acknowledged is counted as failed)
+void mqtt_disconnect(const char *reason) {
+  Serial.print("mqtt disconnected: ");
+  Serial.println(reason);
+  mqtt_client.stop();
+  mqtt_state = mqtt_disconnected;
+  mqtt_retry_waiting = true;
+  mqtt_timer = hal_millis();
+  mqtt_ping_waiting = false;
+  mqtt_response_length = 0;
+  if (mqtt_waiting) {
+    mqtt_waiting = false;
+    mqtt_failures++;
+    sink_finished(sink_mqtt, false);
+  }
+}
+
+
+// Connect to the MQTT broker and send the connection request (the broker publishes "offline" to mqtt_topic/status for us if the connection is lost)
+void mqtt_connect() {
+  if (!mqtt_client.connect(mqtt_broker, mqtt_port)) {
+    mqtt_disconnect("could not connect");
+    return;
+  }
+  mqtt_client.setNoDelay(true);
+  int pos = mqtt_add_string(mqtt_header_room, "MQTT");
+  mqtt_packet[pos++] = 4;                   // protocol level (MQTT 3.1.1)
+  mqtt_packet[pos++] = 0x26;                // clean session, with a retained QoS 0 will message
+  mqtt_packet[pos++] = mqtt_keepalive >> 8;
+  mqtt_packet[pos++] = mqtt_keepalive & 0xff;
+  pos = mqtt_add_string(pos, host_name);    // client ID
+  pos = mqtt_add_string(pos, mqtt_topic "/status");
+  pos = mqtt_add_string(pos, "offline");
+  if (!mqtt_send(0x10, pos)) {
+    mqtt_disconnect("could not send connect");
+    return;
+  }
+  mqtt_state = mqtt_connecting;
+  mqtt_timer = hal_millis();
+}
+
+
+// Handle a packet received from the MQTT broker (mqtt_response holds its first 4 bytes)
+void mqtt_handle_response() {
+  switch (mqtt_response[0] & 0xf0) {
+    case 0x20: // CONNACK
+      if (mqtt_state != mqtt_connecting) {break;}
+      if (mqtt_response[3] != 0) {
+        mqtt_disconnect("connection refused");
+        break;
+      }
+      mqtt_state = mqtt_connected;
+      mqtt_retry_waiting = false;
+      mqtt_connects++;
+      Serial.println("mqtt connected");
+      mqtt_publish(mqtt_topic "/status", (const uint8_t *)"online", 6, false);
+      break;
+    case 0x40: // PUBACK
+      if (!mqtt_waiting || (uint16_t)((mqtt_response[2] << 8) | mqtt_response[3]) != mqtt_packet_id) {break;}
+      mqtt_waiting = false;
+      mqtt_published++;
+      sink_finished(sink_mqtt, true);
+      break;
+    case 0xd0: // PINGRESP
+      mqtt_ping_waiting = false;
+      break;
+    default:
+      break;
+  }
+}
+
+
+// Send the batch being published to the MQTT broker as one small retained message in the binary batch format (the broker acknowledges it with the packet ID)
+bool send_mqtt() {
+  if (mqtt_state != mqtt_connected || mqtt_waiting) {return false;}
+  if (!mqtt_publish(mqtt_topic "/batch", batch_data + batch_offset, batch_length, true)) {
+    mqtt_disconnect("could not publish");
+    return false;
+  }
+  mqtt_waiting = true;
+  mqtt_timer = hal_millis();
+  return true;
+}
+
+
+// Keep the connection to the MQTT broker open and read its acknowledgements, doing a limited amount of work per pass through the loop
+void update_mqtt() {
+  if (mqtt_broker[0] == '\0' || !network_started) {return;}
+  unsigned long now = hal_millis();
+  if (mqtt_state == mqtt_disconnected) {
+    if (valve_open || display_on || !hal_wifi_connected()) {return;} // connecting blocks for a moment, wait until the dispenser is not being used
+    if (mqtt_retry_waiting && now - mqtt_timer < mqtt_retry_delay) {return;}
+    mqtt_connect();
+    return;
+  }
+  if (!mqtt_client.connected()) {
+    mqtt_disconnect("connection lost");
+    return;
+  }
+  int budget = mqtt_packet_size; // number of bytes that can be read this pass through the loop
+  while (budget-- > 0 && mqtt_client.available() > 0) {
+    uint8_t data = mqtt_client.read();
+    if (mqtt_response_length < sizeof(mqtt_response)) {mqtt_response[mqtt_response_length] = data;}
+    mqtt_response_length++;
+    if (mqtt_response_length == 2 && (mqtt_response[1] & 0x80)) { // only short packets are expected
+      mqtt_disconnect("unexpected packet");
+      return;
+    }
+    if (mqtt_response_length >= 2 && mqtt_response_length == 2 + mqtt_response[1]) {
+      mqtt_handle_response();
+      mqtt_response_length = 0;
+      if (mqtt_state == mqtt_disconnected) {return;}
+    }
+  }
+  if ((mqtt_state == mqtt_connecting || mqtt_waiting) && now - mqtt_timer > mqtt_ack_timeout) {
+    mqtt_disconnect("timed out");
+    return;
+  }
+  if (mqtt_state != mqtt_connected) {return;}
+  if (mqtt_ping_waiting && now - mqtt_last_send > mqtt_ack_timeout) {
+    mqtt_disconnect("ping timed out");
+    return;
+  }
+  if (!mqtt_ping_waiting && now - mqtt_last_send > mqtt_keepalive * 500UL) {
+    if (!mqtt_send(0xc0, mqtt_header_room)) { // PINGREQ
+      mqtt_disconnect("could not send ping");
+      return;
+    }
+    mqtt_ping_waiting = true;
+  }
+}
+
+
+// Telemetry sinks (listed in sink_ids order)
+telemetry_sink sinks[sink_count] = {
+  {"google sheets", !mqtt_only, send_sheets, update_publish},
+  {"mqtt",          mqtt_only,  send_mqtt,   update_mqtt},
+};
+
+
+// Start sending the oldest unpublished usage data to every sink (run time and flow meter pulses from the event log, or the running totals if it could not be opened)
+// The batch is encoded once into batch_data (numbers are varints, see encode_varint()):
+//   header:  format, command, flags and config version (encode_batch_header()),
+//            then flow_pulses_per_gallon (flow meter only), first event number, number of event numbers covered,
+//            number of events, total run time (ms) and total pulses (flow meter only)
+//   events:  number of events left out just before this one, start time (unix time, zigzag encoded difference from the last event),
+//            run time (ms), mode (one byte, with event_synced set if the start time came from the NTP server) and pulses (flow meter only)
+// (events that could not be read from flash are left out, so the number of events can be less than the event numbers covered)
+void start_publish_batch() {
+  if (sinks_pending != 0 || publish_state != publish_idle) {return;} // the last batch is still being sent, or Google Sheets is checking for config changes
+  unsigned long encode_start = hal_micros();
+  published_total = run_total;
+  published_pulses = pulse_total;
+  batch_start = next_event;
+  batch_end = next_event;
+  batch_full = false;
+  uint32_t event_count = 0;
+  size_t pos = batch_header_room;
+  if (event_log_ready) { // publish the oldest batch of events that have not been published yet
+    published_total = 0;
+    published_pulses = 0;
+    batch_start = unsent_event;
+    batch_end = unsent_event;
+    uint32_t last_start = 0;
+    uint32_t expected_event = batch_start;
+    dispense_event event;
+    while (batch_end < next_event && batch_end - unsent_event < publish_batch_size) {
+      if (read_event(batch_end, event)) {
+        published_total += event.duration;
+        published_pulses += event.pulses;
+        int32_t start_change = event.start - last_start;
+        last_start = event.start;
+        pos = encode_varint(batch_data, pos, batch_end - expected_event); // the script uses the event numbers to skip events it already has when a batch is sent again
+        expected_event = batch_end + 1;
+        pos = encode_varint(batch_data, pos, ((uint32_t)start_change << 1) ^ (uint32_t)(start_change >> 31)); // small changes either way take few bytes
+        pos = encode_varint(batch_data, pos, event.duration);
+        batch_data[pos++] = event.mode;
+        if (flow_meter_installed) {pos = encode_varint(batch_data, pos, event.pulses);}
+        event_count++;
+      }
+      else {dropped_events++;}
+      batch_end++;
+    }
+    batch_full = (batch_end < next_event);
+  }
+  uint8_t header[batch_header_room];
+  size_t header_length = encode_batch_header(header, event_log_ready ? command_insert_events : command_insert_row);
+  if (flow_meter_installed) {header_length = encode_varint(header, header_length, flow_pulses_per_gallon);}
+  header_length = encode_varint(header, header_length, batch_start);
+  header_length = encode_varint(header, header_length, batch_end - batch_start);
+  header_length = encode_varint(header, header_length, event_count);
+  header_length = encode_varint(header, header_length, published_total);
+  if (flow_meter_installed) {header_length = encode_varint(header, header_length, published_pulses);}
+  batch_offset = batch_header_room - header_length;
+  memcpy(batch_data + batch_offset, header, header_length);
+  batch_length = pos - batch_offset;
+  batch_encode_time = hal_micros() - encode_start;
+  Serial.print("batch of ");
+  Serial.print(event_count);
+  Serial.print(" events encoded in ");
+  Serial.print(batch_length);
+  Serial.print(" bytes (");
+  Serial.print(batch_encode_time);
+  Serial.println(" us)");
+  batch_received = true;
+  sinks_required = 0;
+  for (int i = 0; i < sink_count; i++) {
+    if (sinks[i].required) {sinks_required |= 1 << i;}
+    if (sinks[i].send()) {sinks_pending |= 1 << i;}
+    else if (sinks[i].required) {
+      Serial.print(sinks[i].name);
+      Serial.println(" could not take the batch");
+      batch_received = false;
+    }
+  }
+  if (sinks_pending == 0) {schedule_task(task_publish, log_delay);} // nothing is being sent, try again later
+}
+
+
+// Publish the usage data and get any config changes now (button held to the publish function), with mqtt_only the config comes from a separate check of Google Sheets
+void publish_now() {
+  start_publish_batch();
+  if (mqtt_only) {start_publish(true);}
+}
+
+
+// Carry out the next step of sending to each sink
+void update_sinks() {
+  for (int i = 0; i < sink_count; i++) {
+    sinks[i].update();
+  }
+}
+
+
+// Publish usage data to the telemetry sinks (run by task_publish once the dispenser has been idle for log_delay)
+void publish_data() {
+  if (valve_open || display_on) {return;} // the task is scheduled again when the display turns off
+  if (!hal_wifi_connected()) { // the events are kept in flash until they can be published
+    schedule_task(task_publish, log_delay);
+    return;
+  }
+  if (sinks_pending != 0 || publish_state != publish_idle) { // wait for the last batch or the config check in progress to finish
+    schedule_task(task_publish, task_retry_delay);
+    return;
+  }
+  start_publish_batch();
+}
+
+
+// Open valve and turn on NeoPixels
+void turn_on() {
+  abort_publish(); // do not let a publish hold up the dispenser
+  cancel_task(task_display_off);
+  if (!valve_open && hal_millis() - valve_close_time < cycle_time) { // allow valve to fully close before reopening it
+    if (!tasks[task_reopen_valve].scheduled) {schedule_task(task_reopen_valve, cycle_time - (hal_millis() - valve_close_time));}
+  }
+  else if (!valve_open) {
+    if (debug_mode == false) {hal_write(valve_output, HIGH);} // valve open
+    hal_write(LED_BUILTIN, LOW);      // LED on
+    timer_start = hal_millis();       // time when valve turned on
+    valve_open_pulses = flow_pulses;  // flow meter count when valve turned on
+    valve_open = true;
+    if (first_dispense_time == 0) {
+      first_dispense_time = timer_start;
+      Serial.print("first dispense ");
+      Serial.print(first_dispense_time);
+      Serial.println(" ms after startup");
+    }
+    schedule_task(task_error_check, error_time);
+    if (auto_dispense) {
+      schedule_task(task_blink, led_blink);
+      if (!flow_meter_installed) {schedule_task(task_auto_dispense, automatic_dispense_time);}
+      else {schedule_task(task_auto_dispense, (unsigned long)automatic_dispense_time * flow_time_limit);} // fallback if the flow meter does not count the amount selected
+    }
+    if (debug_mode == true) {Serial.println("**DEBUG MODE**");}
+    Serial.print("valve open at ");
+    Serial.println(timer_start);
+    unsigned long latency = hal_micros() - trigger_edge_time;
+    record_latency(open_latency, latency);
+    Serial.print("valve opened ");
+    Serial.print(latency);
+    Serial.print(" us after input was triggered (input changes dropped: ");
+    Serial.print(dropped_inputs);
+    Serial.print(", coalesced: ");
+    Serial.print(coalesced_inputs);
+    Serial.println(")");
+  }
+  if (!led_on) {  // turn on blue LEDs
+    fade_in(led_blue, 5);
+    display_on = true;
+  }  
+}
+
+
+// Close valve
+void turn_off() {
+  if (tasks[task_reopen_valve].scheduled) { // valve was waiting to be reopened, do not reopen it
+    cancel_task(task_reopen_valve);
+    button_pressed = false;
+    sensor_triggered = false;
+    schedule_task(task_display_off, display_off_delay);
+  }
+  if (valve_open) {
+    dispense_modes mode = dispense_sensor;
+    if (button_pressed) {mode = dispense_button;}
+    if (auto_dispense)  {mode = dispense_auto;}
+    hal_write(LED_BUILTIN, HIGH);    // LED off
+    hal_write(valve_output, LOW);    // valve closed
+    current_time = hal_millis();     // get current time
+    if (sensor_triggered || switch1_state == HIGH) {record_latency(close_latency, hal_micros() - clear_edge_time);} // sensors cleared, or pushbutton pressed to turn off
+    valve_open = false;
+    valve_close_time = current_time;
+    cancel_task(task_error_check);
+    cancel_task(task_auto_dispense);
+    cancel_task(task_blink);
+    button_pressed = false;
+    sensor_triggered = false;
+    button_press_multiplier = 1; // reset back to 1 after valve is off
+    auto_dispense = false;
+    Serial.print("valve closed at ");
+    Serial.println(current_time);
+    run_time = (current_time - timer_start); // calculate how long valve was open
+    Serial.print("valve was open for ");
+    Serial.print(run_time);
+    Serial.println(" ms");
+    run_total = run_total + run_time; // keep track of total time valve has been open until data is published
+    uint32_t pulses = flow_pulses - valve_open_pulses;
+    pulse_total = pulse_total + pulses;
+    if (flow_meter_installed) {
+      Serial.print("flow meter measured ");
+      Serial.print(pulses * 128.0 / flow_pulses_per_gallon);
+      Serial.println(" oz");
+    }
+    log_event(run_time, mode, pulses); // save the dispense event in case the board is reset before it is published
+    schedule_task(task_display_off, display_off_delay);
+  }
+}
+
+
+// Blink the LEDs while automatically dispensing (instead of LEDs being solid on to indicate automatic dispense mode is activated)
+void blink_leds() {
+  if (!valve_open || !auto_dispense) {return;}
+  hal_write(LED_BUILTIN, !hal_read(LED_BUILTIN));
+  if (led_on) {fade_out(led_blue, 1); } else { fade_in(led_blue, 1);}
+  schedule_task(task_blink, led_blink);
+}
+
+
+// Turn display LEDs off once the valve has been closed for display_off_delay
+void display_off() {
+  if (valve_open || !display_on) {return;}
+  if (led_on) { // turn off LEDs if they are currently on (could be off if flashing in automatic dispense mode)
+    if (orange_led) {fade_out(led_orange, 10);}
+    else {fade_out(led_blue, 10);}
+  } 
+  display_on = false;
+  schedule_task(task_publish, log_delay); // publish once the dispenser has not been used for log_delay
+  if(total_gallons > filter_change) { // check to see if filter needs to be changed
+    error_status = 3;
+    error();
+  }
+}
+
+
+// Run a scheduled task
+void run_task(task_ids task) {
+  uint32_t section_start;
+  switch (task) {
+    case task_error_check: // valve has been open for longer than error_time
+      error_status = 1;
+      error();
+      break;
+    case task_auto_dispense:
+      if (valve_open && auto_dispense) {
+        if (flow_meter_installed) {Serial.println("flow meter did not measure the amount selected in time, check the flow meter");}
+        turn_off();
+      }
+      break;
+    case task_reopen_valve:
+      turn_on();
+      break;
+    case task_blink:
+      blink_leds();
+      break;
+    case task_display_off:
+      display_off();
+      break;
+    case task_check_time: // check current time when system not in use
+      if (display_on || sensor_triggered || button_pressed) {
+        schedule_task(task_check_time, task_retry_delay);
+        break;
+      }
+      section_start = hal_cycles();
+      check_time();
+      profile_end(profile_check_time, section_start);
+      schedule_task(task_check_time, time_check);
+      break;
+    case task_time_sync:
+      start_time_sync();
+      break;
+    case task_publish:
+      publish_data();
+      break;
+    case task_check_config:
+      check_config();
+      break;
+    default:
+      break;
+  }
+}
+
+
+// Run the highest priority task whose deadline has passed (only one task is run per pass through the loop so the sensors are checked again in between)
+void run_tasks() {
+  unsigned long now = hal_millis();
+  for (int i = 0; i < task_count; i++) {
+    if (task_due((task_ids)i, now)) {
+      tasks[i].scheduled = false; // the task schedules itself again if it needs to run again
+      run_task((task_ids)i);
+      return;
+    }
+  }
+}
+
+
+// Check whether a sensor or pushbutton change is waiting to pass its input filter
+bool input_pending() {
+  for (int i = 0; i < input_count; i++) {
+    if (input_filters[i].raw != input_filters[i].output) {return true;}
+  }
+  return false;
+}
+
+
+// Wait for the next scheduled task when there is nothing else to do (stops waiting as soon as a sensor or the pushbutton changes)
+void idle_until_next_task() {
+  if (animation_running || publish_state != publish_idle || time_sync_waiting || valve_open || button_down || input_pending()) {return;}
+  unsigned long now = hal_millis();
+  unsigned long wait = idle_limit;
+  for (int i = 0; i < task_count; i++) {
+    if (!tasks[i].scheduled) {continue;}
+    long remaining = (long)(tasks[i].deadline - now);
+    if (remaining <= 0) {return;}
+    if ((unsigned long)remaining < wait) {wait = remaining;}
+  }
+  while (hal_millis() - now < wait && input_queue_head == input_queue_tail) {
+    hal_delay(1); // lets the WiFi stack run while waiting
+  }
+}
+
+
+void loop() {
+  unsigned long pass_start = hal_micros();
+  uint32_t loop_cycles = hal_cycles();
+  if (loop_start_cycles != 0) {profile_end(profile_loop, loop_start_cycles);} // time since the start of the last pass through the loop
+  loop_start_cycles = loop_cycles;
+
+  if (network_started) {ArduinoOTA.handle();} // required for OTA programming
+  check_serial(); // print the metrics if they were requested over serial
+
+  uint32_t section_start = hal_cycles();
+  update_leds();       // show the next frame of any running LED animation
+  profile_end(profile_leds, section_start);
+
+  // Stop dispensing if the valve was left open for too long, board must be reset manually before it is used again
+  if (error_status == 1) {return;}
+
+  // Read status of sensors and pushbutton
+  read_inputs(); // get status of IR sensors and pushbutton from the changes captured by the input interrupts
+  
+
+  // Button has been pressed (press on, press off, hold down for automatic dispense functions)
+  if (switch1_state == HIGH && !button_down) {
+    button_down = true;
+    if (!sensor_triggered) {
+      if (!valve_open) {
+        button_pressed = true;
+        button_holding = true;
+        button_press_time = hal_millis();
+      }
+      else if (valve_open) {  
+        turn_off();
+      }
+    }
+  }
+
+
+  // Button is being held down (select the automatic dispense functions)
+  if (switch1_state == HIGH && button_holding) {
+    current_time = hal_millis();
+    if (current_time - button_press_time > ((unsigned long)button_hold_time * button_press_multiplier)) { // execute the cases below when button has been held down for correct amount of time (ex: case 1 executed when button held down for 1 second, case 2 at 2 seconds, etc.)
+      if (function_1_oz != 0) { // only run automatic dispense function if data has been imported from google sheets, otherwise auto shut off won't work as the function_x_oz variables will all still be set to zero
+        switch (button_press_multiplier) {
+          case 1:
+            Serial.print("Function 1: ");
+            Serial.print(function_1_oz);
+            Serial.println("oz");
+            auto_dispense = true;
+            flash_leds(led_purple, 7, 1);
+            automatic_dispense_oz = function_1_oz;
+            button_press_multiplier ++;
+            break;
+          case 2:                  
+            Serial.print("Function 2: ");
+            Serial.print(function_2_oz);
+            Serial.println("oz");
+            auto_dispense = true;
+            flash_leds(led_purple, 7, 1);
+            automatic_dispense_oz = function_2_oz;
+            button_press_multiplier ++;
+            break;
+          case 3:                    
+            Serial.print("Function 3: ");
+            Serial.print(function_3_oz);
+            Serial.println("oz");
+            auto_dispense = true;
+            flash_leds(led_purple, 7, 1);
+            automatic_dispense_oz = function_3_oz;
+            button_press_multiplier ++;
+            break;
+          case 4:                
+            Serial.print("Function 4: ");
+            Serial.print(function_4_oz);
+            Serial.println("oz");
+            auto_dispense = true;
+            flash_leds(led_purple, 7, 1);
+            automatic_dispense_oz = function_4_oz;
+            button_press_multiplier ++;
+            break;    
+          case 5:      
+            Serial.print("Function 5: ");
+            Serial.print(function_5_oz);
+            Serial.println("oz");
+            auto_dispense = true;
+            flash_leds(led_purple, 7, 1);
+            automatic_dispense_oz = function_5_oz;
+            button_press_multiplier ++;
+            break;   
+          case 6:
+            Serial.println("Function 6: Off");
+            auto_dispense = false;
+            case_off = true;
+            button_press_multiplier ++;
+            break;
+          case 7:
+            Serial.println("Function 7: empty");            
+            button_press_multiplier ++;
+            break;
+          case 8:
+            Serial.println("Function 8: publish/retrieve data");
+            flash_leds(led_green, 5, 1);
+            publish_now();
+            button_press_multiplier ++;
+            break;                              
+          default: // default case if none of the above cases match
+            break;
+        }
+      }
+      else{ // publish data if the button has been held down but data has not yet been imported from Google Sheets
+        if (!case_off) {
+          flash_leds(led_green, 5, 1);
+          case_off = true;
+          publish_now();
+        }
+      }
+    }
+  }
+
+
+  // Button has been released
+  if (switch1_state == LOW && button_down) {
+    button_down = false;
+    if (button_holding) {
+      button_holding = false;
+
+      // if automatically dispensing, calculate how long to leave water on
+      if (auto_dispense) {
+        automatic_dispense_time = automatic_dispense_oz / (conversion_factor * 0.001 * 128); 
+        automatic_dispense_pulses = (uint32_t)automatic_dispense_oz * flow_pulses_per_gallon / 128;
+        Serial.print("automatically dispensing ");
+        Serial.print(automatic_dispense_oz);
+        Serial.print("oz (");
+        if (flow_meter_installed) {
+          Serial.print(automatic_dispense_pulses);
+          Serial.println(" flow meter pulses)");
+        }
+        else {
+          Serial.print(automatic_dispense_time);
+          Serial.println("ms)");
+        }
+      }
+
+      // when button is released, turn on water unless button was held down to the 'off' function 
+      if (case_off) { 
+        button_pressed = false;
+        button_press_multiplier = 1;
+        Serial.println("automatic dispense off");
+        case_off = false;
+      }
+      else {
+        turn_on();  
+      }
+    }
+  } // end of button press
+  
+
+  // If automatically dispensing with a flow meter, turn valve off once the flow meter has measured the amount selected (task_auto_dispense turns it off after the calculated dispense time otherwise, or after flow_time_limit times that if the flow meter stops counting)
+  if (valve_open && auto_dispense && flow_meter_installed) {
+    if (flow_pulses - valve_open_pulses >= automatic_dispense_pulses) {turn_off();}
+  }
+
+
+  // IR sensor has been triggered (sensor states are filtered to prevent false triggers, so no need to check them again here)
+  if ((ir1_state == LOW || ir2_state == LOW) && !button_pressed) {
+    turn_on();
+    sensor_triggered = true;
+    if(display_orange_led) {orange_led = true;}
+  }
+
+
+  // Display orange LEDs if object out of sensor range when water is on, and blue LEDs once it is back in range
+  if (sensor_triggered && display_orange_led) {
+    if (input_filters[input_ir1].raw || input_filters[input_ir2].raw) {
+      if (led_on) {show_leds(led_blue);}
+    }
+    else {
+      show_leds(led_orange);
+    }
+  }
+
+
+  // Turn off water when in IR sensor mode (once neither sensor has detected an object for turn_off_delay)
+  if (sensor_triggered && (ir1_state == HIGH && ir2_state == HIGH)) {
+    turn_off();
+  }
+
+
+  // Carry out background work once the sensors and pushbutton have been handled
+  section_start = hal_cycles();
+  update_sinks();   // carry out the next step of any publish in progress and keep the MQTT connection open
+  profile_end(profile_publish, section_start);
+  update_time_sync(); // pick up the answer from the NTP server if it has arrived
+  if (network_started && !valve_open && !display_on && !button_down && !input_pending()) { // requests wait while the dispenser is being used
+    web_server.handleClient(); // answer any request for the status, config or metrics (only handed over once all of it has arrived, see complete_request_server)
+  }
+  section_start = hal_cycles();
+  run_tasks();      // run the next scheduled task that is due
+  profile_end(profile_tasks, section_start);
+
+  if (!network_started && hal_wifi_connected()) {start_network();}
 
+  record_latency(loop_latency, hal_micros() - pass_start);
+  idle_until_next_task(); // wait for the next scheduled task if there is nothing else to do
 }